@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "kmodchardev.h"
+
+#define ASSERT2(cond, str_cond) \
+    if (!(cond)) \
+        { fprintf(stderr, "Assertion failed: '" str_cond "' in %s:%d, errno %d\n", __FILE__, __LINE__, errno); abort(); }
+#define ASSERT(cond) ASSERT2(cond, #cond)
+
+// Scratch device benchmark: sequential and random pwrite(2)/pread(2) of
+// a fixed amount of data within an area at the start of each target, to
+// compare /dev/kcdev0 with a file on tmpfs (/dev/shm/...) and with a brd
+// RAM disk (/dev/ram0) for instance. The block size is swept by powers of
+// 4; every run is one CSV line. The writes go first so that the reads find
+// the data in memory; the targets are emptied before the writes. With
+// -B the kcdev targets get the blocks in batches through one ioctl each,
+// the other targets keep one syscall per block. With -j the runs are
+// repeated with 1, 2, 4... up to the given number of threads, each
+// with its own slice of the area and of the data, to see how the
+// throughput scales with the concurrent access to one target.
+
+enum op {
+    OP_SEQ_WRITE,
+    OP_SEQ_READ,
+    OP_RAND_WRITE,
+    OP_RAND_READ,
+    OP_COUNT,
+};
+
+static const char *op_names[OP_COUNT] = {
+    "seqwrite",
+    "seqread",
+    "randwrite",
+    "randread",
+};
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned long long xorshift(unsigned long long *state) {
+    unsigned long long x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// Frees whatever the previous run allocated
+static void empty(int fd) {
+    struct stat st;
+
+    ASSERT(fstat(fd, &st) == 0);
+
+    if (S_ISREG(st.st_mode)) {
+        ASSERT(ftruncate(fd, 0) == 0);
+    } else if (S_ISCHR(st.st_mode)) {
+        ioctl(fd, KCDEV_IOCTL_TRUNCATE, 0); // Not a kcdev if it fails
+    }
+}
+
+static bool is_kcdev(int fd) {
+    struct kcdev_info info;
+    struct stat st;
+
+    ASSERT(fstat(fd, &st) == 0);
+
+    return S_ISCHR(st.st_mode) && ioctl(fd, KCDEV_IOCTL_GET_INFO, &info) == 0;
+}
+
+static void submit(int fd, struct kcdev_op *ops, unsigned count) {
+    struct kcdev_batch batch = { .ops = (__u64)(unsigned long)ops, .count = count };
+    unsigned i;
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_BATCH, &batch) == (int)count);
+
+    for (i = 0; i < count; ++i)
+        ASSERT(ops[i].result == (__s64)ops[i].len);
+}
+
+// One thread of a run, in its own slice of the area
+struct worker {
+    pthread_t thread;
+    pthread_barrier_t *start;
+    int fd;
+    enum op op;
+    char *buffer;
+    size_t block;
+    size_t total;
+    off_t base;
+    size_t area;
+    struct kcdev_op *ops;
+    unsigned batch;
+    unsigned long long seed;
+    unsigned long long start_ns;
+    unsigned long long end_ns;
+};
+
+static void *work(void *arg) {
+    struct worker *w = arg;
+    unsigned long long state = w->seed;
+    bool write = w->op == OP_SEQ_WRITE || w->op == OP_RAND_WRITE;
+    size_t blocks = w->area / w->block;
+    size_t done;
+    off_t off = 0;
+    unsigned queued = 0;
+
+    pthread_barrier_wait(w->start);
+    w->start_ns = now_ns();
+
+    for (done = 0; done < w->total; done += w->block) {
+        ssize_t n;
+
+        if (w->op == OP_RAND_WRITE || w->op == OP_RAND_READ)
+            off = (off_t)(xorshift(&state) % blocks) * w->block;
+        else if ((size_t)off + w->block > w->area)
+            off = 0;
+
+        if (w->batch > 1) {
+            w->ops[queued].op = write ? KCDEV_OP_WRITE : KCDEV_OP_READ;
+            w->ops[queued].offset = w->base + off;
+            w->ops[queued].len = w->block;
+            w->ops[queued].buf = (__u64)(unsigned long)w->buffer;
+
+            if (++queued == w->batch) {
+                submit(w->fd, w->ops, queued);
+                queued = 0;
+            }
+        } else {
+            if (write)
+                n = pwrite(w->fd, w->buffer, w->block, w->base + off);
+            else
+                n = pread(w->fd, w->buffer, w->block, w->base + off);
+
+            ASSERT(n == (ssize_t)w->block);
+        }
+
+        off += w->block;
+    }
+
+    if (queued)
+        submit(w->fd, w->ops, queued);
+
+    w->end_ns = now_ns();
+
+    return NULL;
+}
+
+static void run(const char *target, struct worker *workers, unsigned threads, enum op op, size_t block,
+        size_t total, size_t area) {
+    pthread_barrier_t start_barrier;
+    unsigned long long start = ~0ull;
+    unsigned long long end = 0;
+    double elapsed;
+    unsigned t;
+
+    // From the first thread starting to the last one done
+    ASSERT(pthread_barrier_init(&start_barrier, NULL, threads) == 0);
+
+    for (t = 0; t < threads; ++t) {
+        struct worker *w = &workers[t];
+
+        w->start = &start_barrier;
+        w->op = op;
+        w->block = block;
+        w->total = total / threads;
+        w->area = area / threads;
+        w->base = (off_t)w->area * t;
+        w->seed = 0x9e3779b97f4a7c15ull * (t + 1);
+
+        ASSERT(pthread_create(&w->thread, NULL, work, w) == 0);
+    }
+
+    for (t = 0; t < threads; ++t) {
+        ASSERT(pthread_join(workers[t].thread, NULL) == 0);
+
+        if (workers[t].start_ns < start)
+            start = workers[t].start_ns;
+        if (workers[t].end_ns > end)
+            end = workers[t].end_ns;
+    }
+
+    elapsed = (end - start)*1e-9;
+    total = workers[0].total * threads;
+
+    pthread_barrier_destroy(&start_barrier);
+
+    fprintf(stdout, "%s,%s,%zu,%u,%zu,%.6f,%.1f,%.0f\n",
+        target, op_names[op], block, threads, total, elapsed,
+        total/elapsed/(1 << 20), total/block/elapsed);
+    fflush(stdout);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-t total MiB] [-a area MiB] [-s min block] [-S max block] [-f block factor]\n"
+        "          [-B ops per batch] [-j max threads] target...\n"
+        "  targets: /dev/" KCDEV_NAME "0, a file on tmpfs, /dev/ram0...\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    size_t total = 256ul << 20;
+    size_t area = 64ul << 20;
+    size_t min_block = 512;
+    size_t max_block = 1ul << 20;
+    size_t factor = 4;
+    unsigned batch = 1;
+    unsigned max_threads = 1;
+    unsigned threads;
+    struct worker *workers;
+    size_t block;
+    unsigned t;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "t:a:s:S:f:B:j:")) != -1) {
+        switch (opt) {
+        case 't': total = strtoull(optarg, NULL, 0) << 20; break;
+        case 'a': area = strtoull(optarg, NULL, 0) << 20; break;
+        case 's': min_block = strtoull(optarg, NULL, 0); break;
+        case 'S': max_block = strtoull(optarg, NULL, 0); break;
+        case 'f': factor = strtoull(optarg, NULL, 0); break;
+        case 'B': batch = strtoul(optarg, NULL, 0); break;
+        case 'j': max_threads = strtoul(optarg, NULL, 0); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind == argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    ASSERT(min_block > 0 && min_block <= max_block && max_block <= area && factor > 1);
+    ASSERT(batch > 0 && batch <= KCDEV_BATCH_MAX);
+    ASSERT(max_threads > 0 && max_block <= area / max_threads);
+
+    workers = calloc(max_threads, sizeof(*workers));
+    ASSERT(workers);
+
+    for (t = 0; t < max_threads; ++t) {
+        workers[t].buffer = aligned_alloc(4096, max_block);
+        ASSERT(workers[t].buffer);
+        memset(workers[t].buffer, 0x5a, max_block);
+        workers[t].ops = calloc(batch, sizeof(struct kcdev_op));
+        ASSERT(workers[t].ops);
+    }
+
+    fprintf(stdout, "target,op,block,threads,bytes,seconds,mb_s,iops\n");
+
+    for (i = optind; i < argc; ++i) {
+        int fd = open(argv[i], O_RDWR | O_CREAT, 0600);
+        unsigned target_batch = 1;
+        char label[256];
+
+        if (fd == -1) {
+            fprintf(stderr, "Couldn't open %s: %#04x\n", argv[i], errno);
+            continue;
+        }
+
+        if (is_kcdev(fd) && batch > 1) {
+            target_batch = batch;
+            for (t = 0; t < max_threads; ++t) {
+                for (unsigned j = 0; j < batch; ++j)
+                    workers[t].ops[j].fd = KCDEV_FD_SELF;
+            }
+        }
+
+        for (t = 0; t < max_threads; ++t) {
+            workers[t].fd = fd;
+            workers[t].batch = target_batch;
+        }
+
+        if (target_batch > 1)
+            snprintf(label, sizeof label, "%s+batch%u", argv[i], target_batch);
+        else
+            snprintf(label, sizeof label, "%s", argv[i]);
+
+        for (threads = 1; threads <= max_threads; threads = threads < max_threads && threads*2 > max_threads ? max_threads : threads*2) {
+            for (block = min_block; block <= max_block; block *= factor) {
+                enum op op;
+
+                empty(fd);
+
+                for (op = 0; op < OP_COUNT; ++op)
+                    run(label, workers, threads, op, block, total, area);
+            }
+
+            if (threads == max_threads)
+                break;
+        }
+
+        empty(fd);
+        close(fd);
+    }
+
+    for (t = 0; t < max_threads; ++t) {
+        free(workers[t].ops);
+        free(workers[t].buffer);
+    }
+
+    free(workers);
+
+    return 0;
+}
@@ -8,52 +8,2052 @@
 #include <linux/cred.h>
 #include <linux/thread_info.h>
 #include <linux/sched.h>
+#include <linux/sched/signal.h>
 #include <linux/mm.h>
 #include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/xarray.h>
+#include <linux/rwsem.h>
+#include <linux/uio.h>
+#include <linux/huge_mm.h>
+#include <linux/vmalloc.h>
+#include <linux/kthread.h>
+#include <linux/mmu_context.h>
+#include <linux/sched/mm.h>
+#include <linux/eventfd.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>
+#include <linux/hash.h>
+#include <linux/xxhash.h>
+#include <linux/lz4.h>
+#include <linux/shrinker.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,17,0)
+#include <linux/pfn_t.h>
+#endif
 
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/errno.h>
 #include <linux/fs.h>
+#include <linux/file.h>
 #include <linux/proc_fs.h>
 #include <linux/uaccess.h>
 
 #include "kmodchardev.h"
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,1,0)
+#define ITER_DEST   READ
+#define ITER_SOURCE WRITE
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+#define kthread_use_mm   use_mm
+#define kthread_unuse_mm unuse_mm
+#endif
+
 MODULE_LICENSE("GPL v2");
 MODULE_AUTHOR("kromych");
 MODULE_DESCRIPTION("kcdev char device example");
 MODULE_VERSION("0.01");
 
-static bool     dump_stack_trace = false;
-static ulong    kcdev_count = KCDEV_MAX_DEVICES;
+static bool     dump_stack_trace = false;
+static ulong    kcdev_count = KCDEV_MAX_DEVICES;
+static unsigned long long kcdev_capacity = KCDEV_DEFAULT_CAPACITY;
+static ulong    kcdev_async_min = 1ul << 20;
+static ulong    kcdev_dedup_ms = 0;
+static bool     kcdev_compress = true;
+
+module_param(dump_stack_trace, bool, 0644); // Permissions in /sysfs
+MODULE_PARM_DESC(dump_stack_trace, "Dumping stack traces");
+
+module_param(kcdev_count, ulong, 00); // Permissions in /sysfs
+MODULE_PARM_DESC(kcdev_count, "Number of devices");
+
+module_param(kcdev_capacity, ullong, 0444); // Permissions in /sysfs
+MODULE_PARM_DESC(kcdev_capacity, "Capacity of each device in bytes, the memory is allocated on write");
+
+module_param(kcdev_async_min, ulong, 0644); // Permissions in /sysfs
+MODULE_PARM_DESC(kcdev_async_min, "Size in bytes from which the AIO and io_uring requests complete from a workqueue, 0 for never");
+
+module_param(kcdev_dedup_ms, ulong, 0644); // Permissions in /sysfs
+MODULE_PARM_DESC(kcdev_dedup_ms, "Period in ms of the page deduplication passes in the background, 0 for none");
+
+module_param(kcdev_compress, bool, 0644); // Permissions in /sysfs
+MODULE_PARM_DESC(kcdev_compress, "Compressing the cold pages under memory pressure");
+
+static int	         kcdev_open(struct inode *, struct file *);
+static ssize_t	     kcdev_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t	     kcdev_write_iter(struct kiocb *, struct iov_iter *);
+static loff_t	     kcdev_llseek(struct file *, loff_t, int);
+static int	         kcdev_release(struct inode *, struct file *);
+static int	         kcdev_mmap(struct file *, struct vm_area_struct *);
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static unsigned long kcdev_get_unmapped_area(struct file *, unsigned long, unsigned long, unsigned long,
+                                             unsigned long);
+#endif
+static long          kcdev_ioctl(struct file *, unsigned int, unsigned long);
+static __poll_t      kcdev_poll(struct file *, struct poll_table_struct *);
+
+static const struct file_operations kcdev_file_ops = {
+    .owner             = THIS_MODULE,
+	.open              = kcdev_open,
+	.read_iter         = kcdev_read_iter,
+	.write_iter        = kcdev_write_iter,
+    .llseek            = kcdev_llseek,
+	.release           = kcdev_release,
+	.mmap              = kcdev_mmap,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    .get_unmapped_area = kcdev_get_unmapped_area,
+#endif
+    .unlocked_ioctl    = kcdev_ioctl,
+    .poll              = kcdev_poll,
+};
+
+static dev_t            kcdev_num;
+static struct cdev      kcdev;
+static struct class*    kcdev_class;
+static struct workqueue_struct *kcdev_wq;
+
+// The storage of a minor: the pages indexed by the offset in pages,
+// allocated on the first write to them. The holes read as zeros.
+//
+// The reads and the writes lock the byte ranges they touch, see struct
+// kcdev_range, so that those of the different parts of the store run
+// in parallel.
+//
+// The user mappings of all the files opened on the minor hang off its
+// own address space so that they can be zapped when a page changes.
+// The faults can't take the range locks: the read() and write() paths
+// may fault on a mapping while holding them. They take fault_lock
+// instead, never held while touching the user memory, exclusive around
+// putting the pages in or taking them out together with zapping the
+// mappings.
+//
+// Under memory pressure the cold pages are compressed, see struct
+// kcdev_zpage: the entries of the store are either pages or compressed
+// pages, brought back on the next access.
+struct kcdev_dev {
+    struct xarray pages;
+    spinlock_t range_lock;
+    struct list_head ranges; // Locked
+    wait_queue_head_t range_wait;
+    struct rw_semaphore fault_lock;
+    struct address_space mapping;
+    atomic64_t size; // Up to the last byte written, through the mappings too
+    atomic_long_t nr_pages; // The compressed ones too
+    atomic_long_t nr_compressed;
+    atomic64_t compressed_bytes;
+    atomic64_t compressions;
+    atomic64_t decompressions;
+    atomic64_t decompress_ns;
+    atomic64_t decompress_ns_max;
+};
+
+static struct kcdev_dev* kcdev_devs;
+
+// A page compressed with LZ4, stored tagged in place of the page. The
+// clones share them like the pages, hence the reference count.
+struct kcdev_zpage {
+    refcount_t ref;
+    unsigned int size;
+    u8 data[];
+};
+
+#define KCDEV_ENTRY_COMPRESSED  1
+// Set on the access to a page, cleared by the shrinker: the pages
+// found without it the next time around are cold
+#define KCDEV_MARK_HOT          XA_MARK_0
+
+static bool kcdev_entry_compressed(void *entry)
+{
+    return xa_pointer_tag(entry) == KCDEV_ENTRY_COMPRESSED;
+}
+
+static void kcdev_zpage_put(struct kcdev_zpage *zpage)
+{
+    if (refcount_dec_and_test(&zpage->ref))
+        kfree(zpage);
+}
+
+// Drops an entry taken out of the store
+static void kcdev_dev_put_entry(struct kcdev_dev *dev, void *entry)
+{
+    if (kcdev_entry_compressed(entry)) {
+        struct kcdev_zpage *zpage = xa_untag_pointer(entry);
+
+        atomic_long_dec(&dev->nr_compressed);
+        atomic64_sub(zpage->size, &dev->compressed_bytes);
+        kcdev_zpage_put(zpage);
+    } else {
+        __free_page(entry);
+    }
+
+    atomic_long_dec(&dev->nr_pages);
+}
+
+// A byte range of the store locked by a reader or a writer, on the
+// stack of the owner. The readers share the ranges, the writers don't
+// share them with anyone. The held ranges are few, one per thread in
+// the store at most, a list does.
+struct kcdev_range {
+    struct list_head entry;
+    u64 start;
+    u64 end; // Exclusive
+    bool write;
+};
+
+// The submission and completion rings of a file, see
+// KCDEV_IOCTL_RING_SETUP. The kernel keeps its own copies of the
+// indexes it advances, the ones in the shared memory are only written.
+struct kcdev_ring {
+    void *mem; // vmalloc_user(), struct kcdev_ring_ctl first
+    size_t size;
+    struct kcdev_ring_ctl *ctl;
+    struct kcdev_sqe *sqes;
+    struct kcdev_cqe *cqes;
+    u32 sq_entries;
+    u32 cq_entries;
+    u32 sq_head;
+    u32 cq_tail;
+    struct mutex lock; // Taken by the submitters without the polling thread
+    wait_queue_head_t cq_wait;
+    wait_queue_head_t sq_wait; // The polling thread sleeps there
+    struct eventfd_ctx *eventfd;
+    struct task_struct *poller;
+    unsigned long idle; // In jiffies
+    struct mm_struct *mm; // Of the user buffers, for the polling thread
+    struct file *file;
+};
+
+struct kcdev_file {
+    struct kcdev_dev *dev;
+    struct mutex ring_lock;
+    struct kcdev_ring *ring; // Set once
+};
+
+static struct kcdev_dev *kcdev_file_dev(struct file *fp)
+{
+    return ((struct kcdev_file *)fp->private_data)->dev;
+}
+
+#define KCDEV_CAPACITY_PAGES    DIV_ROUND_UP(kcdev_capacity, PAGE_SIZE)
+
+static void kcdev_dev_init(struct kcdev_dev *dev)
+{
+    xa_init(&dev->pages);
+    spin_lock_init(&dev->range_lock);
+    INIT_LIST_HEAD(&dev->ranges);
+    init_waitqueue_head(&dev->range_wait);
+    init_rwsem(&dev->fault_lock);
+    address_space_init_once(&dev->mapping);
+    atomic64_set(&dev->size, 0);
+    atomic_long_set(&dev->nr_pages, 0);
+    atomic_long_set(&dev->nr_compressed, 0);
+    atomic64_set(&dev->compressed_bytes, 0);
+    atomic64_set(&dev->compressions, 0);
+    atomic64_set(&dev->decompressions, 0);
+    atomic64_set(&dev->decompress_ns, 0);
+    atomic64_set(&dev->decompress_ns_max, 0);
+}
+
+static void kcdev_dev_extend(struct kcdev_dev *dev, loff_t end)
+{
+    s64 size = atomic64_read(&dev->size);
+
+    while (size < end && !atomic64_try_cmpxchg(&dev->size, &size, end))
+        ;
+}
+
+// Zaps the user mappings of the pages from index on, 0 nr for all.
+// The private copies made on write go too only when even_cows.
+static void kcdev_dev_unmap(struct kcdev_dev *dev, pgoff_t index, pgoff_t nr, bool even_cows)
+{
+    if (mapping_mapped(&dev->mapping))
+        unmap_mapping_range(&dev->mapping, (loff_t)index << PAGE_SHIFT, (loff_t)nr << PAGE_SHIFT, even_cows);
+}
+
+// Frees the pages from index on, they must not be mapped anymore
+static void kcdev_dev_free_pages(struct kcdev_dev *dev, pgoff_t index)
+{
+    void *entry;
+    unsigned long i;
+
+    xa_for_each_start(&dev->pages, i, entry, index) {
+        xa_erase(&dev->pages, i);
+        kcdev_dev_put_entry(dev, entry);
+        cond_resched();
+    }
+}
+
+static void kcdev_dev_destroy(struct kcdev_dev *dev)
+{
+    kcdev_dev_free_pages(dev, 0);
+    xa_destroy(&dev->pages);
+}
+
+static struct page *kcdev_dev_decompress(struct kcdev_dev *dev, pgoff_t index, bool nowait);
+
+// Fills the hole at index with 1 << order zeroed pages, a physically
+// contiguous run for the huge mappings when order isn't 0. The entries
+// already there are kept. The zero page may be mapped over the hole,
+// that goes. Returns the page at index with a reference taken, called
+// without fault_lock.
+static struct page *kcdev_dev_fill(struct kcdev_dev *dev, pgoff_t index, unsigned int order)
+{
+    gfp_t gfp = GFP_KERNEL | __GFP_ZERO;
+    pgoff_t nr = 1ul << order;
+    struct page *pages;
+    struct page *page;
+    struct page *old;
+    pgoff_t i;
+    int ret = 0;
+
+    if (order)
+        gfp |= __GFP_NOWARN | __GFP_NORETRY;
+
+    pages = alloc_pages(gfp, order);
+    if (!pages)
+        return ERR_PTR(-ENOMEM);
+
+    // Freed and shared one by one from now on
+    if (order)
+        split_page(pages, order);
+
+    down_write(&dev->fault_lock);
+
+    for (i = 0; i < nr; ++i) {
+        old = ret ? NULL : xa_cmpxchg(&dev->pages, index + i, NULL, pages + i, GFP_KERNEL);
+
+        if (ret || old) {
+            __free_page(pages + i);
+            if (xa_is_err(old))
+                ret = xa_err(old);
+        } else
+            atomic_long_inc(&dev->nr_pages);
+    }
+
+    kcdev_dev_unmap(dev, index, nr, false);
+
+    page = xa_load(&dev->pages, index);
+    if (page && !kcdev_entry_compressed(page))
+        get_page(page);
+
+    up_write(&dev->fault_lock);
+
+    if (!page)
+        return ERR_PTR(ret ? ret : -ENOMEM);
+
+    if (kcdev_entry_compressed(page))
+        return kcdev_dev_decompress(dev, index, false);
+
+    return page;
+}
+
+static bool kcdev_range_trylock(struct kcdev_dev *dev, struct kcdev_range *range)
+{
+    struct kcdev_range *held;
+
+    spin_lock(&dev->range_lock);
+
+    list_for_each_entry(held, &dev->ranges, entry) {
+        if (held->start < range->end && range->start < held->end && (held->write || range->write)) {
+            spin_unlock(&dev->range_lock);
+            return false;
+        }
+    }
+
+    list_add(&range->entry, &dev->ranges);
+
+    spin_unlock(&dev->range_lock);
+
+    return true;
+}
+
+// Locks [start, end), waits for the overlapping ranges to go unless
+// nowait. EAGAIN then.
+static int kcdev_range_lock(struct kcdev_dev *dev, struct kcdev_range *range, u64 start, u64 end, bool write,
+                            bool nowait)
+{
+    range->start = start;
+    range->end = end;
+    range->write = write;
+
+    if (nowait)
+        return kcdev_range_trylock(dev, range) ? 0 : -EAGAIN;
+
+    wait_event(dev->range_wait, kcdev_range_trylock(dev, range));
+
+    return 0;
+}
+
+static void kcdev_range_unlock(struct kcdev_dev *dev, struct kcdev_range *range)
+{
+    spin_lock(&dev->range_lock);
+    list_del(&range->entry);
+    spin_unlock(&dev->range_lock);
+
+    if (wq_has_sleeper(&dev->range_wait))
+        wake_up_all(&dev->range_wait);
+}
+
+// Not for the shrinker to compress the page at index the next time
+// around. Written only if not set yet, the pages are read a lot.
+static void kcdev_dev_mark_hot(struct kcdev_dev *dev, pgoff_t index)
+{
+    if (!xa_get_mark(&dev->pages, index, KCDEV_MARK_HOT))
+        xa_set_mark(&dev->pages, index, KCDEV_MARK_HOT);
+}
+
+// Puts the page back in place of the compressed one at index. Returns
+// the page at index with a reference taken, NULL if there is none: a
+// compressed page may have been brought back or freed meanwhile.
+static struct page *kcdev_dev_decompress(struct kcdev_dev *dev, pgoff_t index, bool nowait)
+{
+    struct kcdev_zpage *zpage;
+    struct page *page;
+    void *entry;
+    void *old;
+    void *addr;
+    u64 start;
+    s64 ns;
+    int size;
+
+    down_read(&dev->fault_lock);
+
+    entry = xa_load(&dev->pages, index);
+    if (!entry || !kcdev_entry_compressed(entry)) {
+        if (entry)
+            get_page(entry);
+        up_read(&dev->fault_lock);
+        return entry;
+    }
+
+    zpage = xa_untag_pointer(entry);
+    refcount_inc(&zpage->ref);
+
+    up_read(&dev->fault_lock);
+
+    page = alloc_page(nowait ? GFP_NOWAIT | __GFP_NOWARN : GFP_KERNEL);
+    if (!page) {
+        kcdev_zpage_put(zpage);
+        return ERR_PTR(nowait ? -EAGAIN : -ENOMEM);
+    }
+
+    start = ktime_get_ns();
+
+    addr = kmap_local_page(page);
+    size = LZ4_decompress_safe(zpage->data, addr, zpage->size, PAGE_SIZE);
+    kunmap_local(addr);
+
+    ns = ktime_get_ns() - start;
+
+    if (size != PAGE_SIZE) {
+        __free_page(page);
+        kcdev_zpage_put(zpage);
+        return ERR_PTR(-EIO);
+    }
+
+    down_write(&dev->fault_lock);
+
+    old = xa_cmpxchg(&dev->pages, index, entry, page, GFP_KERNEL);
+    if (old == entry) {
+        s64 max = atomic64_read(&dev->decompress_ns_max);
+
+        atomic_long_dec(&dev->nr_compressed);
+        atomic64_sub(zpage->size, &dev->compressed_bytes);
+        atomic64_inc(&dev->decompressions);
+        atomic64_add(ns, &dev->decompress_ns);
+        while (max < ns && !atomic64_try_cmpxchg(&dev->decompress_ns_max, &max, ns))
+            ;
+
+        xa_set_mark(&dev->pages, index, KCDEV_MARK_HOT);
+        kcdev_zpage_put(zpage); // Of the store
+        get_page(page);
+    } else {
+        __free_page(page);
+
+        if (xa_is_err(old))
+            page = ERR_PTR(xa_err(old));
+        else if (old && kcdev_entry_compressed(old))
+            page = ERR_PTR(-EAGAIN); // Compressed again, the faults retry
+        else if ((page = old))
+            get_page(page);
+    }
+
+    up_write(&dev->fault_lock);
+
+    kcdev_zpage_put(zpage);
+
+    return page;
+}
+
+// The page at index for read() and write(), brought back if compressed.
+// NULL for a hole. The range lock doesn't keep the page from going away:
+// a fault unsharing it doesn't take it. So the page comes with a
+// reference taken under the xarray lock, every removal goes through it
+// before the page is freed.
+static struct page *kcdev_dev_load(struct kcdev_dev *dev, pgoff_t index, bool nowait)
+{
+    struct page *page;
+
+    xa_lock(&dev->pages);
+    page = xa_load(&dev->pages, index);
+    if (page && !kcdev_entry_compressed(page))
+        get_page(page);
+    xa_unlock(&dev->pages);
+
+    if (!page)
+        return NULL;
+
+    if (kcdev_entry_compressed(page))
+        return kcdev_dev_decompress(dev, index, nowait);
+
+    kcdev_dev_mark_hot(dev, index);
+
+    return page;
+}
+
+// Returns the page at index with a reference taken, allocating a zeroed
+// one if there is none
+static struct page *kcdev_dev_get_page(struct kcdev_dev *dev, pgoff_t index, bool nowait)
+{
+    struct page *page = kcdev_dev_load(dev, index, nowait);
+
+    if (page)
+        return page;
+
+    if (nowait)
+        return ERR_PTR(-EAGAIN);
+
+    page = kcdev_dev_fill(dev, index, 0);
+    if (!IS_ERR(page))
+        kcdev_dev_mark_hot(dev, index);
+
+    return page;
+}
+
+// A page is shared when another minor has it after a clone, or a
+// private mapping. The ones shared are never written to: the writers
+// get their own copy first, see kcdev_dev_unshare(). A read() copying
+// out of the page holds a reference too, at worst the page is copied
+// for nothing.
+static bool kcdev_page_shared(struct page *page)
+{
+    return page_count(page) > 1;
+}
+
+// The same for a page the caller holds a reference to
+static bool kcdev_page_shared_held(struct page *page)
+{
+    return page_count(page) > 2;
+}
+
+// Gives the minor its own copy of the page at index if it's shared,
+// zapping the mappings of the old one. Returns the page at index with a
+// reference taken, NULL if there is none: the old page goes away once
+// the other holders let it go, whatever range the caller has locked.
+static struct page *kcdev_dev_unshare(struct kcdev_dev *dev, pgoff_t index, bool nowait)
+{
+    struct page *page;
+    struct page *copy;
+    struct page *old;
+
+    down_read(&dev->fault_lock);
+
+    page = xa_load(&dev->pages, index);
+    if (page && kcdev_entry_compressed(page))
+        page = NULL; // Not for read() and write(), the faults look again
+
+    if (page)
+        get_page(page);
+
+    if (!page || !kcdev_page_shared_held(page)) {
+        up_read(&dev->fault_lock);
+        return page;
+    }
+
+    up_read(&dev->fault_lock);
+
+    copy = nowait ? NULL : alloc_page(GFP_KERNEL);
+    if (!copy) {
+        put_page(page);
+        return ERR_PTR(nowait ? -EAGAIN : -ENOMEM);
+    }
+
+    copy_highpage(copy, page);
+
+    down_write(&dev->fault_lock);
+
+    old = xa_cmpxchg(&dev->pages, index, page, copy, GFP_KERNEL);
+    if (old == page) {
+        kcdev_dev_unmap(dev, index, 1, false);
+        put_page(page); // Of the store
+        get_page(copy);
+    } else {
+        // Unshared or gone meanwhile
+        __free_page(copy);
+        copy = xa_is_err(old) ? ERR_PTR(xa_err(old)) : old;
+        if (copy && kcdev_entry_compressed(copy))
+            copy = NULL; // As above
+        if (!IS_ERR_OR_NULL(copy))
+            get_page(copy);
+    }
+
+    up_write(&dev->fault_lock);
+
+    put_page(page);
+
+    return copy;
+}
+
+// Copies out up to the size, a page at a time. Returns the number of
+// bytes copied, less than asked at the end of the data or when the
+// user buffer faults. EAGAIN if nowait and a writer has the range.
+static ssize_t kcdev_dev_read(struct kcdev_dev *dev, loff_t pos, struct iov_iter *to, bool nowait)
+{
+    size_t size = iov_iter_count(to);
+    size_t done = 0;
+    struct kcdev_range range;
+    loff_t dev_size;
+    int ret;
+
+    if (pos < 0)
+        return -EINVAL;
+
+    if (pos >= kcdev_capacity || !size)
+        return 0;
+
+    // The size may change until the range is locked
+    ret = kcdev_range_lock(dev, &range, pos, pos + min_t(u64, size, kcdev_capacity - pos), false, nowait);
+    if (ret)
+        return ret;
+
+    dev_size = atomic64_read(&dev->size);
+    if (pos < dev_size)
+        size = min_t(u64, size, dev_size - pos);
+    else
+        size = 0;
+
+    while (done < size) {
+        size_t off = (pos + done) & ~PAGE_MASK;
+        size_t chunk = min_t(size_t, size - done, PAGE_SIZE - off);
+        struct page *page = kcdev_dev_load(dev, (pos + done) >> PAGE_SHIFT, nowait);
+        size_t copied;
+
+        if (IS_ERR(page)) {
+            ret = PTR_ERR(page);
+            break;
+        }
+
+        if (page) {
+            copied = copy_page_to_iter(page, off, chunk, to);
+            put_page(page);
+        } else
+            copied = iov_iter_zero(chunk, to);
+
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+
+    kcdev_range_unlock(dev, &range);
+
+    if (!done && size)
+        return ret ? ret : -EFAULT;
+
+    return done;
+}
+
+// Copies in up to the capacity, allocating the pages as needed. If
+// nowait, stops with EAGAIN at a page to allocate or if someone else
+// has the range.
+static ssize_t kcdev_dev_write(struct kcdev_dev *dev, loff_t pos, struct iov_iter *from, bool nowait)
+{
+    size_t size = iov_iter_count(from);
+    size_t done = 0;
+    struct kcdev_range range;
+    ssize_t ret = 0;
+
+    if (pos < 0)
+        return -EINVAL;
+
+    if (!size)
+        return 0;
+
+    if (pos >= kcdev_capacity)
+        return -ENOSPC;
+
+    size = min_t(u64, size, kcdev_capacity - pos);
+
+    ret = kcdev_range_lock(dev, &range, pos, pos + size, true, nowait);
+    if (ret)
+        return ret;
+
+    while (done < size) {
+        size_t off = (pos + done) & ~PAGE_MASK;
+        size_t chunk = min_t(size_t, size - done, PAGE_SIZE - off);
+        struct page *page = kcdev_dev_get_page(dev, (pos + done) >> PAGE_SHIFT, nowait);
+        size_t copied;
+
+        if (!IS_ERR(page) && kcdev_page_shared_held(page)) {
+            put_page(page);
+            page = kcdev_dev_unshare(dev, (pos + done) >> PAGE_SHIFT, nowait);
+        }
+
+        if (IS_ERR_OR_NULL(page)) {
+            ret = page ? PTR_ERR(page) : -ENOMEM;
+            break;
+        }
+
+        copied = copy_page_from_iter(page, off, chunk, from);
+        put_page(page);
+
+        done += copied;
+        if (copied < chunk) {
+            ret = -EFAULT;
+            break;
+        }
+    }
+
+    kcdev_dev_extend(dev, pos + done);
+
+    kcdev_range_unlock(dev, &range);
+
+    return done ? done : ret;
+}
+
+static int kcdev_dev_truncate(struct kcdev_dev *dev, u64 size)
+{
+    struct kcdev_range range;
+    struct page *page;
+
+    if (size > kcdev_capacity)
+        return -EINVAL;
+
+    // From the page zeroed at the end on
+    kcdev_range_lock(dev, &range, round_down(size, PAGE_SIZE), U64_MAX, true, false);
+
+    // Not zeroed compressed or under a clone
+    if (size & ~PAGE_MASK) {
+        page = kcdev_dev_load(dev, size >> PAGE_SHIFT, false);
+        if (!IS_ERR_OR_NULL(page)) {
+            put_page(page);
+            page = kcdev_dev_unshare(dev, size >> PAGE_SHIFT, false);
+        }
+        if (IS_ERR(page)) {
+            kcdev_range_unlock(dev, &range);
+            return PTR_ERR(page);
+        }
+        if (page)
+            put_page(page);
+    }
+
+    down_write(&dev->fault_lock);
+
+    // Not to the end: the ring mappings are there past the capacity
+    kcdev_dev_unmap(dev, DIV_ROUND_UP(size, PAGE_SIZE), KCDEV_CAPACITY_PAGES - DIV_ROUND_UP(size, PAGE_SIZE), true);
+    kcdev_dev_free_pages(dev, DIV_ROUND_UP(size, PAGE_SIZE));
+
+    // The tail of the last page reads as zeros if the size grows back
+    page = xa_load(&dev->pages, size >> PAGE_SHIFT);
+    if (page)
+        memzero_page(page, size & ~PAGE_MASK, PAGE_SIZE - (size & ~PAGE_MASK));
+
+    atomic64_set(&dev->size, size);
+
+    up_write(&dev->fault_lock);
+    kcdev_range_unlock(dev, &range);
+
+    return 0;
+}
+
+// Makes dst a copy of src sharing the pages, no data copied: each side
+// copies a page apart on its next write to it, see kcdev_dev_unshare().
+// The mappings of src are zapped so that the writes through them fault
+// again and the old contents of dst go.
+static int kcdev_dev_clone(struct kcdev_dev *dst, struct kcdev_dev *src)
+{
+    // Both locked in the order of the devices
+    struct kcdev_dev *first = min(dst, src);
+    struct kcdev_dev *second = max(dst, src);
+    struct kcdev_range first_range;
+    struct kcdev_range second_range;
+    void *entry;
+    unsigned long i;
+    int ret = 0;
+
+    if (dst == src)
+        return -EINVAL;
+
+    kcdev_range_lock(first, &first_range, 0, U64_MAX, first == dst, false);
+    kcdev_range_lock(second, &second_range, 0, U64_MAX, second == dst, false);
+    down_write(&first->fault_lock);
+    down_write_nested(&second->fault_lock, SINGLE_DEPTH_NESTING);
+
+    kcdev_dev_unmap(dst, 0, KCDEV_CAPACITY_PAGES, true);
+    kcdev_dev_free_pages(dst, 0);
+
+    xa_for_each(&src->pages, i, entry) {
+        struct kcdev_zpage *zpage = NULL;
+
+        if (kcdev_entry_compressed(entry)) {
+            zpage = xa_untag_pointer(entry);
+            refcount_inc(&zpage->ref);
+        } else {
+            get_page(entry);
+        }
+
+        ret = xa_err(xa_store(&dst->pages, i, entry, GFP_KERNEL));
+        if (ret) {
+            if (zpage)
+                kcdev_zpage_put(zpage);
+            else
+                put_page(entry);
+            break;
+        }
+
+        if (zpage) {
+            atomic_long_inc(&dst->nr_compressed);
+            atomic64_add(zpage->size, &dst->compressed_bytes);
+        }
+
+        atomic_long_inc(&dst->nr_pages);
+        cond_resched();
+    }
+
+    if (ret) {
+        kcdev_dev_free_pages(dst, 0);
+        atomic64_set(&dst->size, 0);
+    } else {
+        kcdev_dev_unmap(src, 0, KCDEV_CAPACITY_PAGES, false);
+        atomic64_set(&dst->size, atomic64_read(&src->size));
+    }
+
+    up_write(&second->fault_lock);
+    up_write(&first->fault_lock);
+    kcdev_range_unlock(second, &second_range);
+    kcdev_range_unlock(first, &first_range);
+
+    return ret;
+}
+
+// The source is a file of the caller open for reading: cloning reads
+// all of it
+static long kcdev_clone(struct file *fp, unsigned long fd)
+{
+    struct file *src;
+    long ret;
+
+    if (!(fp->f_mode & FMODE_WRITE))
+        return -EBADF;
+
+    if (fd > INT_MAX)
+        return -EBADF;
+
+    src = fget(fd);
+    if (!src)
+        return -EBADF;
+
+    if (src->f_op != &kcdev_file_ops || !(src->f_mode & FMODE_READ))
+        ret = -EBADF;
+    else
+        ret = kcdev_dev_clone(kcdev_file_dev(fp), kcdev_file_dev(src));
+
+    fput(src);
+
+    return ret;
+}
+
+// The deduplication passes: every page of every minor gets hashed and
+// looked up in a table of the pages seen so far in the pass. A page
+// equal to one there is replaced with it, a page of zeros is freed, a
+// new one goes in the table. The table holds a reference to its pages
+// to keep them shared for the pass: never written to, so they can be
+// compared without any locks, see kcdev_page_shared(). That costs a
+// copy on the next write to the pages left alone, until the end of
+// the pass.
+struct kcdev_dedup_entry {
+    struct hlist_node node;
+    u64 hash;
+    struct page *page;
+};
+
+struct kcdev_dedup_table {
+    struct hlist_head *buckets;
+    unsigned int bits;
+    u64 sharing;
+};
+
+static DEFINE_MUTEX(kcdev_dedup_lock); // One pass at a time
+static struct task_struct *kcdev_dedup_thread;
+static DECLARE_WAIT_QUEUE_HEAD(kcdev_dedup_wait);
+
+static atomic64_t kcdev_dedup_passes;
+static atomic64_t kcdev_dedup_scanned;
+static atomic64_t kcdev_dedup_merged;
+static atomic64_t kcdev_dedup_zero;
+static atomic64_t kcdev_dedup_sharing;
+
+static u64 kcdev_page_hash(struct page *page, bool *zero)
+{
+    void *addr = kmap_local_page(page);
+    u64 hash = xxh64(addr, PAGE_SIZE, 0);
+
+    *zero = !memchr_inv(addr, 0, PAGE_SIZE);
+    kunmap_local(addr);
+
+    return hash;
+}
+
+static bool kcdev_pages_equal(struct page *a, struct page *b)
+{
+    void *addr_a = kmap_local_page(a);
+    void *addr_b = kmap_local_page(b);
+    bool equal = !memcmp(addr_a, addr_b, PAGE_SIZE);
+
+    kunmap_local(addr_b);
+    kunmap_local(addr_a);
+
+    return equal;
+}
+
+// The page in the table equal to this one, found then, or this one if
+// it goes in. NULL when out of memory, the page is left alone.
+static struct page *kcdev_dedup_lookup(struct kcdev_dedup_table *table, struct page *page, u64 hash, bool *found)
+{
+    struct hlist_head *bucket = &table->buckets[hash_64(hash, table->bits)];
+    struct kcdev_dedup_entry *entry;
+
+    *found = true;
+
+    hlist_for_each_entry(entry, bucket, node) {
+        if (entry->hash == hash && (entry->page == page || kcdev_pages_equal(entry->page, page)))
+            return entry->page;
+    }
+
+    *found = false;
+
+    entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+    if (!entry)
+        return NULL;
+
+    get_page(page);
+    entry->hash = hash;
+    entry->page = page;
+    hlist_add_head(&entry->node, bucket);
+
+    return page;
+}
+
+// One page: the range lock keeps out read() and write(), fault_lock
+// the faults, the mappings are zapped for the page to stay unwritten
+static void kcdev_dedup_page(struct kcdev_dedup_table *table, struct kcdev_dev *dev, pgoff_t index)
+{
+    struct kcdev_range range;
+    struct page *page;
+    struct page *same;
+    bool found;
+    bool zero;
+    u64 hash;
+
+    kcdev_range_lock(dev, &range, (u64)index << PAGE_SHIFT, (u64)(index + 1) << PAGE_SHIFT, true, false);
+    down_write(&dev->fault_lock);
+
+    // The compressed pages are cold, not worth bringing back for this
+    page = xa_load(&dev->pages, index);
+    if (!page || kcdev_entry_compressed(page))
+        goto out;
+
+    kcdev_dev_unmap(dev, index, 1, false);
+    atomic64_inc(&kcdev_dedup_scanned);
+
+    hash = kcdev_page_hash(page, &zero);
+
+    if (zero) {
+        xa_erase(&dev->pages, index);
+        __free_page(page);
+        atomic_long_dec(&dev->nr_pages);
+        atomic64_inc(&kcdev_dedup_zero);
+        goto out;
+    }
+
+    same = kcdev_dedup_lookup(table, page, hash, &found);
+    if (found)
+        ++table->sharing;
+
+    // Merged before or cloned if found
+    if (same == page || !same)
+        goto out;
+
+    get_page(same);
+    xa_store(&dev->pages, index, same, GFP_KERNEL); // Replacing, no allocation
+    __free_page(page);
+    atomic64_inc(&kcdev_dedup_merged);
+
+out:
+    up_write(&dev->fault_lock);
+    kcdev_range_unlock(dev, &range);
+}
+
+static int kcdev_dedup_pass(void)
+{
+    struct kcdev_dedup_table table = { 0 };
+    struct kcdev_dedup_entry *entry;
+    struct hlist_node *tmp;
+    unsigned long pages = 0;
+    unsigned long index;
+    u32 i;
+
+    for (i = 0; i < kcdev_count; ++i)
+        pages += atomic_long_read(&kcdev_devs[i].nr_pages);
+
+    table.bits = clamp_t(unsigned int, ilog2(pages | 1) + 1, 4, 20);
+    table.buckets = kvcalloc(1ul << table.bits, sizeof(*table.buckets), GFP_KERNEL);
+    if (!table.buckets)
+        return -ENOMEM;
+
+    mutex_lock(&kcdev_dedup_lock);
+
+    for (i = 0; i < kcdev_count; ++i) {
+        struct kcdev_dev *dev = &kcdev_devs[i];
+
+        // Only the index is used, the page is looked up again locked
+        for (index = 0; xa_find(&dev->pages, &index, ULONG_MAX, XA_PRESENT); ++index) {
+            kcdev_dedup_page(&table, dev, index);
+            cond_resched();
+        }
+    }
+
+    // The pages left alone aren't shared anymore
+    for (index = 0; index < (1ul << table.bits); ++index) {
+        hlist_for_each_entry_safe(entry, tmp, &table.buckets[index], node) {
+            put_page(entry->page);
+            kfree(entry);
+        }
+    }
+
+    atomic64_set(&kcdev_dedup_sharing, table.sharing);
+    atomic64_inc(&kcdev_dedup_passes);
+
+    mutex_unlock(&kcdev_dedup_lock);
+
+    kvfree(table.buckets);
+
+    return 0;
+}
+
+static int kcdev_dedup_info(struct kcdev_dedup_info __user *arg)
+{
+    struct kcdev_dedup_info info = {
+        .passes = atomic64_read(&kcdev_dedup_passes),
+        .scanned = atomic64_read(&kcdev_dedup_scanned),
+        .merged = atomic64_read(&kcdev_dedup_merged),
+        .zero = atomic64_read(&kcdev_dedup_zero),
+        .sharing = atomic64_read(&kcdev_dedup_sharing),
+        .page_size = PAGE_SIZE,
+    };
+
+    return copy_to_user(arg, &info, sizeof(info)) ? -EFAULT : 0;
+}
+
+// Sleeps kcdev_dedup_ms between the passes, checks every second for it
+// to be set if 0
+static int kcdev_dedup_fn(void *data)
+{
+    while (!kthread_should_stop()) {
+        ulong ms = READ_ONCE(kcdev_dedup_ms);
+
+        wait_event_interruptible_timeout(kcdev_dedup_wait, kthread_should_stop(),
+                                         msecs_to_jiffies(ms ? ms : MSEC_PER_SEC));
+
+        if (ms && !kthread_should_stop())
+            kcdev_dedup_pass();
+    }
+
+    return 0;
+}
+
+// The compressed tier: under memory pressure the shrinker goes around
+// the stores of all the minors like a clock, a page accessed since the
+// last time gets another chance, the others are compressed with LZ4
+// and freed. LZ4 for the fast decompression, that is on the path of
+// the next access. The pages shared by a clone or the deduplication and
+// those not compressing to KCDEV_ZPAGE_MAX are left alone.
+#define KCDEV_ZPAGE_MAX (PAGE_SIZE*3/4)
+
+static DEFINE_MUTEX(kcdev_zlock); // The buffers and the clock hand
+static void *kcdev_zwork;
+static void *kcdev_zbuf;
+static u32 kcdev_zdev;
+static pgoff_t kcdev_zindex;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,7,0)
+static unsigned long kcdev_shrink_count(struct shrinker *, struct shrink_control *);
+static unsigned long kcdev_shrink_scan(struct shrinker *, struct shrink_control *);
+
+static struct shrinker kcdev_shrinker_static = {
+    .count_objects = kcdev_shrink_count,
+    .scan_objects = kcdev_shrink_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+#endif
+
+static struct shrinker *kcdev_shrinker;
+
+// Compresses the page at index if cold, gives it another chance if hot.
+// Returns whether a page was freed. The locks are only tried: the page
+// is skipped if in use, the shrinker doesn't wait. Under kcdev_zlock.
+static bool kcdev_dev_compress(struct kcdev_dev *dev, pgoff_t index)
+{
+    struct kcdev_range range = {
+        .start = (u64)index << PAGE_SHIFT,
+        .end = (u64)(index + 1) << PAGE_SHIFT,
+        .write = true,
+    };
+    struct kcdev_zpage *zpage;
+    struct page *page;
+    bool freed = false;
+    void *addr;
+    int size;
+
+    if (!kcdev_range_trylock(dev, &range))
+        return false;
+
+    if (!down_write_trylock(&dev->fault_lock)) {
+        kcdev_range_unlock(dev, &range);
+        return false;
+    }
+
+    page = xa_load(&dev->pages, index);
+    if (!page || kcdev_entry_compressed(page) || kcdev_page_shared(page))
+        goto out;
+
+    // Zapped first: the stores through a writable pte would go unseen by
+    // the compression, and the accesses through the mappings have to
+    // fault to mark the page hot again
+    kcdev_dev_unmap(dev, index, 1, false);
+
+    if (xa_get_mark(&dev->pages, index, KCDEV_MARK_HOT)) {
+        xa_clear_mark(&dev->pages, index, KCDEV_MARK_HOT);
+        goto out;
+    }
+
+    addr = kmap_local_page(page);
+    size = LZ4_compress_default(addr, kcdev_zbuf, PAGE_SIZE, LZ4_COMPRESSBOUND(PAGE_SIZE), kcdev_zwork);
+    kunmap_local(addr);
+
+    // Not worth it, tried again in two times around
+    if (size <= 0 || size > KCDEV_ZPAGE_MAX) {
+        xa_set_mark(&dev->pages, index, KCDEV_MARK_HOT);
+        goto out;
+    }
+
+    zpage = kmalloc(struct_size(zpage, data, size), GFP_NOWAIT | __GFP_NOWARN);
+    if (!zpage)
+        goto out;
+
+    refcount_set(&zpage->ref, 1);
+    zpage->size = size;
+    memcpy(zpage->data, kcdev_zbuf, size);
+
+    xa_store(&dev->pages, index, xa_tag_pointer(zpage, KCDEV_ENTRY_COMPRESSED), GFP_NOWAIT); // Replacing, no allocation
+    __free_page(page);
+
+    atomic_long_inc(&dev->nr_compressed);
+    atomic64_add(size, &dev->compressed_bytes);
+    atomic64_inc(&dev->compressions);
+    freed = true;
+
+out:
+    up_write(&dev->fault_lock);
+    kcdev_range_unlock(dev, &range);
+
+    return freed;
+}
+
+// Moves the clock hand over up to nr pages of the stores, returns the
+// pages freed. Under kcdev_zlock.
+static unsigned long kcdev_zscan(unsigned long nr)
+{
+    unsigned long freed = 0;
+    u32 empty = 0; // The minors found with nothing left past the hand in a row
+
+    while (nr && empty < kcdev_count) {
+        struct kcdev_dev *dev = &kcdev_devs[kcdev_zdev];
+        pgoff_t index = kcdev_zindex;
+
+        if (!xa_find(&dev->pages, &index, ULONG_MAX, XA_PRESENT)) {
+            kcdev_zdev = (kcdev_zdev + 1) % kcdev_count;
+            kcdev_zindex = 0;
+            ++empty;
+            continue;
+        }
+
+        kcdev_zindex = index + 1;
+        empty = 0;
+        --nr;
+
+        freed += kcdev_dev_compress(dev, index);
+        cond_resched();
+    }
+
+    return freed;
+}
+
+// The pages not compressed yet
+static unsigned long kcdev_shrink_count(struct shrinker *shrinker, struct shrink_control *sc)
+{
+    unsigned long pages = 0;
+    u32 i;
+
+    if (!READ_ONCE(kcdev_compress))
+        return 0;
+
+    for (i = 0; i < kcdev_count; ++i)
+        pages += atomic_long_read(&kcdev_devs[i].nr_pages) - atomic_long_read(&kcdev_devs[i].nr_compressed);
+
+    return pages ? pages : SHRINK_EMPTY;
+}
+
+// Not from the filesystem reclaim: zapping the mappings takes the
+// locks of the mm that may be held there
+static unsigned long kcdev_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc)
+{
+    unsigned long freed;
+
+    if (!(sc->gfp_mask & __GFP_FS) || !mutex_trylock(&kcdev_zlock))
+        return SHRINK_STOP;
+
+    freed = kcdev_zscan(sc->nr_to_scan);
+
+    mutex_unlock(&kcdev_zlock);
+
+    return freed;
+}
+
+static int kcdev_shrinker_register(void)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,7,0)
+    int ret;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,0,0)
+    ret = register_shrinker(&kcdev_shrinker_static);
+#else
+    ret = register_shrinker(&kcdev_shrinker_static, "kcdev");
+#endif
+    if (!ret)
+        kcdev_shrinker = &kcdev_shrinker_static;
+
+    return ret;
+#else
+    kcdev_shrinker = shrinker_alloc(0, "kcdev");
+    if (!kcdev_shrinker)
+        return -ENOMEM;
+
+    kcdev_shrinker->count_objects = kcdev_shrink_count;
+    kcdev_shrinker->scan_objects = kcdev_shrink_scan;
+    shrinker_register(kcdev_shrinker);
+
+    return 0;
+#endif
+}
+
+static void kcdev_shrinker_unregister(void)
+{
+    if (!kcdev_shrinker)
+        return;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,7,0)
+    unregister_shrinker(kcdev_shrinker);
+#else
+    shrinker_free(kcdev_shrinker);
+#endif
+    kcdev_shrinker = NULL;
+}
+
+static int kcdev_dev_zinfo(struct kcdev_dev *dev, struct kcdev_zinfo __user *arg)
+{
+    struct kcdev_zinfo info = {
+        .compressed = atomic_long_read(&dev->nr_compressed),
+        .compressed_bytes = atomic64_read(&dev->compressed_bytes),
+        .compressions = atomic64_read(&dev->compressions),
+        .decompressions = atomic64_read(&dev->decompressions),
+        .decompress_ns = atomic64_read(&dev->decompress_ns),
+        .decompress_ns_max = atomic64_read(&dev->decompress_ns_max),
+        .page_size = PAGE_SIZE,
+    };
+
+    return copy_to_user(arg, &info, sizeof(info)) ? -EFAULT : 0;
+}
+
+// One time around the store of the minor, what the shrinker does
+// little by little
+static void kcdev_dev_sweep(struct kcdev_dev *dev)
+{
+    pgoff_t index;
+
+    mutex_lock(&kcdev_zlock);
+
+    for (index = 0; xa_find(&dev->pages, &index, ULONG_MAX, XA_PRESENT); ++index) {
+        kcdev_dev_compress(dev, index);
+        cond_resched();
+    }
+
+    mutex_unlock(&kcdev_zlock);
+}
+
+static int kcdev_dev_info(struct kcdev_dev *dev, struct kcdev_info __user *arg)
+{
+    struct kcdev_info info = {
+        .size = atomic64_read(&dev->size),
+        .capacity = kcdev_capacity,
+        .pages = atomic_long_read(&dev->nr_pages),
+    };
+
+    return copy_to_user(arg, &info, sizeof(info)) ? -EFAULT : 0;
+}
+
+// A request of an AIO or io_uring completed from kcdev_wq, with the
+// user buffer reached through the address space of the submitter
+struct kcdev_async {
+    struct work_struct work;
+    struct kiocb *iocb;
+    struct mm_struct *mm;
+    void __user *buf;
+    size_t len;
+    bool write;
+};
+
+// The buffer of a single segment user iterator, NULL for the others
+static void __user *kcdev_iter_user_buf(struct iov_iter *iter)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,0,0)
+    if (!iter_is_iovec(iter) || iter->nr_segs != 1)
+        return NULL;
+
+    return iter->iov->iov_base + iter->iov_offset;
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6,4,0)
+    if (iter_is_ubuf(iter))
+        return iter->ubuf + iter->iov_offset;
+
+    if (!iter_is_iovec(iter) || iter->nr_segs != 1)
+        return NULL;
+
+    return iter->iov->iov_base + iter->iov_offset;
+#else
+    if (!user_backed_iter(iter) || iter->nr_segs != 1)
+        return NULL;
+
+    return iter_iov_addr(iter);
+#endif
+}
+
+static void kcdev_async_fn(struct work_struct *work)
+{
+    struct kcdev_async *async = container_of(work, struct kcdev_async, work);
+    struct kiocb *iocb = async->iocb;
+    struct kcdev_dev *dev = kcdev_file_dev(iocb->ki_filp);
+    struct iovec iov = { .iov_base = async->buf, .iov_len = async->len };
+    struct iov_iter iter;
+    ssize_t ret = -EFAULT;
+
+    // Gone if the submitter has exited
+    if (mmget_not_zero(async->mm)) {
+        kthread_use_mm(async->mm);
+
+        if (async->write) {
+            iov_iter_init(&iter, ITER_SOURCE, &iov, 1, async->len);
+            ret = kcdev_dev_write(dev, iocb->ki_pos, &iter, false);
+        } else {
+            iov_iter_init(&iter, ITER_DEST, &iov, 1, async->len);
+            ret = kcdev_dev_read(dev, iocb->ki_pos, &iter, false);
+        }
+
+        kthread_unuse_mm(async->mm);
+        mmput(async->mm);
+    }
+
+    if (ret > 0)
+        iocb->ki_pos += ret;
+
+    mmdrop(async->mm);
+    kfree(async);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,16,0)
+    iocb->ki_complete(iocb, ret, 0);
+#else
+    iocb->ki_complete(iocb, ret);
+#endif
+}
+
+// Queues the asynchronous requests from kcdev_async_min on to the
+// workqueue, that's EIOCBQUEUED. The synchronous ones, the small ones
+// and those with several segments or kernel buffers are done by the
+// caller, that's 0.
+static ssize_t kcdev_async(struct kiocb *iocb, struct iov_iter *iter, bool write)
+{
+    struct kcdev_async *async;
+    void __user *buf;
+
+    if (is_sync_kiocb(iocb) || !kcdev_async_min || iov_iter_count(iter) < kcdev_async_min)
+        return 0;
+
+    buf = kcdev_iter_user_buf(iter);
+    if (!buf)
+        return 0;
+
+    async = kmalloc(sizeof(*async), (iocb->ki_flags & IOCB_NOWAIT) ? GFP_NOWAIT : GFP_KERNEL);
+    if (!async)
+        return (iocb->ki_flags & IOCB_NOWAIT) ? -EAGAIN : -ENOMEM;
+
+    INIT_WORK(&async->work, kcdev_async_fn);
+    async->iocb = iocb;
+    async->buf = buf;
+    async->len = iov_iter_count(iter);
+    async->write = write;
+
+    mmgrab(current->mm);
+    async->mm = current->mm;
+
+    queue_work(kcdev_wq, &async->work);
+
+    return -EIOCBQUEUED;
+}
+
+// One op of a batch, errors go to its result. The op goes to fp or to
+// another file of the task: a kcdev one, open the way the op needs it,
+// as if read(2) or write(2) went to it.
+static s64 kcdev_batch_op(struct file *fp, const struct kcdev_op *op)
+{
+    struct iovec iov = { .iov_base = u64_to_user_ptr(op->buf), .iov_len = op->len };
+    struct file *target = fp;
+    struct iov_iter iter;
+    fmode_t mode;
+    s64 ret;
+
+    if (op->offset > LLONG_MAX || op->len > MAX_RW_COUNT)
+        return -EINVAL;
+
+    switch (op->op) {
+    case KCDEV_OP_READ:
+        mode = FMODE_READ;
+        break;
+
+    case KCDEV_OP_WRITE:
+        mode = FMODE_WRITE;
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    if (op->fd != KCDEV_FD_SELF) {
+        // The polling thread of a ring has no descriptors
+        if (current->flags & PF_KTHREAD)
+            return -EBADF;
+
+        target = fget(op->fd);
+        if (!target)
+            return -EBADF;
+    }
+
+    if (target->f_op != &kcdev_file_ops || !(target->f_mode & mode)) {
+        ret = -EBADF;
+    } else if (mode == FMODE_READ) {
+        iov_iter_init(&iter, ITER_DEST, &iov, 1, op->len);
+        ret = kcdev_dev_read(kcdev_file_dev(target), op->offset, &iter, false);
+    } else {
+        iov_iter_init(&iter, ITER_SOURCE, &iov, 1, op->len);
+        ret = kcdev_dev_write(kcdev_file_dev(target), op->offset, &iter, false);
+    }
+
+    if (target != fp)
+        fput(target);
+
+    return ret;
+}
+
+// The ops are copied in and the results out one at a time: no limit on
+// the memory taken from the count, and a 40 bytes copy is little next
+// to the syscall it replaces
+static long kcdev_batch(struct file *fp, struct kcdev_batch __user *arg)
+{
+    struct kcdev_batch batch;
+    struct kcdev_op __user *ops;
+    u32 i;
+
+    if (copy_from_user(&batch, arg, sizeof(batch)))
+        return -EFAULT;
+
+    if (batch.flags || batch.count > KCDEV_BATCH_MAX)
+        return -EINVAL;
+
+    ops = u64_to_user_ptr(batch.ops);
+
+    for (i = 0; i < batch.count; ++i) {
+        struct kcdev_op op;
+
+        if (copy_from_user(&op, &ops[i], sizeof(op)))
+            return -EFAULT;
+
+        op.result = kcdev_batch_op(fp, &op);
+
+        if (put_user(op.result, &ops[i].result))
+            return -EFAULT;
+
+        if (signal_pending(current) && i + 1 < batch.count)
+            return i + 1;
+
+        cond_resched();
+    }
+
+    return i;
+}
+
+static u32 kcdev_ring_completions(struct kcdev_ring *ring)
+{
+    return READ_ONCE(ring->cq_tail) - READ_ONCE(ring->ctl->cq_head);
+}
+
+// Entries queued and room for their completions
+static bool kcdev_ring_pending(struct kcdev_ring *ring)
+{
+    return smp_load_acquire(&ring->ctl->sq_tail) != ring->sq_head &&
+           kcdev_ring_completions(ring) < ring->cq_entries;
+}
 
-module_param(dump_stack_trace, bool, 0644); // Permissions in /sysfs
-MODULE_PARM_DESC(dump_stack_trace, "Dumping stack traces");
+// Runs the queued entries while there is room for the completions, one
+// submitter at a time. Returns the number run.
+static u32 kcdev_ring_submit(struct kcdev_ring *ring)
+{
+    struct kcdev_ring_ctl *ctl = ring->ctl;
+    u32 head = ring->sq_head;
+    u32 tail = smp_load_acquire(&ctl->sq_tail);
+    u32 done = 0;
 
-module_param(kcdev_count, ulong, 00); // Permissions in /sysfs
-MODULE_PARM_DESC(kcdev_count, "Number of devices");
+    // Whatever the application has put there, no more than a ring's worth
+    if (tail - head > ring->sq_entries)
+        tail = head + ring->sq_entries;
 
-static int	         kcdev_open(struct inode *, struct file *);
-static ssize_t	     kcdev_read(struct file *, char __user *, size_t, loff_t *);
-static ssize_t	     kcdev_write(struct file *, const char __user *, size_t, loff_t *);
-static int	         kcdev_release(struct inode *, struct file *);
-static int	         kcdev_mmap(struct file *, struct vm_area_struct *);
-static long          kcdev_ioctl(struct file *, unsigned int, unsigned long);
+    while (head != tail && kcdev_ring_completions(ring) < ring->cq_entries) {
+        struct kcdev_sqe *sqe = &ring->sqes[head & (ring->sq_entries - 1)];
+        struct kcdev_cqe *cqe = &ring->cqes[ring->cq_tail & (ring->cq_entries - 1)];
+        // Read once, the application may change the entry under us
+        struct kcdev_op op = {
+            .fd = READ_ONCE(sqe->fd),
+            .op = READ_ONCE(sqe->op),
+            .offset = READ_ONCE(sqe->offset),
+            .len = READ_ONCE(sqe->len),
+            .buf = READ_ONCE(sqe->buf),
+        };
 
-static const struct file_operations kcdev_file_ops = {
-    .owner             = THIS_MODULE,
-	.open              = kcdev_open,
-	.read              = kcdev_read,
-	.write             = kcdev_write,
-	.release           = kcdev_release,
-	.mmap              = kcdev_mmap,
-    .unlocked_ioctl    = kcdev_ioctl,
+        WRITE_ONCE(cqe->user_data, READ_ONCE(sqe->user_data));
+        WRITE_ONCE(cqe->result, kcdev_batch_op(ring->file, &op));
+
+        ++head;
+        ++done;
+        smp_store_release(&ctl->sq_head, head);
+        ring->sq_head = head;
+        smp_store_release(&ctl->cq_tail, ring->cq_tail + 1);
+        WRITE_ONCE(ring->cq_tail, ring->cq_tail + 1);
+
+        if (signal_pending(current))
+            break;
+
+        cond_resched();
+    }
+
+    if (done) {
+        wake_up_all(&ring->cq_wait);
+        if (ring->eventfd)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,8,0)
+            eventfd_signal(ring->eventfd, 1);
+#else
+            eventfd_signal(ring->eventfd);
+#endif
+    }
+
+    return done;
+}
+
+// Polls the submission ring while there are entries and for the idle
+// time after, then sleeps until woken with KCDEV_ENTER_WAKEUP. The user
+// address space is held only while polling: the ring mapping holds the
+// file and so the ring, a thread holding the address space all along
+// would never let it go.
+static int kcdev_ring_poll_fn(void *data)
+{
+    struct kcdev_ring *ring = data;
+    struct kcdev_ring_ctl *ctl = ring->ctl;
+
+    while (!kthread_should_stop()) {
+        unsigned long idle_end = jiffies + ring->idle;
+        DEFINE_WAIT(wait);
+
+        if (mmget_not_zero(ring->mm)) {
+            kthread_use_mm(ring->mm);
+
+            do {
+                if (kcdev_ring_submit(ring))
+                    idle_end = jiffies + ring->idle;
+                else
+                    cond_resched();
+            } while (!kthread_should_stop() && time_before(jiffies, idle_end));
+
+            kthread_unuse_mm(ring->mm);
+            mmput(ring->mm);
+        }
+
+        prepare_to_wait(&ring->sq_wait, &wait, TASK_INTERRUPTIBLE);
+
+        // Seen by the application before it checks the flag after
+        // queueing, or the entries are seen here
+        WRITE_ONCE(ctl->flags, READ_ONCE(ctl->flags) | KCDEV_RING_NEED_WAKEUP);
+        smp_mb();
+
+        if (!kthread_should_stop() && !kcdev_ring_pending(ring))
+            schedule();
+
+        finish_wait(&ring->sq_wait, &wait);
+
+        WRITE_ONCE(ctl->flags, READ_ONCE(ctl->flags) & ~KCDEV_RING_NEED_WAKEUP);
+    }
+
+    return 0;
+}
+
+static void kcdev_ring_destroy(struct kcdev_ring *ring)
+{
+    if (ring->poller)
+        kthread_stop(ring->poller);
+
+    if (ring->eventfd)
+        eventfd_ctx_put(ring->eventfd);
+
+    if (ring->mm)
+        mmdrop(ring->mm);
+
+    vfree(ring->mem);
+    kfree(ring);
+}
+
+static long kcdev_ring_setup(struct file *fp, struct kcdev_ring_setup __user *arg)
+{
+    struct kcdev_file *kfile = fp->private_data;
+    struct kcdev_ring_setup setup;
+    struct kcdev_ring *ring;
+    long ret = 0;
+
+    if (copy_from_user(&setup, arg, sizeof(setup)))
+        return -EFAULT;
+
+    if ((setup.flags & ~KCDEV_RING_SQPOLL) || setup.reserved ||
+        !setup.sq_entries || setup.sq_entries > KCDEV_RING_MAX_ENTRIES ||
+        setup.cq_entries > 2*KCDEV_RING_MAX_ENTRIES)
+        return -EINVAL;
+
+    setup.sq_entries = roundup_pow_of_two(setup.sq_entries);
+    setup.cq_entries = setup.cq_entries ? roundup_pow_of_two(setup.cq_entries) : 2*setup.sq_entries;
+    if (setup.cq_entries < setup.sq_entries)
+        return -EINVAL;
+
+    setup.sqes = ALIGN(sizeof(struct kcdev_ring_ctl), SMP_CACHE_BYTES);
+    setup.cqes = ALIGN(setup.sqes + setup.sq_entries*sizeof(struct kcdev_sqe), SMP_CACHE_BYTES);
+    setup.size = PAGE_ALIGN(setup.cqes + setup.cq_entries*sizeof(struct kcdev_cqe));
+
+    ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+    if (!ring)
+        return -ENOMEM;
+
+    mutex_init(&ring->lock);
+    init_waitqueue_head(&ring->cq_wait);
+    init_waitqueue_head(&ring->sq_wait);
+    ring->sq_entries = setup.sq_entries;
+    ring->cq_entries = setup.cq_entries;
+    ring->idle = msecs_to_jiffies(setup.sq_idle_ms);
+    ring->file = fp;
+
+    ring->size = setup.size;
+    ring->mem = vmalloc_user(ring->size);
+    if (!ring->mem) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    ring->ctl = ring->mem;
+    ring->sqes = ring->mem + setup.sqes;
+    ring->cqes = ring->mem + setup.cqes;
+
+    if (setup.eventfd >= 0) {
+        struct eventfd_ctx *eventfd = eventfd_ctx_fdget(setup.eventfd);
+
+        if (IS_ERR(eventfd)) {
+            ret = PTR_ERR(eventfd);
+            goto fail;
+        }
+
+        ring->eventfd = eventfd;
+    }
+
+    mmgrab(current->mm);
+    ring->mm = current->mm;
+
+    mutex_lock(&kfile->ring_lock);
+
+    if (kfile->ring) {
+        ret = -EBUSY;
+        goto fail_unlock;
+    }
+
+    if (copy_to_user(arg, &setup, sizeof(setup))) {
+        ret = -EFAULT;
+        goto fail_unlock;
+    }
+
+    if (setup.flags & KCDEV_RING_SQPOLL) {
+        struct task_struct *task = kthread_create(kcdev_ring_poll_fn, ring, "kcdev%ld-sq",
+                                                  (long)(kfile->dev - kcdev_devs));
+
+        if (IS_ERR(task)) {
+            ret = PTR_ERR(task);
+            goto fail_unlock;
+        }
+
+        ring->poller = task;
+        wake_up_process(task);
+    }
+
+    smp_store_release(&kfile->ring, ring);
+
+    mutex_unlock(&kfile->ring_lock);
+
+    return 0;
+
+fail_unlock:
+    mutex_unlock(&kfile->ring_lock);
+fail:
+    kcdev_ring_destroy(ring);
+
+    return ret;
+}
+
+static long kcdev_ring_enter(struct file *fp, struct kcdev_ring_enter __user *arg)
+{
+    struct kcdev_file *kfile = fp->private_data;
+    struct kcdev_ring *ring = smp_load_acquire(&kfile->ring);
+    struct kcdev_ring_enter enter;
+    long ret = 0;
+
+    if (!ring)
+        return -EINVAL;
+
+    if (copy_from_user(&enter, arg, sizeof(enter)))
+        return -EFAULT;
+
+    if ((enter.flags & ~KCDEV_ENTER_WAKEUP) || enter.min_complete > ring->cq_entries)
+        return -EINVAL;
+
+    if (ring->poller) {
+        if (enter.flags & KCDEV_ENTER_WAKEUP)
+            wake_up(&ring->sq_wait);
+    } else {
+        if (mutex_lock_interruptible(&ring->lock))
+            return -ERESTARTSYS;
+
+        ret = kcdev_ring_submit(ring);
+
+        mutex_unlock(&ring->lock);
+    }
+
+    if (enter.min_complete &&
+        wait_event_interruptible(ring->cq_wait, kcdev_ring_completions(ring) >= enter.min_complete) &&
+        !ret)
+        ret = -ERESTARTSYS;
+
+    return ret;
+}
+
+// The ring mapping, the pages go in right away
+static int kcdev_ring_mmap(struct file *fp, struct vm_area_struct *vma)
+{
+    struct kcdev_file *kfile = fp->private_data;
+    struct kcdev_ring *ring = smp_load_acquire(&kfile->ring);
+
+    if (!ring || vma->vm_end - vma->vm_start > ring->size)
+        return -EINVAL;
+
+    // The buffers are in the address space of the one who set it up
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+    vma->vm_flags |= VM_DONTCOPY;
+#else
+    vm_flags_set(vma, VM_DONTCOPY);
+#endif
+
+    return remap_vmalloc_range(vma, ring->mem, 0);
+}
+
+// Drops the reference to the page a fault put in place and has it
+// faulted in again
+static vm_fault_t kcdev_vm_refault(struct page *page)
+{
+    // Compressed again meanwhile if EAGAIN, retried as well
+    if (IS_ERR(page) && PTR_ERR(page) != -EAGAIN)
+        return VM_FAULT_OOM;
+
+    if (page && !IS_ERR(page))
+        put_page(page);
+
+    return VM_FAULT_NOPAGE;
+}
+
+// A fault on a compressed page: brought back and faulted in again
+static vm_fault_t kcdev_vm_decompress(struct kcdev_dev *dev, pgoff_t index)
+{
+    return kcdev_vm_refault(kcdev_dev_decompress(dev, index, false));
+}
+
+// The page or the zero page for a read of a hole, the page is filled
+// on the first write. The shared mappings insert the pfns themselves,
+// under fault_lock: nothing else keeps the page from going away.
+static vm_fault_t kcdev_vm_fault(struct vm_fault *vmf)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct kcdev_dev *dev = kcdev_file_dev(vma->vm_file);
+    bool write = vmf->flags & FAULT_FLAG_WRITE;
+    struct page *page;
+    unsigned long pfn;
+    vm_fault_t ret;
+
+    if (vmf->pgoff >= KCDEV_CAPACITY_PAGES)
+        return VM_FAULT_SIGBUS;
+
+    down_read(&dev->fault_lock);
+
+    page = xa_load(&dev->pages, vmf->pgoff);
+    if (!page && write) {
+        up_read(&dev->fault_lock);
+
+        page = kcdev_dev_fill(dev, vmf->pgoff, 0);
+        if (IS_ERR(page))
+            return VM_FAULT_OOM;
+        put_page(page);
+
+        // Gone again if truncated in between, retried
+        down_read(&dev->fault_lock);
+        page = xa_load(&dev->pages, vmf->pgoff);
+    }
+
+    if (page && kcdev_entry_compressed(page)) {
+        up_read(&dev->fault_lock);
+        return kcdev_vm_decompress(dev, vmf->pgoff);
+    }
+
+    // Copied and faulted in again
+    if (page && write && kcdev_page_shared(page)) {
+        up_read(&dev->fault_lock);
+
+        return kcdev_vm_refault(kcdev_dev_unshare(dev, vmf->pgoff, false));
+    }
+
+    if (page) {
+        pfn = page_to_pfn(page);
+        kcdev_dev_mark_hot(dev, vmf->pgoff);
+    } else {
+        pfn = page_to_pfn(ZERO_PAGE(vmf->address));
+        write = false;
+    }
+
+    // The pages are writable right away, the zero page never
+    ret = vmf_insert_pfn_prot(vma, vmf->address & PAGE_MASK, pfn,
+                              write ? vm_get_page_prot(vma->vm_flags) : vma->vm_page_prot);
+    if (write)
+        kcdev_dev_extend(dev, min_t(u64, (u64)(vmf->pgoff + 1) << PAGE_SHIFT, kcdev_capacity));
+
+    up_read(&dev->fault_lock);
+
+    return ret;
+}
+
+// A write to a page mapped read-only: fine if it's a page of the
+// store not shared. The zero page gets replaced with a filled hole, a
+// shared page with a copy, a page compressed meanwhile with itself
+// brought back, and faulted in again.
+static vm_fault_t kcdev_vm_pfn_mkwrite(struct vm_fault *vmf)
+{
+    struct kcdev_dev *dev = kcdev_file_dev(vmf->vma->vm_file);
+    struct page *page;
+    bool shared = false;
+
+    down_read(&dev->fault_lock);
+    page = xa_load(&dev->pages, vmf->pgoff);
+    if (page && kcdev_entry_compressed(page)) {
+        up_read(&dev->fault_lock);
+        return kcdev_vm_decompress(dev, vmf->pgoff);
+    }
+
+    if (page) {
+        shared = kcdev_page_shared(page);
+        if (!shared) {
+            kcdev_dev_extend(dev, min_t(u64, (u64)(vmf->pgoff + 1) << PAGE_SHIFT, kcdev_capacity));
+            kcdev_dev_mark_hot(dev, vmf->pgoff);
+        }
+    }
+    up_read(&dev->fault_lock);
+
+    if (shared)
+        return kcdev_vm_refault(kcdev_dev_unshare(dev, vmf->pgoff, false));
+
+    if (page)
+        return 0;
+
+    return kcdev_vm_refault(kcdev_dev_fill(dev, vmf->pgoff, 0));
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+
+// Whether the pages at index map with a PMD: all of them present,
+// not compressed and physically contiguous from an aligned pfn, and
+// not shared for writing
+static bool kcdev_dev_huge_mappable(struct kcdev_dev *dev, pgoff_t index, struct page *first, bool write)
+{
+    unsigned long pfn;
+    pgoff_t i;
+
+    if (kcdev_entry_compressed(first))
+        return false;
+
+    pfn = page_to_pfn(first);
+    if (!IS_ALIGNED(pfn, HPAGE_PMD_NR))
+        return false;
+
+    for (i = 0; i < HPAGE_PMD_NR; ++i) {
+        struct page *page = i ? xa_load(&dev->pages, index + i) : first;
+
+        if (!page || kcdev_entry_compressed(page) || page_to_pfn(page) != pfn + i ||
+            (write && kcdev_page_shared(page)))
+            return false;
+    }
+
+    return true;
+}
+
+// Maps 2 MB at once where the mapping and the pages line up. A write to
+// an aligned hole fills it with a contiguous run of pages, the reads of
+// the holes and the pages written one by one fall back to the ptes.
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,6,0)
+static vm_fault_t kcdev_vm_huge_fault(struct vm_fault *vmf, enum page_entry_size pe_size)
+#else
+static vm_fault_t kcdev_vm_huge_fault(struct vm_fault *vmf, unsigned int order)
+#endif
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct kcdev_dev *dev = kcdev_file_dev(vma->vm_file);
+    bool write = vmf->flags & FAULT_FLAG_WRITE;
+    unsigned long addr = vmf->address & PMD_MASK;
+    pgoff_t index = vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT);
+    struct page *page;
+    unsigned long pfn;
+    pgoff_t hole = index;
+    vm_fault_t ret;
+    pgoff_t i;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,6,0)
+    if (pe_size != PE_SIZE_PMD)
+#else
+    if (order != PMD_SHIFT - PAGE_SHIFT)
+#endif
+        return VM_FAULT_FALLBACK;
+
+    if (addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end || !IS_ALIGNED(index, HPAGE_PMD_NR) ||
+        index + HPAGE_PMD_NR > KCDEV_CAPACITY_PAGES)
+        return VM_FAULT_FALLBACK;
+
+    down_read(&dev->fault_lock);
+
+    page = xa_load(&dev->pages, index);
+    if (!page) {
+        bool empty = !xa_find(&dev->pages, &hole, index + HPAGE_PMD_NR - 1, XA_PRESENT);
+
+        up_read(&dev->fault_lock);
+
+        if (write && empty)
+            page = kcdev_dev_fill(dev, index, HPAGE_PMD_ORDER);
+        if (IS_ERR_OR_NULL(page))
+            return VM_FAULT_FALLBACK;
+        put_page(page);
+
+        down_read(&dev->fault_lock);
+        page = xa_load(&dev->pages, index);
+    }
+
+    if (!page || !kcdev_dev_huge_mappable(dev, index, page, write)) {
+        up_read(&dev->fault_lock);
+        return VM_FAULT_FALLBACK;
+    }
+
+    pfn = page_to_pfn(page);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,17,0)
+    ret = vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(pfn), write);
+#else
+    ret = vmf_insert_pfn_pmd(vmf, pfn, write);
+#endif
+    if (write)
+        kcdev_dev_extend(dev, min_t(u64, (u64)(index + HPAGE_PMD_NR) << PAGE_SHIFT, kcdev_capacity));
+
+    // One fault maps them all, all of them are in use
+    for (i = 0; i < HPAGE_PMD_NR; ++i)
+        kcdev_dev_mark_hot(dev, index + i);
+
+    up_read(&dev->fault_lock);
+
+    return ret;
+}
+
+#endif
+
+static const struct vm_operations_struct kcdev_vm_ops = {
+    .fault = kcdev_vm_fault,
+    .pfn_mkwrite = kcdev_vm_pfn_mkwrite,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    .huge_fault = kcdev_vm_huge_fault,
+#endif
 };
 
-static dev_t            kcdev_num;
-static struct cdev      kcdev;
-static struct class*    kcdev_class;
+// The private mappings get the pages themselves for the kernel to copy
+// them on write, a pfn mapping can't be copied on write. No zero page
+// and no huge mappings here: the holes are filled on the first touch.
+static vm_fault_t kcdev_vm_fault_private(struct vm_fault *vmf)
+{
+    struct kcdev_dev *dev = kcdev_file_dev(vmf->vma->vm_file);
+    struct page *page;
+
+    if (vmf->pgoff >= KCDEV_CAPACITY_PAGES)
+        return VM_FAULT_SIGBUS;
+
+    down_read(&dev->fault_lock);
+    page = xa_load(&dev->pages, vmf->pgoff);
+    if (page && kcdev_entry_compressed(page)) {
+        up_read(&dev->fault_lock);
+        return kcdev_vm_decompress(dev, vmf->pgoff);
+    }
+    if (page) {
+        get_page(page);
+        kcdev_dev_mark_hot(dev, vmf->pgoff);
+    }
+    up_read(&dev->fault_lock);
+
+    if (!page)
+        return kcdev_vm_refault(kcdev_dev_fill(dev, vmf->pgoff, 0));
+
+    vmf->page = page;
+
+    return 0;
+}
+
+static const struct vm_operations_struct kcdev_vm_private_ops = {
+    .fault = kcdev_vm_fault_private,
+};
 
 static void kcdev_cleanup(void)
 {
@@ -69,6 +2069,31 @@ static void kcdev_cleanup(void)
     }
 
     unregister_chrdev(MAJOR(kcdev_num), KCDEV_NAME);
+
+    kcdev_shrinker_unregister();
+
+    if (kcdev_dedup_thread) {
+        kthread_stop(kcdev_dedup_thread);
+        kcdev_dedup_thread = NULL;
+    }
+
+    if (kcdev_wq) {
+        destroy_workqueue(kcdev_wq);
+        kcdev_wq = NULL;
+    }
+
+    if (kcdev_devs) {
+        for (i = 0; i < kcdev_count; ++i)
+            kcdev_dev_destroy(&kcdev_devs[i]);
+
+        kfree(kcdev_devs);
+        kcdev_devs = NULL;
+    }
+
+    kfree(kcdev_zbuf);
+    kcdev_zbuf = NULL;
+    vfree(kcdev_zwork);
+    kcdev_zwork = NULL;
 }
 
 static int __init init_kcdev_example(void)
@@ -78,6 +2103,40 @@ static int __init init_kcdev_example(void)
 
     if (dump_stack_trace) dump_stack();
 
+    if (!kcdev_count || kcdev_count > MINORMASK || !kcdev_capacity || kcdev_capacity > KCDEV_RING_OFFSET)
+        return -EINVAL;
+
+    kcdev_devs = kcalloc(kcdev_count, sizeof(struct kcdev_dev), GFP_KERNEL);
+    if (!kcdev_devs)
+        return -ENOMEM;
+
+    for (i = 0; i < kcdev_count; ++i)
+        kcdev_dev_init(&kcdev_devs[i]);
+
+    kcdev_wq = alloc_workqueue("kcdev", WQ_UNBOUND, 0);
+    if (!kcdev_wq) {
+        ret = -ENOMEM;
+        goto exit;
+    }
+
+    kcdev_dedup_thread = kthread_run(kcdev_dedup_fn, NULL, "kcdev-dedup");
+    if (IS_ERR(kcdev_dedup_thread)) {
+        ret = PTR_ERR(kcdev_dedup_thread);
+        kcdev_dedup_thread = NULL;
+        goto exit;
+    }
+
+    kcdev_zwork = vmalloc(LZ4_MEM_COMPRESS);
+    kcdev_zbuf = kmalloc(LZ4_COMPRESSBOUND(PAGE_SIZE), GFP_KERNEL);
+    if (!kcdev_zwork || !kcdev_zbuf) {
+        ret = -ENOMEM;
+        goto exit;
+    }
+
+    ret = kcdev_shrinker_register();
+    if (ret)
+        goto exit;
+
     // Get the MAJOR and MINOR device numbers dynamically.
     // register_chrdev() does that statically eliminating the need to call
     // cdev_init() and cdev_add()
@@ -117,7 +2176,11 @@ static int __init init_kcdev_example(void)
     // service for that purpose. If the kernel has devtmpfs, the
     // devices will be created automatically.
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,4,0)
     kcdev_class = class_create(THIS_MODULE, KCDEVICE_CLASS);
+#else
+    kcdev_class = class_create(KCDEVICE_CLASS);
+#endif
     if (IS_ERR(kcdev_class)) {
         ret = PTR_ERR(kcdev_class);
         kcdev_class = NULL;
@@ -190,9 +2253,29 @@ module_exit(exit_kcdev_example);
 static int kcdev_open(struct inode *inodep, struct file *fp)
 {
     long ret = 0;
+    unsigned int minor = iminor(inodep);
+    struct kcdev_file *kfile;
 
     if (dump_stack_trace) dump_stack();
 
+    if (minor >= kcdev_count)
+        return -ENXIO;
+
+    kfile = kzalloc(sizeof(*kfile), GFP_KERNEL);
+    if (!kfile)
+        return -ENOMEM;
+
+    kfile->dev = &kcdev_devs[minor];
+    mutex_init(&kfile->ring_lock);
+
+    fp->private_data = kfile;
+
+    // The mappings of all the opens of the minor in one place
+    fp->f_mapping = &kcdev_devs[minor].mapping;
+
+    // See kcdev_read_iter() and kcdev_write_iter()
+    fp->f_mode |= FMODE_NOWAIT;
+
     return ret;
 }
 
@@ -205,12 +2288,20 @@ static int kcdev_open(struct inode *inodep, struct file *fp)
         ? do_syscall_64+0x5b/0xf0
         ? entry_SYSCALL_64_after_hwframe+0x44/0xa9
 */
-static ssize_t kcdev_read(struct file *fp, char __user *user_data, size_t size, loff_t *offesetp)
+static ssize_t kcdev_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-    long ret = -EFAULT;
+    ssize_t ret;
 
     if (dump_stack_trace) dump_stack();
 
+    ret = kcdev_async(iocb, to, false);
+    if (ret)
+        return ret;
+
+    ret = kcdev_dev_read(kcdev_file_dev(iocb->ki_filp), iocb->ki_pos, to, iocb->ki_flags & IOCB_NOWAIT);
+    if (ret > 0)
+        iocb->ki_pos += ret;
+
     return ret;
 }
 
@@ -224,15 +2315,32 @@ static ssize_t kcdev_read(struct file *fp, char __user *user_data, size_t size,
         do_syscall_64+0x52/0xc0
         entry_SYSCALL_64_after_hwframe+0x44/0xa9
 */
-static ssize_t kcdev_write(struct file *fp, const char __user * user_data, size_t size, loff_t *offset)
+static ssize_t kcdev_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    long ret = -EFAULT;
+    ssize_t ret;
 
     if (dump_stack_trace) dump_stack();
 
+    ret = kcdev_async(iocb, from, true);
+    if (ret)
+        return ret;
+
+    ret = kcdev_dev_write(kcdev_file_dev(iocb->ki_filp), iocb->ki_pos, from, iocb->ki_flags & IOCB_NOWAIT);
+    if (ret > 0)
+        iocb->ki_pos += ret;
+
     return ret;
 }
 
+// SEEK_END and SEEK_DATA/SEEK_HOLE go by the size, the position can
+// go up to the capacity
+static loff_t kcdev_llseek(struct file *fp, loff_t offset, int whence)
+{
+    struct kcdev_dev *dev = kcdev_file_dev(fp);
+
+    return generic_file_llseek_size(fp, offset, whence, kcdev_capacity, atomic64_read(&dev->size));
+}
+
 /*
     Call stack (5.7):
         dump_stack+0x64/0x88
@@ -244,10 +2352,17 @@ static ssize_t kcdev_write(struct file *fp, const char __user * user_data, size_
 */
 static int kcdev_release(struct inode *inodep, struct file *fp)
 {
+    struct kcdev_file *kfile = fp->private_data;
     long ret = 0;
 
     if (dump_stack_trace) dump_stack();
 
+    // Nothing maps the ring anymore, the mappings hold the file
+    if (kfile->ring)
+        kcdev_ring_destroy(kfile->ring);
+
+    kfree(kfile);
+
     return ret;
 }
 
@@ -266,13 +2381,45 @@ static int kcdev_release(struct inode *inodep, struct file *fp)
 */
 static int kcdev_mmap(struct file *fp, struct vm_area_struct *vma)
 {
-    long ret = -EFAULT;
+    long ret = 0;
 
     if (dump_stack_trace) dump_stack();
 
+    if (vma->vm_pgoff == KCDEV_RING_OFFSET >> PAGE_SHIFT)
+        return kcdev_ring_mmap(fp, vma);
+
+    if (vma->vm_pgoff + vma_pages(vma) > KCDEV_CAPACITY_PAGES)
+        return -EINVAL;
+
+    // Nothing is mapped here, the faults do it page by page
+    if (vma->vm_flags & VM_SHARED) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+        vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP | VM_HUGEPAGE;
+#else
+        vm_flags_set(vma, VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP | VM_HUGEPAGE);
+#endif
+        vma->vm_ops = &kcdev_vm_ops;
+    } else {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+        vma->vm_flags |= VM_DONTEXPAND;
+#else
+        vm_flags_set(vma, VM_DONTEXPAND);
+#endif
+        vma->vm_ops = &kcdev_vm_private_ops;
+    }
+
     return ret;
 }
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+// Lines the address up with the offset for the PMD mappings
+static unsigned long kcdev_get_unmapped_area(struct file *fp, unsigned long addr, unsigned long len,
+                                             unsigned long pgoff, unsigned long flags)
+{
+    return thp_get_unmapped_area(fp, addr, len, pgoff, flags);
+}
+#endif
+
 /*
     Call Trace:
         dump_stack+0x70/0x8d
@@ -284,9 +2431,84 @@ static int kcdev_mmap(struct file *fp, struct vm_area_struct *vma)
 */
 static long kcdev_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
 {
-    long ret = -EFAULT;
+    struct kcdev_dev *dev = kcdev_file_dev(fp);
+    long ret = -ENOIOCTLCMD;
 
     if (dump_stack_trace) dump_stack();
 
+    switch (cmd) {
+    case KCDEV_IOCTL_GET_INFO:
+        ret = kcdev_dev_info(dev, (struct kcdev_info __user *)arg);
+        break;
+
+    case KCDEV_IOCTL_TRUNCATE:
+        if (!(fp->f_mode & FMODE_WRITE))
+            ret = -EBADF;
+        else
+            ret = kcdev_dev_truncate(dev, arg);
+        break;
+
+    case KCDEV_IOCTL_BATCH:
+        ret = kcdev_batch(fp, (struct kcdev_batch __user *)arg);
+        break;
+
+    case KCDEV_IOCTL_CLONE:
+        ret = kcdev_clone(fp, arg);
+        break;
+
+    case KCDEV_IOCTL_DEDUP:
+        if (!(fp->f_mode & FMODE_WRITE))
+            ret = -EBADF;
+        else
+            ret = kcdev_dedup_pass();
+
+        if (!ret)
+            ret = kcdev_dedup_info((struct kcdev_dedup_info __user *)arg);
+        break;
+
+    case KCDEV_IOCTL_DEDUP_INFO:
+        ret = kcdev_dedup_info((struct kcdev_dedup_info __user *)arg);
+        break;
+
+    case KCDEV_IOCTL_COMPRESS:
+        if (!(fp->f_mode & FMODE_WRITE)) {
+            ret = -EBADF;
+            break;
+        }
+
+        kcdev_dev_sweep(dev);
+        ret = kcdev_dev_zinfo(dev, (struct kcdev_zinfo __user *)arg);
+        break;
+
+    case KCDEV_IOCTL_ZINFO:
+        ret = kcdev_dev_zinfo(dev, (struct kcdev_zinfo __user *)arg);
+        break;
+
+    case KCDEV_IOCTL_RING_SETUP:
+        ret = kcdev_ring_setup(fp, (struct kcdev_ring_setup __user *)arg);
+        break;
+
+    case KCDEV_IOCTL_RING_ENTER:
+        ret = kcdev_ring_enter(fp, (struct kcdev_ring_enter __user *)arg);
+        break;
+    }
+
     return ret;
 }
+
+static __poll_t kcdev_poll(struct file *fp, struct poll_table_struct *wait)
+{
+    struct kcdev_file *kfile = fp->private_data;
+    struct kcdev_ring *ring = smp_load_acquire(&kfile->ring);
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    if (!ring)
+        return mask | EPOLLIN | EPOLLRDNORM;
+
+    poll_wait(fp, &ring->cq_wait, wait);
+
+    if (kcdev_ring_completions(ring))
+        mask |= EPOLLIN | EPOLLRDNORM;
+
+    return mask;
+}
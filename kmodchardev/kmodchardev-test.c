@@ -1,15 +1,29 @@
+#define _GNU_SOURCE
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 
+#include <linux/aio_abi.h>
+
 #include "kmodchardev.h"
 
+#define ASSERT2(cond, str_cond) \
+    if (!(cond)) \
+        { printf("(%d) Assertion failed: '" str_cond "' in %s:%d\n", entry_idx, __FILE__, __LINE__); abort(); }
+#define ASSERT(cond) ASSERT2(cond, #cond)
+
 void test_read(int entry_idx) {
     char name[KCDEV_MAX_NAME_LEN];
     int fd;
@@ -105,6 +119,736 @@ void test_mmap(int entry_idx) {
     }
 }
 
+void test_storage(int entry_idx) {
+    char name[KCDEV_MAX_NAME_LEN];
+    char buffer[2*KCDEV_BUF_SIZE];
+    char zeros[2*KCDEV_BUF_SIZE] = { 0 };
+    struct kcdev_info info;
+    off_t far;
+    int fd;
+
+    snprintf(name, sizeof(name) - 1, "/dev/" KCDEV_NAME "%d", entry_idx);
+
+    fd = open(name, O_RDWR);
+
+    if (fd == -1) {
+        fprintf(stderr, "Opening %s failed: %#04x\n", name, errno);
+        return;
+    }
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_GET_INFO, &info) == 0);
+    ASSERT(info.size == 0 && info.pages == 0);
+    ASSERT(read(fd, buffer, sizeof buffer) == 0);
+
+    // Sparse: only the pages written to are allocated, the holes read as zeros
+    far = (off_t)(info.capacity / 2);
+    ASSERT(pwrite(fd, "tail", 4, far) == 4);
+    ASSERT(pwrite(fd, "head", 4, KCDEV_BUF_SIZE - 2) == 4);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_GET_INFO, &info) == 0);
+    ASSERT(info.size == (__u64)far + 4 && info.pages == 3);
+
+    ASSERT(pread(fd, buffer, sizeof buffer, 0) == sizeof buffer);
+    ASSERT(memcmp(buffer, zeros, KCDEV_BUF_SIZE - 2) == 0);
+    ASSERT(memcmp(buffer + KCDEV_BUF_SIZE - 2, "head", 4) == 0);
+    ASSERT(pread(fd, buffer, sizeof buffer, far - 4) == 8);
+    ASSERT(memcmp(buffer, "\0\0\0\0tail", 8) == 0);
+
+    // The file position follows read() and write(), SEEK_END goes by the size
+    ASSERT(lseek(fd, -4, SEEK_END) == far);
+    ASSERT(read(fd, buffer, sizeof buffer) == 4);
+    ASSERT(lseek(fd, 0, SEEK_CUR) == far + 4);
+    ASSERT(write(fd, "more", 4) == 4);
+    ASSERT(lseek(fd, 0, SEEK_END) == far + 8);
+
+    // Up to the capacity
+    ASSERT(pwrite(fd, "xy", 2, info.capacity - 1) == 1);
+    ASSERT(pwrite(fd, "xy", 2, info.capacity) == -1 && errno == ENOSPC);
+    ASSERT(lseek(fd, info.capacity + 1, SEEK_SET) == -1 && errno == EINVAL);
+
+    // Truncating frees the pages past the size and zeroes the tail
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, KCDEV_BUF_SIZE) == 0);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_GET_INFO, &info) == 0);
+    ASSERT(info.size == KCDEV_BUF_SIZE && info.pages == 1);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, KCDEV_BUF_SIZE - 1) == 0);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, KCDEV_BUF_SIZE + 2) == 0);
+    ASSERT(pread(fd, buffer, sizeof buffer, KCDEV_BUF_SIZE - 2) == 4);
+    ASSERT(memcmp(buffer, "h\0\0\0", 4) == 0);
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+
+    fprintf(stdout, "(%d) Test has passed\n", entry_idx);
+
+    close(fd);
+}
+
+void test_mmap_shared(int entry_idx) {
+    const size_t huge = 2ul << 20;
+    char name[KCDEV_MAX_NAME_LEN];
+    char buffer[KCDEV_BUF_SIZE];
+    struct kcdev_info info;
+    char *addr;
+    size_t i;
+    int fd;
+
+    snprintf(name, sizeof(name) - 1, "/dev/" KCDEV_NAME "%d", entry_idx);
+
+    fd = open(name, O_RDWR);
+
+    if (fd == -1) {
+        fprintf(stderr, "Opening %s failed: %#04x\n", name, errno);
+        return;
+    }
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_GET_INFO, &info) == 0);
+
+    // Not past the capacity
+    ASSERT(mmap(NULL, KCDEV_BUF_SIZE, PROT_READ, MAP_SHARED, fd, info.capacity) == MAP_FAILED && errno == EINVAL);
+
+    addr = mmap(NULL, 2*huge, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ASSERT(addr != MAP_FAILED);
+
+    // Reading the holes allocates nothing
+    for (i = 0; i < 2*huge; i += KCDEV_BUF_SIZE)
+        ASSERT(addr[i] == 0);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_GET_INFO, &info) == 0);
+    ASSERT(info.size == 0 && info.pages == 0);
+
+    // The stores through the mapping go to the storage and the other way round
+    memcpy(addr + KCDEV_BUF_SIZE - 2, "head", 4);
+    ASSERT(pread(fd, buffer, 4, KCDEV_BUF_SIZE - 2) == 4);
+    ASSERT(memcmp(buffer, "head", 4) == 0);
+    ASSERT(pwrite(fd, "tail", 4, 3*KCDEV_BUF_SIZE) == 4);
+    ASSERT(memcmp(addr + 3*KCDEV_BUF_SIZE, "tail", 4) == 0);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_GET_INFO, &info) == 0);
+    ASSERT(info.size == 3*KCDEV_BUF_SIZE + 4 && info.pages == 3);
+
+    // A write to an empty 2 MB region fills all of it at once
+    addr[huge] = 'x';
+    ASSERT(ioctl(fd, KCDEV_IOCTL_GET_INFO, &info) == 0);
+    ASSERT(info.pages == 3 || info.pages == 3 + huge/KCDEV_BUF_SIZE);
+    ASSERT(info.size >= huge + 1);
+    ASSERT(pread(fd, buffer, 1, huge) == 1 && buffer[0] == 'x');
+
+    // Truncating leaves zeros in the mapping
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+    for (i = 0; i < 2*huge; i += KCDEV_BUF_SIZE)
+        ASSERT(addr[i] == 0);
+    ASSERT(addr[KCDEV_BUF_SIZE] == 0 && addr[3*KCDEV_BUF_SIZE] == 0);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_GET_INFO, &info) == 0);
+    ASSERT(info.size == 0 && info.pages == 0);
+
+    munmap(addr, 2*huge);
+
+    fprintf(stdout, "(%d) Test has passed\n", entry_idx);
+
+    close(fd);
+}
+
+void test_batch(int entry_idx) {
+    int other_idx = (entry_idx + 1) % KCDEV_DEFAULT_ENTRIES;
+    char name[KCDEV_MAX_NAME_LEN];
+    char in[4][16];
+    char out[4][16];
+    struct kcdev_op ops[8];
+    struct kcdev_batch batch = { .ops = (__u64)(unsigned long)ops };
+    int pipe_fds[2];
+    int other;
+    int fd;
+    int i;
+
+    snprintf(name, sizeof(name) - 1, "/dev/" KCDEV_NAME "%d", entry_idx);
+
+    fd = open(name, O_RDWR);
+
+    if (fd == -1) {
+        fprintf(stderr, "Opening %s failed: %#04x\n", name, errno);
+        return;
+    }
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+
+    // Writes, then the reads of the same places, in one call
+    memset(ops, 0, sizeof ops);
+    for (i = 0; i < 4; ++i) {
+        snprintf(in[i], sizeof in[i], "batch op %d", i);
+
+        ops[i].fd = KCDEV_FD_SELF;
+        ops[i].op = KCDEV_OP_WRITE;
+        ops[i].offset = i*KCDEV_BUF_SIZE*3 + i;
+        ops[i].len = sizeof in[i];
+        ops[i].buf = (__u64)(unsigned long)in[i];
+
+        ops[4 + i] = ops[i];
+        ops[4 + i].op = KCDEV_OP_READ;
+        ops[4 + i].buf = (__u64)(unsigned long)out[i];
+    }
+
+    batch.count = 8;
+    ASSERT(ioctl(fd, KCDEV_IOCTL_BATCH, &batch) == 8);
+    for (i = 0; i < 8; ++i)
+        ASSERT(ops[i].result == sizeof in[0]);
+    ASSERT(memcmp(in, out, sizeof in) == 0);
+
+    // The failures are per op
+    ASSERT(pipe(pipe_fds) == 0);
+    ops[0].fd = pipe_fds[1];
+    ops[1].op = 7;
+    ops[2].buf = 0;
+    ops[3].op = KCDEV_OP_READ;
+    ops[3].offset = 1ull << 62;
+    batch.count = 4;
+    ASSERT(ioctl(fd, KCDEV_IOCTL_BATCH, &batch) == 4);
+    ASSERT(ops[0].result == -EBADF && ops[1].result == -EINVAL);
+    ASSERT(ops[2].result == -EFAULT && ops[3].result == 0);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    ops[0].fd = pipe_fds[1];
+    batch.count = 1;
+    ASSERT(ioctl(fd, KCDEV_IOCTL_BATCH, &batch) == 1 && ops[0].result == -EBADF);
+
+    // Another minor by its descriptor, with the access it was opened with
+    snprintf(name, sizeof(name) - 1, "/dev/" KCDEV_NAME "%d", other_idx);
+    other = open(name, O_RDONLY);
+    ASSERT(other != -1);
+    ops[0] = ops[4];
+    ops[0].fd = other;
+    ASSERT(ioctl(fd, KCDEV_IOCTL_BATCH, &batch) == 1 && ops[0].result >= 0);
+    ops[0].op = KCDEV_OP_WRITE;
+    ops[0].buf = (__u64)(unsigned long)in[0];
+    ASSERT(ioctl(fd, KCDEV_IOCTL_BATCH, &batch) == 1 && ops[0].result == -EBADF);
+    close(other);
+
+    other = open(name, O_RDWR);
+    ASSERT(other != -1);
+    ASSERT(ioctl(other, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+    ops[0].fd = other;
+    ops[1] = ops[0];
+    ops[1].op = KCDEV_OP_READ;
+    ops[1].buf = (__u64)(unsigned long)out[1];
+    batch.count = 2;
+    ASSERT(ioctl(fd, KCDEV_IOCTL_BATCH, &batch) == 2);
+    ASSERT(ops[0].result == sizeof in[0] && ops[1].result == sizeof in[0]);
+    ASSERT(memcmp(out[1], in[0], sizeof in[0]) == 0);
+    ASSERT(ioctl(other, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+    close(other);
+
+    batch.count = KCDEV_BATCH_MAX + 1;
+    ASSERT(ioctl(fd, KCDEV_IOCTL_BATCH, &batch) == -1 && errno == EINVAL);
+    batch.count = 1;
+    batch.ops = 0;
+    ASSERT(ioctl(fd, KCDEV_IOCTL_BATCH, &batch) == -1 && errno == EFAULT);
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+
+    fprintf(stdout, "(%d) Test has passed\n", entry_idx);
+
+    close(fd);
+}
+
+// Queues the reads and the writes of count entries, with the index as the user data
+static void ring_queue(struct kcdev_ring_ctl *ctl, struct kcdev_sqe *sqes, unsigned sq_entries,
+        int op, char (*bufs)[16], int count) {
+    unsigned tail = ctl->sq_tail;
+    int i;
+
+    for (i = 0; i < count; ++i, ++tail) {
+        struct kcdev_sqe *sqe = &sqes[tail & (sq_entries - 1)];
+
+        sqe->fd = KCDEV_FD_SELF;
+        sqe->op = op;
+        sqe->offset = i*KCDEV_BUF_SIZE*5 + i;
+        sqe->len = sizeof bufs[i];
+        sqe->buf = (__u64)(unsigned long)bufs[i];
+        sqe->user_data = i;
+    }
+
+    __atomic_store_n(&ctl->sq_tail, tail, __ATOMIC_RELEASE);
+}
+
+static void ring_reap(int entry_idx, struct kcdev_ring_ctl *ctl, struct kcdev_cqe *cqes, unsigned cq_entries,
+        int count) {
+    unsigned head = ctl->cq_head;
+    int i;
+
+    ASSERT(__atomic_load_n(&ctl->cq_tail, __ATOMIC_ACQUIRE) - head == (unsigned)count);
+
+    for (i = 0; i < count; ++i, ++head) {
+        struct kcdev_cqe *cqe = &cqes[head & (cq_entries - 1)];
+
+        ASSERT(cqe->user_data == (__u64)i && cqe->result == 16);
+    }
+
+    __atomic_store_n(&ctl->cq_head, head, __ATOMIC_RELEASE);
+}
+
+void test_ring(int entry_idx) {
+    char name[KCDEV_MAX_NAME_LEN];
+    char in[8][16];
+    char out[8][16];
+    struct kcdev_ring_setup setup = { .sq_entries = 6, .eventfd = -1 };
+    struct kcdev_ring_enter enter = { 0 };
+    struct kcdev_ring_ctl *ctl;
+    struct pollfd pfd;
+    char *mem;
+    int fd;
+    int efd;
+    int i;
+    unsigned long long events;
+
+    snprintf(name, sizeof(name) - 1, "/dev/" KCDEV_NAME "%d", entry_idx);
+
+    fd = open(name, O_RDWR);
+
+    if (fd == -1) {
+        fprintf(stderr, "Opening %s failed: %#04x\n", name, errno);
+        return;
+    }
+
+    for (i = 0; i < 8; ++i)
+        snprintf(in[i], sizeof in[i], "ring entry %d", i);
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_RING_ENTER, &enter) == -1 && errno == EINVAL);
+    ASSERT(mmap(NULL, KCDEV_BUF_SIZE, PROT_READ, MAP_SHARED, fd, KCDEV_RING_OFFSET) == MAP_FAILED);
+
+    // Run by the ioctl, the completions signal the eventfd
+    efd = eventfd(0, EFD_NONBLOCK);
+    ASSERT(efd != -1);
+    setup.eventfd = efd;
+    ASSERT(ioctl(fd, KCDEV_IOCTL_RING_SETUP, &setup) == 0);
+    ASSERT(setup.sq_entries == 8 && setup.cq_entries == 16);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_RING_SETUP, &setup) == -1 && errno == EBUSY);
+
+    mem = mmap(NULL, setup.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, KCDEV_RING_OFFSET);
+    ASSERT(mem != MAP_FAILED);
+    ctl = (struct kcdev_ring_ctl *)mem;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    ASSERT(poll(&pfd, 1, 0) == 0);
+
+    ring_queue(ctl, (struct kcdev_sqe *)(mem + setup.sqes), setup.sq_entries, KCDEV_OP_WRITE, in, 8);
+    enter.min_complete = 8;
+    ASSERT(ioctl(fd, KCDEV_IOCTL_RING_ENTER, &enter) == 8);
+    ASSERT(ctl->sq_head == 8);
+    ASSERT(poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN));
+    ASSERT(read(efd, &events, sizeof events) == sizeof events && events >= 1);
+    ring_reap(entry_idx, ctl, (struct kcdev_cqe *)(mem + setup.cqes), setup.cq_entries, 8);
+
+    ring_queue(ctl, (struct kcdev_sqe *)(mem + setup.sqes), setup.sq_entries, KCDEV_OP_READ, out, 8);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_RING_ENTER, &enter) == 8);
+    ring_reap(entry_idx, ctl, (struct kcdev_cqe *)(mem + setup.cqes), setup.cq_entries, 8);
+    ASSERT(memcmp(in, out, sizeof in) == 0);
+
+    munmap(mem, setup.size);
+    close(efd);
+    close(fd);
+
+    // Run by the polling thread, which goes to sleep right away here
+    fd = open(name, O_RDWR);
+    ASSERT(fd != -1);
+
+    memset(&setup, 0, sizeof setup);
+    setup.sq_entries = 8;
+    setup.flags = KCDEV_RING_SQPOLL;
+    setup.eventfd = -1;
+    ASSERT(ioctl(fd, KCDEV_IOCTL_RING_SETUP, &setup) == 0);
+
+    mem = mmap(NULL, setup.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, KCDEV_RING_OFFSET);
+    ASSERT(mem != MAP_FAILED);
+    ctl = (struct kcdev_ring_ctl *)mem;
+
+    memset(out, 0, sizeof out);
+    ring_queue(ctl, (struct kcdev_sqe *)(mem + setup.sqes), setup.sq_entries, KCDEV_OP_READ, out, 8);
+    enter.flags = __atomic_load_n(&ctl->flags, __ATOMIC_SEQ_CST) & KCDEV_RING_NEED_WAKEUP ? KCDEV_ENTER_WAKEUP : 0;
+    ASSERT(ioctl(fd, KCDEV_IOCTL_RING_ENTER, &enter) == 0);
+    ring_reap(entry_idx, ctl, (struct kcdev_cqe *)(mem + setup.cqes), setup.cq_entries, 8);
+    ASSERT(memcmp(in, out, sizeof in) == 0);
+
+    munmap(mem, setup.size);
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+
+    fprintf(stdout, "(%d) Test has passed\n", entry_idx);
+
+    close(fd);
+}
+
+void test_aio(int entry_idx) {
+    const size_t size = 4ul << 20;
+    char name[KCDEV_MAX_NAME_LEN];
+    aio_context_t ctx = 0;
+    struct iocb cbs[2];
+    struct iocb *cbps[2] = { &cbs[0], &cbs[1] };
+    struct io_event events[2];
+    struct iovec iov;
+    char *in;
+    char *out;
+    size_t i;
+    int fd;
+
+    snprintf(name, sizeof(name) - 1, "/dev/" KCDEV_NAME "%d", entry_idx);
+
+    fd = open(name, O_RDWR);
+
+    if (fd == -1) {
+        fprintf(stderr, "Opening %s failed: %#04x\n", name, errno);
+        return;
+    }
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+
+    // Not blocking: no pages allocated then
+    iov.iov_base = "nowait";
+    iov.iov_len = 6;
+    ASSERT(pwritev2(fd, &iov, 1, 0, RWF_NOWAIT) == -1 && errno == EAGAIN);
+    ASSERT(pwrite(fd, "wait", 4, 0) == 4);
+    ASSERT(pwritev2(fd, &iov, 1, 0, RWF_NOWAIT) == 6);
+
+    in = malloc(size);
+    out = malloc(size);
+    ASSERT(in && out);
+    for (i = 0; i < size; ++i)
+        in[i] = (char)(i*7 + entry_idx);
+
+    // Large enough for the workqueue with the defaults, both in flight
+    ASSERT(syscall(__NR_io_setup, 2, &ctx) == 0);
+
+    memset(cbs, 0, sizeof cbs);
+    cbs[0].aio_fildes = fd;
+    cbs[0].aio_lio_opcode = IOCB_CMD_PWRITE;
+    cbs[0].aio_buf = (__u64)(unsigned long)in;
+    cbs[0].aio_nbytes = size;
+    cbs[0].aio_offset = KCDEV_BUF_SIZE;
+    cbs[0].aio_data = 1;
+    cbs[1] = cbs[0];
+    cbs[1].aio_offset = KCDEV_BUF_SIZE + size;
+    cbs[1].aio_data = 2;
+
+    ASSERT(syscall(__NR_io_submit, ctx, 2, cbps) == 2);
+    ASSERT(syscall(__NR_io_getevents, ctx, 2, 2, events, NULL) == 2);
+    ASSERT(events[0].res == (__s64)size && events[1].res == (__s64)size);
+    ASSERT(events[0].data + events[1].data == 3);
+
+    cbs[0].aio_lio_opcode = IOCB_CMD_PREAD;
+    cbs[0].aio_buf = (__u64)(unsigned long)out;
+    ASSERT(syscall(__NR_io_submit, ctx, 1, cbps) == 1);
+    ASSERT(syscall(__NR_io_getevents, ctx, 1, 1, events, NULL) == 1);
+    ASSERT(events[0].res == (__s64)size);
+    ASSERT(memcmp(in, out, size) == 0);
+
+    ASSERT(pread(fd, out, size, KCDEV_BUF_SIZE + size) == (ssize_t)size);
+    ASSERT(memcmp(in, out, size) == 0);
+
+    ASSERT(syscall(__NR_io_destroy, ctx) == 0);
+
+    free(in);
+    free(out);
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+
+    fprintf(stdout, "(%d) Test has passed\n", entry_idx);
+
+    close(fd);
+}
+
+void test_ranges(int entry_idx) {
+    const int writers = 4;
+    const size_t slice = 256*1024;
+    char name[KCDEV_MAX_NAME_LEN];
+    char *buffer;
+    int fd;
+    int w;
+    size_t i;
+
+    snprintf(name, sizeof(name) - 1, "/dev/" KCDEV_NAME "%d", entry_idx);
+
+    fd = open(name, O_RDWR);
+
+    if (fd == -1) {
+        fprintf(stderr, "Opening %s failed: %#04x\n", name, errno);
+        return;
+    }
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+
+    // Writers on the neighbouring slices, a byte apart from a page boundary
+    for (w = 0; w < writers; ++w) {
+        pid_t pid = fork();
+
+        ASSERT(pid != -1);
+
+        if (pid == 0) {
+            char block[KCDEV_BUF_SIZE];
+            int round;
+
+            memset(block, 'a' + w, sizeof block);
+
+            for (round = 0; round < 64; ++round) {
+                for (i = 0; i < slice; i += sizeof block)
+                    ASSERT(pwrite(fd, block, sizeof block, w*slice + i + 1) == sizeof block);
+            }
+
+            _exit(0);
+        }
+    }
+
+    for (w = 0; w < writers; ++w) {
+        int status;
+
+        ASSERT(wait(&status) != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    buffer = malloc(writers*slice);
+    ASSERT(buffer);
+    ASSERT(pread(fd, buffer, writers*slice, 1) == (ssize_t)(writers*slice));
+    for (i = 0; i < writers*slice; ++i)
+        ASSERT(buffer[i] == 'a' + (int)(i/slice));
+    free(buffer);
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+
+    fprintf(stdout, "(%d) Test has passed\n", entry_idx);
+
+    close(fd);
+}
+
+void test_clone(int entry_idx) {
+    int src_idx = (entry_idx + 1) % KCDEV_DEFAULT_ENTRIES;
+    char name[KCDEV_MAX_NAME_LEN];
+    char buffer[16];
+    struct kcdev_info info;
+    char *addr;
+    int wronly;
+    int src;
+    int fd;
+
+    snprintf(name, sizeof(name) - 1, "/dev/" KCDEV_NAME "%d", src_idx);
+    src = open(name, O_RDWR);
+
+    snprintf(name, sizeof(name) - 1, "/dev/" KCDEV_NAME "%d", entry_idx);
+    fd = open(name, O_RDWR);
+
+    if (fd == -1 || src == -1) {
+        fprintf(stderr, "Opening %s failed: %#04x\n", name, errno);
+        return;
+    }
+
+    ASSERT(ioctl(src, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+    ASSERT(pwrite(src, "first", 5, 0) == 5);
+    ASSERT(pwrite(src, "second", 6, 5*KCDEV_BUF_SIZE) == 6);
+    ASSERT(pwrite(fd, "gone", 4, 9*KCDEV_BUF_SIZE) == 4);
+
+    // The source by a descriptor open for reading
+    ASSERT(ioctl(fd, KCDEV_IOCTL_CLONE, fd) == -1 && errno == EINVAL);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_CLONE, -1) == -1 && errno == EBADF);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_CLONE, 1) == -1 && errno == EBADF);
+    snprintf(name, sizeof(name) - 1, "/dev/" KCDEV_NAME "%d", src_idx);
+    wronly = open(name, O_WRONLY);
+    ASSERT(wronly != -1);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_CLONE, wronly) == -1 && errno == EBADF);
+    close(wronly);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_CLONE, src) == 0);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_GET_INFO, &info) == 0);
+    ASSERT(info.size == 5*KCDEV_BUF_SIZE + 6 && info.pages == 2);
+    ASSERT(pread(fd, buffer, 5, 0) == 5 && memcmp(buffer, "first", 5) == 0);
+    ASSERT(pread(fd, buffer, 6, 5*KCDEV_BUF_SIZE) == 6 && memcmp(buffer, "second", 6) == 0);
+
+    // Written to on either side, the other one keeps its contents
+    ASSERT(pwrite(src, "FIRST", 5, 0) == 5);
+    ASSERT(pread(fd, buffer, 5, 0) == 5 && memcmp(buffer, "first", 5) == 0);
+    ASSERT(pwrite(fd, "12", 2, 0) == 2);
+    ASSERT(pread(src, buffer, 5, 0) == 5 && memcmp(buffer, "FIRST", 5) == 0);
+    ASSERT(pread(fd, buffer, 5, 0) == 5 && memcmp(buffer, "12rst", 5) == 0);
+
+    // Through the mappings too
+    addr = mmap(NULL, 6*KCDEV_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ASSERT(addr != MAP_FAILED);
+    ASSERT(memcmp(addr + 5*KCDEV_BUF_SIZE, "second", 6) == 0);
+    memcpy(addr + 5*KCDEV_BUF_SIZE, "SECOND", 6);
+    ASSERT(pread(src, buffer, 6, 5*KCDEV_BUF_SIZE) == 6 && memcmp(buffer, "second", 6) == 0);
+    ASSERT(pread(fd, buffer, 6, 5*KCDEV_BUF_SIZE) == 6 && memcmp(buffer, "SECOND", 6) == 0);
+    munmap(addr, 6*KCDEV_BUF_SIZE);
+
+    // The mappings of the source are write protected by the clone
+    addr = mmap(NULL, 6*KCDEV_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, src, 0);
+    ASSERT(addr != MAP_FAILED);
+    addr[5*KCDEV_BUF_SIZE] = 'S';
+    ASSERT(ioctl(fd, KCDEV_IOCTL_CLONE, src) == 0);
+    addr[5*KCDEV_BUF_SIZE + 1] = 'E';
+    ASSERT(pread(fd, buffer, 6, 5*KCDEV_BUF_SIZE) == 6 && memcmp(buffer, "Second", 6) == 0);
+    ASSERT(pread(src, buffer, 6, 5*KCDEV_BUF_SIZE) == 6 && memcmp(buffer, "SEcond", 6) == 0);
+    munmap(addr, 6*KCDEV_BUF_SIZE);
+
+    // Not zeroing the tail of a shared page
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 2) == 0);
+    ASSERT(pread(src, buffer, 5, 0) == 5 && memcmp(buffer, "FIRST", 5) == 0);
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+    ASSERT(ioctl(src, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+
+    fprintf(stdout, "(%d) Test has passed\n", entry_idx);
+
+    close(src);
+    close(fd);
+}
+
+void test_dedup(int entry_idx) {
+    int other_idx = (entry_idx + 1) % KCDEV_DEFAULT_ENTRIES;
+    char name[KCDEV_MAX_NAME_LEN];
+    char page[KCDEV_BUF_SIZE];
+    char buffer[KCDEV_BUF_SIZE];
+    char zeros[KCDEV_BUF_SIZE] = { 0 };
+    struct kcdev_dedup_info before;
+    struct kcdev_dedup_info after;
+    struct kcdev_info info;
+    int other;
+    int fd;
+    int i;
+
+    snprintf(name, sizeof(name) - 1, "/dev/" KCDEV_NAME "%d", other_idx);
+    other = open(name, O_RDWR);
+
+    snprintf(name, sizeof(name) - 1, "/dev/" KCDEV_NAME "%d", entry_idx);
+    fd = open(name, O_RDWR);
+
+    if (fd == -1 || other == -1) {
+        fprintf(stderr, "Opening %s failed: %#04x\n", name, errno);
+        return;
+    }
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+    ASSERT(ioctl(other, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+
+    // The same page 3 times here and once there, and a page of zeros
+    for (i = 0; i < KCDEV_BUF_SIZE; ++i)
+        page[i] = (char)(i ^ (i >> 8));
+    for (i = 0; i < 3; ++i)
+        ASSERT(pwrite(fd, page, sizeof page, i*KCDEV_BUF_SIZE) == sizeof page);
+    ASSERT(pwrite(fd, zeros, sizeof zeros, 3*KCDEV_BUF_SIZE) == sizeof zeros);
+    ASSERT(pwrite(other, page, sizeof page, 7*KCDEV_BUF_SIZE) == sizeof page);
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_DEDUP_INFO, &before) == 0);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_DEDUP, &after) == 0);
+    ASSERT(after.passes == before.passes + 1 && after.page_size > 0);
+    ASSERT(after.scanned >= before.scanned + 5);
+    ASSERT(after.merged >= before.merged + 3);
+    ASSERT(after.zero >= before.zero + 1);
+    ASSERT(after.sharing >= 3);
+
+    // The zero page is a hole now, the contents are the same
+    ASSERT(ioctl(fd, KCDEV_IOCTL_GET_INFO, &info) == 0);
+    ASSERT(info.pages == 3 && info.size == 4*KCDEV_BUF_SIZE);
+    for (i = 0; i < 3; ++i)
+        ASSERT(pread(fd, buffer, sizeof buffer, i*KCDEV_BUF_SIZE) == sizeof buffer && memcmp(buffer, page, sizeof page) == 0);
+    ASSERT(pread(fd, buffer, sizeof buffer, 3*KCDEV_BUF_SIZE) == sizeof buffer && memcmp(buffer, zeros, sizeof zeros) == 0);
+
+    // Copied apart on write
+    ASSERT(pwrite(fd, "x", 1, KCDEV_BUF_SIZE) == 1);
+    ASSERT(pread(fd, buffer, sizeof buffer, 0) == sizeof buffer && memcmp(buffer, page, sizeof page) == 0);
+    ASSERT(pread(other, buffer, sizeof buffer, 7*KCDEV_BUF_SIZE) == sizeof buffer && memcmp(buffer, page, sizeof page) == 0);
+    ASSERT(pread(fd, buffer, 2, KCDEV_BUF_SIZE) == 2 && buffer[0] == 'x' && buffer[1] == page[1]);
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+    ASSERT(ioctl(other, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+
+    fprintf(stdout, "(%d) Test has passed\n", entry_idx);
+
+    close(other);
+    close(fd);
+}
+
+void test_compress(int entry_idx) {
+    char name[KCDEV_MAX_NAME_LEN];
+    char pages[4][KCDEV_BUF_SIZE];
+    char buffer[KCDEV_BUF_SIZE];
+    struct kcdev_zinfo before;
+    struct kcdev_zinfo after;
+    struct kcdev_info info;
+    char *addr;
+    int fd;
+    int i;
+    int j;
+
+    snprintf(name, sizeof(name) - 1, "/dev/" KCDEV_NAME "%d", entry_idx);
+    fd = open(name, O_RDWR);
+
+    if (fd == -1) {
+        fprintf(stderr, "Opening %s failed: %#04x\n", name, errno);
+        return;
+    }
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+
+    // Compressible and different
+    for (i = 0; i < 4; ++i) {
+        for (j = 0; j < KCDEV_BUF_SIZE; ++j)
+            pages[i][j] = 'a' + (j/64 + i*7) % 26;
+        ASSERT(pwrite(fd, pages[i], KCDEV_BUF_SIZE, i*KCDEV_BUF_SIZE) == KCDEV_BUF_SIZE);
+    }
+
+    // The pages just written get another chance the first time around
+    ASSERT(ioctl(fd, KCDEV_IOCTL_ZINFO, &before) == 0);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_COMPRESS, &after) == 0);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_COMPRESS, &after) == 0);
+    ASSERT(after.page_size > 0 && after.compressed == 4);
+    ASSERT(after.compressions >= before.compressions + 4);
+    ASSERT(after.compressed_bytes > 0 && after.compressed_bytes < 4*after.page_size);
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_GET_INFO, &info) == 0);
+    ASSERT(info.pages == 4 && info.size == 4*KCDEV_BUF_SIZE);
+
+    // Brought back on read
+    before = after;
+    ASSERT(pread(fd, buffer, sizeof buffer, 0) == sizeof buffer && memcmp(buffer, pages[0], sizeof buffer) == 0);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_ZINFO, &after) == 0);
+    ASSERT(after.compressed == 3 && after.decompressions == before.decompressions + 1);
+    ASSERT(after.decompress_ns_max > 0 && after.decompress_ns >= after.decompress_ns_max);
+
+    // On write, in the middle of the page
+    ASSERT(pwrite(fd, "xyz", 3, KCDEV_BUF_SIZE + 100) == 3);
+    memcpy(pages[1] + 100, "xyz", 3);
+    ASSERT(pread(fd, buffer, sizeof buffer, KCDEV_BUF_SIZE) == sizeof buffer && memcmp(buffer, pages[1], sizeof buffer) == 0);
+
+    // Through a mapping
+    addr = mmap(NULL, 4*KCDEV_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ASSERT(addr != MAP_FAILED);
+    ASSERT(memcmp(addr + 2*KCDEV_BUF_SIZE, pages[2], KCDEV_BUF_SIZE) == 0);
+
+    // The stores through the mapping keep the page hot, and make it
+    // into the compressed page later
+    ASSERT(ioctl(fd, KCDEV_IOCTL_COMPRESS, &after) == 0);
+    addr[2*KCDEV_BUF_SIZE + 1] = 'Y';
+    pages[2][1] = 'Y';
+    ASSERT(ioctl(fd, KCDEV_IOCTL_COMPRESS, &after) == 0);
+    ASSERT(after.compressed == 3);
+
+    // Zapped when compressed, faulted in again
+    ASSERT(ioctl(fd, KCDEV_IOCTL_COMPRESS, &after) == 0);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_COMPRESS, &after) == 0);
+    ASSERT(after.compressed == 4);
+    addr[2*KCDEV_BUF_SIZE] = 'Z';
+    pages[2][0] = 'Z';
+    ASSERT(pread(fd, buffer, sizeof buffer, 2*KCDEV_BUF_SIZE) == sizeof buffer && memcmp(buffer, pages[2], sizeof buffer) == 0);
+    munmap(addr, 4*KCDEV_BUF_SIZE);
+
+    // The tail of a compressed page zeroed
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 3*KCDEV_BUF_SIZE + 10) == 0);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 4*KCDEV_BUF_SIZE) == 0);
+    memset(pages[3] + 10, 0, KCDEV_BUF_SIZE - 10);
+    ASSERT(pread(fd, buffer, sizeof buffer, 3*KCDEV_BUF_SIZE) == sizeof buffer && memcmp(buffer, pages[3], sizeof buffer) == 0);
+
+    ASSERT(ioctl(fd, KCDEV_IOCTL_TRUNCATE, 0) == 0);
+    ASSERT(ioctl(fd, KCDEV_IOCTL_ZINFO, &after) == 0);
+    ASSERT(after.compressed == 0 && after.compressed_bytes == 0);
+
+    fprintf(stdout, "(%d) Test has passed\n", entry_idx);
+
+    close(fd);
+}
+
 int main() {
     int i;
 
@@ -112,6 +856,15 @@ int main() {
         test_write(i);
         test_read(i);
         test_mmap(i);
+        test_storage(i);
+        test_mmap_shared(i);
+        test_batch(i);
+        test_ring(i);
+        test_aio(i);
+        test_ranges(i);
+        test_clone(i);
+        test_dedup(i);
+        test_compress(i);
         //test_ioctl(i);
         //test_seek(i);
     }
@@ -2,6 +2,7 @@
 #define __kmod_chardev__
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #define KCDEV_MINOR_START    0
 #define KCDEV_MAX_DEVICES    8
@@ -12,4 +13,190 @@
 #define KCDEV_MAX_NAME_LEN    32
 #define KCDEV_DEFAULT_ENTRIES 8
 
+// Each device is a sparse store of pages allocated on the first write,
+// the holes read as zeros. The size grows with the writes up to the
+// capacity, see the kcdev_capacity module parameter.
+#define KCDEV_DEFAULT_CAPACITY (1ull << 30)
+
+#define KCDEV_IOCTL_BASE     'k'
+// Fills struct kcdev_info
+#define KCDEV_IOCTL_GET_INFO _IOR(KCDEV_IOCTL_BASE, 0, struct kcdev_info)
+// Sets the size of the device to the argument in bytes, up to the
+// capacity. The pages past it are freed, the bytes read as zeros.
+#define KCDEV_IOCTL_TRUNCATE _IO(KCDEV_IOCTL_BASE, 1)
+
+// Runs the array of struct kcdev_op described by struct kcdev_batch in
+// one call, in order. Each op reads or writes at its own offset like
+// pread(2)/pwrite(2), the file position doesn't move, and gets its
+// result: the number of bytes or a negative errno. An op goes to the
+// file of the ioctl with KCDEV_FD_SELF, to another kcdev file of the
+// caller by its descriptor otherwise: EBADF unless the file is a kcdev
+// one open for reading for the reads, for writing for the writes. An
+// op failing doesn't stop the others. Returns the number of ops run,
+// fewer than count only if interrupted by a signal, or fails with
+// EFAULT if the array can't be accessed.
+#define KCDEV_IOCTL_BATCH    _IOW(KCDEV_IOCTL_BASE, 2, struct kcdev_batch)
+
+#define KCDEV_BATCH_MAX      4096
+
+#define KCDEV_OP_READ        0
+#define KCDEV_OP_WRITE       1
+
+// The file the batch or the ring comes with
+#define KCDEV_FD_SELF        (-1)
+
+struct kcdev_op {
+    __s32 fd; // KCDEV_FD_SELF or a descriptor of a kcdev file
+    __u32 op; // KCDEV_OP_*
+    __u64 offset;
+    __u64 len;
+    __u64 buf; // User pointer
+    __s64 result; // Set by the call
+};
+
+struct kcdev_batch {
+    __u64 ops; // User pointer to the array of struct kcdev_op
+    __u32 count; // Up to KCDEV_BATCH_MAX
+    __u32 flags; // Must be 0
+};
+
+// Sets up the submission and completion rings of the file, once per
+// file. The rings are mapped with mmap(2) at KCDEV_RING_OFFSET with the
+// size and the layout returned in struct kcdev_ring_setup: struct
+// kcdev_ring_ctl at the start, the arrays of the entries at their
+// offsets. The entries go at the tail of their index masked with the
+// count of the entries less one; the indexes are free running.
+//
+// The application fills struct kcdev_sqe at sq_tail and then advances
+// it with a release store, the kernel runs the entries in order and
+// advances sq_head as it goes. Each entry run posts struct kcdev_cqe at
+// cq_tail, the application consumes them and advances cq_head. The
+// submissions wait while the completion ring is full. The entries run
+// like the ops of KCDEV_IOCTL_BATCH, the descriptors are those of the
+// task running them.
+//
+// Without KCDEV_RING_SQPOLL the entries run in KCDEV_IOCTL_RING_ENTER.
+// With it a kernel thread polls the submission ring and runs them,
+// going to sleep after sq_idle_ms without any: it sets
+// KCDEV_RING_NEED_WAKEUP in the flags of the ring then, and has to be
+// woken with KCDEV_ENTER_WAKEUP once there are entries again, or room
+// for the completions after the ring has filled up. The thread has no
+// descriptors: the entries can only go to the file of the ring with
+// KCDEV_FD_SELF, EBADF otherwise.
+#define KCDEV_IOCTL_RING_SETUP _IOWR(KCDEV_IOCTL_BASE, 3, struct kcdev_ring_setup)
+// Runs the queued entries without KCDEV_RING_SQPOLL, wakes the polling
+// thread with KCDEV_ENTER_WAKEUP, then waits for at least min_complete
+// completions to be there to consume. Returns the number of entries
+// run. poll(2) reports EPOLLIN while there are completions too.
+#define KCDEV_IOCTL_RING_ENTER _IOW(KCDEV_IOCTL_BASE, 4, struct kcdev_ring_enter)
+
+// Beyond any capacity
+#define KCDEV_RING_OFFSET      (1ull << 44)
+#define KCDEV_RING_MAX_ENTRIES 4096
+
+// struct kcdev_ring_setup flags
+#define KCDEV_RING_SQPOLL      0x1
+// struct kcdev_ring_ctl flags
+#define KCDEV_RING_NEED_WAKEUP 0x1
+// struct kcdev_ring_enter flags
+#define KCDEV_ENTER_WAKEUP     0x1
+
+struct kcdev_ring_setup {
+    __u32 sq_entries; // Rounded up to a power of 2
+    __u32 cq_entries; // 0 for twice sq_entries, rounded up to a power of 2
+    __u32 flags; // KCDEV_RING_*
+    __u32 sq_idle_ms; // With KCDEV_RING_SQPOLL
+    __s32 eventfd; // Signalled on the completions, -1 for none
+    __u32 reserved; // Must be 0
+    __u64 size; // Returned: the length to map
+    __u64 sqes; // Returned: the offset of the struct kcdev_sqe array
+    __u64 cqes; // Returned: the offset of the struct kcdev_cqe array
+};
+
+// The heads and the tails of the rings are on their own cache lines
+struct kcdev_ring_ctl {
+    __u32 sq_head;
+    __u32 sq_tail;
+    __u32 flags; // KCDEV_RING_NEED_WAKEUP
+    __u32 reserved0[13];
+    __u32 cq_head;
+    __u32 cq_tail;
+    __u32 reserved1[14];
+};
+
+struct kcdev_sqe {
+    __s32 fd; // KCDEV_FD_SELF or a descriptor of a kcdev file
+    __u32 op; // KCDEV_OP_*
+    __u64 offset;
+    __u64 len;
+    __u64 buf; // User pointer
+    __u64 user_data; // Copied to the completion
+};
+
+struct kcdev_cqe {
+    __u64 user_data;
+    __s64 result; // The number of bytes or a negative errno
+};
+
+struct kcdev_ring_enter {
+    __u32 min_complete; // Up to cq_entries
+    __u32 flags; // KCDEV_ENTER_*
+};
+
+// Replaces the contents of the device with those of the kcdev file
+// whose descriptor is the argument, the size too. That file has to be
+// open for reading, EBADF otherwise. The pages are shared until either
+// side writes to them, through write(2) or a mapping: only the pages
+// written to after that take more memory.
+#define KCDEV_IOCTL_CLONE      _IO(KCDEV_IOCTL_BASE, 5)
+
+// Runs a deduplication pass over all the minors now and then fills
+// struct kcdev_dedup_info. The identical pages are merged into one,
+// shared and copied apart on the next write like after a clone, the
+// pages of zeros are freed and read as holes again. The passes run in
+// the background too with the kcdev_dedup_ms module parameter.
+#define KCDEV_IOCTL_DEDUP      _IOR(KCDEV_IOCTL_BASE, 6, struct kcdev_dedup_info)
+// Fills struct kcdev_dedup_info
+#define KCDEV_IOCTL_DEDUP_INFO _IOR(KCDEV_IOCTL_BASE, 7, struct kcdev_dedup_info)
+
+// Goes once around the pages of the device like the shrinker does under
+// memory pressure and then fills struct kcdev_zinfo: the pages not read,
+// written or faulted in since the previous time around are compressed,
+// the others are left for the next time. The compressed pages are
+// brought back on the next access. Off for the shrinker with the
+// kcdev_compress module parameter.
+#define KCDEV_IOCTL_COMPRESS   _IOR(KCDEV_IOCTL_BASE, 8, struct kcdev_zinfo)
+// Fills struct kcdev_zinfo
+#define KCDEV_IOCTL_ZINFO      _IOR(KCDEV_IOCTL_BASE, 9, struct kcdev_zinfo)
+
+// For all the minors. The memory saved is (sharing + zero)*page_size
+// as long as nothing has been written since.
+struct kcdev_dedup_info {
+    __u64 passes;
+    __u64 scanned; // Pages looked at by all the passes
+    __u64 merged; // Pages replaced with an identical one by all the passes
+    __u64 zero; // Pages of zeros freed by all the passes
+    __u64 sharing; // Pages saved by the sharing as of the last pass, the clones included
+    __u64 page_size;
+};
+
+// For the device. The compression ratio is
+// compressed*page_size/compressed_bytes, the mean latency of bringing a
+// page back decompress_ns/decompressions.
+struct kcdev_zinfo {
+    __u64 compressed; // Pages compressed now, counted in kcdev_info.pages too
+    __u64 compressed_bytes; // Taken by them
+    __u64 compressions;
+    __u64 decompressions;
+    __u64 decompress_ns; // Spent decompressing in total
+    __u64 decompress_ns_max;
+    __u64 page_size;
+};
+
+struct kcdev_info {
+    __u64 size; // Up to the last byte written, SEEK_END is relative to it
+    __u64 capacity; // The writes past it fail with ENOSPC
+    __u64 pages; // Allocated
+};
+
 #endif
@@ -0,0 +1,476 @@
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "kmodmiscdev.h"
+
+#define ASSERT2(cond, str_cond) \
+    if (!(cond)) \
+        { fprintf(stderr, "Assertion failed: '" str_cond "' in %s:%d, errno %d\n", __FILE__, __LINE__, errno); abort(); }
+#define ASSERT(cond) ASSERT2(cond, #cond)
+
+#define MAX_THREADS     64
+#define MAX_CPUS        256
+
+// Throughput and latency benchmark: N producers and M consumers, optionally
+// pinned to CPUs, move a fixed amount of data through /dev/kmisc in every ring
+// mode and, as the baselines, through a pipe and an AF_UNIX stream socketpair.
+// The chunk size is swept by powers of 2 or 4; every run is one CSV line.
+//
+// The latency is that of a producer write(2), blocking on a full ring included,
+// so it shows both the syscall cost and the back pressure. The samples land in
+// a log-linear histogram: 16 sub-buckets per power of 2, within ~6% of the value.
+
+#define HIST_SUB_BITS   4
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    (64 * HIST_SUB)
+
+enum backend_kind {
+    BACKEND_KMISC,
+    BACKEND_PIPE,
+    BACKEND_SOCKETPAIR,
+};
+
+struct backend {
+    const char *name;
+    enum backend_kind kind;
+    int mode;
+};
+
+static const struct backend backends[] = {
+    { "kmisc-locked", BACKEND_KMISC, KMISC_MODE_LOCKED },
+    { "kmisc-spsc", BACKEND_KMISC, KMISC_MODE_SPSC },
+    { "kmisc-mpmc", BACKEND_KMISC, KMISC_MODE_MPMC },
+    { "pipe", BACKEND_PIPE, 0 },
+    { "socketpair", BACKEND_SOCKETPAIR, 0 },
+};
+
+struct hist {
+    unsigned long long count[HIST_BUCKETS];
+};
+
+struct bench {
+    const struct backend *backend;
+    size_t chunk;
+    size_t total;
+    int producers;
+    int consumers;
+    int write_fd;       // Shared by the producers of a pipe or a socketpair
+    int read_fd;        // Shared by the consumers of a pipe or a socketpair
+    unsigned long long consumed;
+    unsigned long long writes;
+    struct hist hist;
+    pthread_mutex_t hist_lock;
+};
+
+struct thread_arg {
+    struct bench *b;
+    int index;
+};
+
+static int producer_cpus[MAX_CPUS];
+static int producer_cpu_count;
+static int consumer_cpus[MAX_CPUS];
+static int consumer_cpu_count;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int hist_bucket(unsigned long long v) {
+    int exp;
+
+    if (v < HIST_SUB)
+        return v;
+
+    exp = 63 - __builtin_clzll(v);
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static unsigned long long hist_value(int bucket) {
+    int exp;
+
+    if (bucket < HIST_SUB)
+        return bucket;
+
+    // The lower bound of the bucket
+    exp = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+    return (1ull << exp) | ((unsigned long long)(bucket % HIST_SUB) << (exp - HIST_SUB_BITS));
+}
+
+static unsigned long long hist_percentile(const struct hist *h, double p) {
+    unsigned long long total = 0;
+    unsigned long long rank;
+    unsigned long long seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; ++i)
+        total += h->count[i];
+    if (total == 0)
+        return 0;
+
+    rank = (unsigned long long)(p * total);
+    if (rank >= total)
+        rank = total - 1;
+
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->count[i];
+        if (seen > rank)
+            return hist_value(i);
+    }
+
+    return hist_value(HIST_BUCKETS - 1);
+}
+
+static int parse_cpus(const char *list, int *cpus) {
+    char *copy, *tok, *save;
+    int count = 0;
+
+    copy = strdup(list);
+    ASSERT(copy);
+
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int first, last;
+
+        if (sscanf(tok, "%d-%d", &first, &last) != 2)
+            last = first = atoi(tok);
+
+        for (; first <= last && count < MAX_CPUS; ++first)
+            cpus[count++] = first;
+    }
+
+    free(copy);
+
+    return count;
+}
+
+static void pin(const int *cpus, int count, int index) {
+    cpu_set_t set;
+
+    if (count == 0)
+        return;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpus[index % count], &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof set, &set) != 0)
+        fprintf(stderr, "Couldn't pin to CPU %d\n", cpus[index % count]);
+}
+
+static void *producer(void *arg) {
+    struct thread_arg *ta = arg;
+    struct bench *b = ta->b;
+    struct hist *hist;
+    char *buffer;
+    size_t left = b->total / b->producers;
+    unsigned long long writes = 0;
+    int fd;
+    int i;
+
+    pin(producer_cpus, producer_cpu_count, ta->index);
+
+    if (b->backend->kind == BACKEND_KMISC) {
+        fd = open("/dev/" KMISC_NAME, O_WRONLY);
+        ASSERT(fd != -1);
+    } else
+        fd = b->write_fd;
+
+    buffer = calloc(1, b->chunk);
+    hist = calloc(1, sizeof *hist);
+    ASSERT(buffer && hist);
+
+    while (left > 0) {
+        unsigned long long start = now_ns();
+        ssize_t n = write(fd, buffer, left < b->chunk ? left : b->chunk);
+
+        ASSERT(n > 0);
+        hist->count[hist_bucket(now_ns() - start)]++;
+        left -= n;
+        ++writes;
+    }
+
+    pthread_mutex_lock(&b->hist_lock);
+    for (i = 0; i < HIST_BUCKETS; ++i)
+        b->hist.count[i] += hist->count[i];
+    b->writes += writes;
+    pthread_mutex_unlock(&b->hist_lock);
+
+    free(hist);
+    free(buffer);
+    if (b->backend->kind == BACKEND_KMISC)
+        close(fd);
+
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    struct thread_arg *ta = arg;
+    struct bench *b = ta->b;
+    struct pollfd pfd;
+    char *buffer;
+    int fd;
+
+    pin(consumer_cpus, consumer_cpu_count, ta->index);
+
+    // Non-blocking so that the consumers notice the end of the run
+    if (b->backend->kind == BACKEND_KMISC) {
+        fd = open("/dev/" KMISC_NAME, O_RDONLY | O_NONBLOCK);
+        ASSERT(fd != -1);
+    } else
+        fd = b->read_fd;
+
+    buffer = malloc(b->chunk);
+    ASSERT(buffer);
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while (__atomic_load_n(&b->consumed, __ATOMIC_RELAXED) < b->total) {
+        ssize_t n = read(fd, buffer, b->chunk);
+
+        if (n > 0)
+            __atomic_add_fetch(&b->consumed, n, __ATOMIC_RELAXED);
+        else {
+            ASSERT(n == -1 && errno == EAGAIN);
+            poll(&pfd, 1, 10);
+        }
+    }
+
+    free(buffer);
+    if (b->backend->kind == BACKEND_KMISC)
+        close(fd);
+
+    return NULL;
+}
+
+static int setup(struct bench *b, int ctl_fd, size_t ring_bytes) {
+    int fds[2];
+
+    switch (b->backend->kind) {
+    case BACKEND_KMISC:
+        if (ioctl(ctl_fd, KMISC_IOCTL_SET_MODE, b->backend->mode) != 0) {
+            fprintf(stderr, "Couldn't switch to %s: %#04x\n", b->backend->name, errno);
+            return -1;
+        }
+        return 0;
+
+    case BACKEND_PIPE:
+        ASSERT(pipe(fds) == 0);
+        if (ring_bytes)
+            fcntl(fds[1], F_SETPIPE_SZ, (int)ring_bytes);
+        break;
+
+    case BACKEND_SOCKETPAIR:
+        ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        if (ring_bytes) {
+            int size = ring_bytes;
+
+            setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+            setsockopt(fds[0], SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+        }
+        break;
+    }
+
+    b->read_fd = fds[0];
+    b->write_fd = fds[1];
+    ASSERT(fcntl(b->read_fd, F_SETFL, fcntl(b->read_fd, F_GETFL) | O_NONBLOCK) == 0);
+
+    return 0;
+}
+
+// The kmisc ring is backed with 2 MiB pages
+static int huge;
+
+static void run(int ctl_fd, const struct backend *backend, int producers, int consumers,
+        size_t chunk, size_t total, size_t ring_bytes) {
+    pthread_t threads[2*MAX_THREADS];
+    struct thread_arg args[2*MAX_THREADS];
+    struct bench *b;
+    unsigned long long start;
+    double elapsed;
+    int i;
+
+    b = calloc(1, sizeof *b);
+    ASSERT(b);
+
+    b->backend = backend;
+    b->chunk = chunk;
+    b->total = total - total % producers;
+    b->producers = producers;
+    b->consumers = consumers;
+    b->read_fd = b->write_fd = -1;
+    pthread_mutex_init(&b->hist_lock, NULL);
+
+    if (setup(b, ctl_fd, ring_bytes) != 0) {
+        free(b);
+        return;
+    }
+
+    start = now_ns();
+
+    for (i = 0; i < consumers; ++i) {
+        args[i].b = b;
+        args[i].index = i;
+        ASSERT(pthread_create(&threads[i], NULL, consumer, &args[i]) == 0);
+    }
+    for (i = 0; i < producers; ++i) {
+        args[consumers + i].b = b;
+        args[consumers + i].index = i;
+        ASSERT(pthread_create(&threads[consumers + i], NULL, producer, &args[consumers + i]) == 0);
+    }
+    for (i = 0; i < producers + consumers; ++i)
+        ASSERT(pthread_join(threads[i], NULL) == 0);
+
+    elapsed = (now_ns() - start)*1e-9;
+
+    fprintf(stdout, "%s%s,%d,%d,%zu,%zu,%.6f,%.1f,%.0f,%llu,%llu,%llu\n",
+        backend->name, backend->kind == BACKEND_KMISC && huge ? "+huge" : "", producers, consumers, chunk, b->total, elapsed,
+        b->total/elapsed/(1 << 20), b->writes/elapsed,
+        hist_percentile(&b->hist, 0.5), hist_percentile(&b->hist, 0.99),
+        hist_percentile(&b->hist, 0.999));
+    fflush(stdout);
+
+    if (b->read_fd != -1)
+        close(b->read_fd);
+    if (b->write_fd != -1)
+        close(b->write_fd);
+    pthread_mutex_destroy(&b->hist_lock);
+    free(b);
+}
+
+static void usage(const char *name) {
+    size_t i;
+
+    fprintf(stderr,
+        "Usage: %s [-p producers] [-c consumers] [-P cpus] [-C cpus] [-t total MiB]\n"
+        "          [-n max writes per run] [-s min chunk] [-S max chunk] [-f chunk factor]\n"
+        "          [-r ring bytes] [-H] [-b backend]...\n"
+        "  -H: back the kmisc ring with 2 MiB pages, needs -r 2097152 at least\n"
+        "  cpus: a list like 0,2,4-7, thread i runs on the (i %% count)-th one\n"
+        "  backends:", name);
+    for (i = 0; i < sizeof backends/sizeof backends[0]; ++i)
+        fprintf(stderr, " %s", backends[i].name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
+    int producers = 1;
+    int consumers = 1;
+    size_t total = 256ul << 20;
+    size_t max_writes = 1ul << 20;
+    size_t min_chunk = 1;
+    size_t max_chunk = 1ul << 20;
+    size_t factor = 4;
+    size_t ring_bytes = 0;
+    int selected[sizeof backends/sizeof backends[0]] = { 0 };
+    int any_selected = 0;
+    size_t chunk;
+    int ctl_fd = -1;
+    int opt;
+    size_t i;
+
+    while ((opt = getopt(argc, argv, "p:c:P:C:t:n:s:S:f:r:Hb:")) != -1) {
+        switch (opt) {
+        case 'p': producers = atoi(optarg); break;
+        case 'c': consumers = atoi(optarg); break;
+        case 'P': producer_cpu_count = parse_cpus(optarg, producer_cpus); break;
+        case 'C': consumer_cpu_count = parse_cpus(optarg, consumer_cpus); break;
+        case 't': total = strtoull(optarg, NULL, 0) << 20; break;
+        case 'n': max_writes = strtoull(optarg, NULL, 0); break;
+        case 's': min_chunk = strtoull(optarg, NULL, 0); break;
+        case 'S': max_chunk = strtoull(optarg, NULL, 0); break;
+        case 'f': factor = strtoull(optarg, NULL, 0); break;
+        case 'r': ring_bytes = strtoull(optarg, NULL, 0); break;
+        case 'H': huge = 1; break;
+        case 'b':
+            for (i = 0; i < sizeof backends/sizeof backends[0]; ++i)
+                if (strcmp(optarg, backends[i].name) == 0)
+                    break;
+            if (i == sizeof backends/sizeof backends[0]) {
+                usage(argv[0]);
+                return 1;
+            }
+            selected[i] = any_selected = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    ASSERT(producers > 0 && producers <= MAX_THREADS);
+    ASSERT(consumers > 0 && consumers <= MAX_THREADS);
+    ASSERT(min_chunk > 0 && min_chunk <= max_chunk && factor > 1 && max_writes > 0);
+
+    if (!any_selected)
+        for (i = 0; i < sizeof backends/sizeof backends[0]; ++i)
+            selected[i] = 1;
+
+    for (i = 0; i < sizeof backends/sizeof backends[0]; ++i) {
+        if (!selected[i] || backends[i].kind != BACKEND_KMISC)
+            continue;
+
+        ctl_fd = open("/dev/" KMISC_NAME, O_RDWR);
+
+        if (ctl_fd == -1) {
+            fprintf(stderr, "Couldn't open the file: %#04x\n", errno);
+            return 1;
+        }
+
+        // A flight recorder or a record ring would skew the numbers
+        ASSERT(ioctl(ctl_fd, KMISC_IOCTL_SET_FLAGS, 0) == 0);
+        if (ring_bytes)
+            ASSERT(ioctl(ctl_fd, KMISC_IOCTL_SET_SIZE, ring_bytes) == 0);
+        if (huge && ioctl(ctl_fd, KMISC_IOCTL_SET_FLAGS, KMISC_RING_HUGE) != 0) {
+            fprintf(stderr, "Couldn't get a huge page ring: %#04x\n", errno);
+            return 1;
+        }
+        break;
+    }
+
+    fprintf(stdout, "backend,producers,consumers,chunk,bytes,seconds,mb_s,ops_s,p50_ns,p99_ns,p999_ns\n");
+
+    for (chunk = min_chunk; chunk <= max_chunk; chunk *= factor) {
+        // Small chunks are capped by the number of writes to keep the run short
+        size_t bytes = chunk * max_writes < total ? chunk * max_writes : total;
+
+        if (bytes < (size_t)producers)
+            bytes = producers;
+
+        for (i = 0; i < sizeof backends/sizeof backends[0]; ++i) {
+            if (!selected[i])
+                continue;
+
+            // Anything else would corrupt the ring
+            if (backends[i].kind == BACKEND_KMISC && backends[i].mode == KMISC_MODE_SPSC &&
+                    (producers > 1 || consumers > 1))
+                continue;
+
+            run(ctl_fd, &backends[i], producers, consumers, chunk, bytes, ring_bytes);
+        }
+    }
+
+    if (ctl_fd != -1) {
+        // Gives the huge pages back
+        if (huge)
+            ASSERT(ioctl(ctl_fd, KMISC_IOCTL_SET_FLAGS, 0) == 0);
+        ASSERT(ioctl(ctl_fd, KMISC_IOCTL_SET_MODE, KMISC_MODE_LOCKED) == 0);
+        close(ctl_fd);
+    }
+
+    return 0;
+}
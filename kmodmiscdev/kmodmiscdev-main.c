@@ -10,6 +10,32 @@
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/log2.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/topology.h>
+#include <linux/irq_work.h>
+#include <linux/hardirq.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/huge_mm.h>
+#include <linux/kthread.h>
+#include <linux/file.h>
+#include <linux/cred.h>
+#include <linux/sched/signal.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,17,0)
+#include <linux/pfn_t.h>
+#endif
 
 #include "kmodmiscdev.h"
 
@@ -23,250 +49,2741 @@ static bool dump_stack_trace = false;
 module_param(dump_stack_trace, bool, 0644); // Permissions in /sysfs
 MODULE_PARM_DESC(dump_stack_trace, "Dumping stack traces");
 
+static uint ring_mode = KMISC_MODE_LOCKED;
+
+module_param(ring_mode, uint, 0444); // Permissions in /sysfs
+MODULE_PARM_DESC(ring_mode, "Initial ring mode: 0 - locked, 1 - SPSC, 2 - MPMC");
+
+static ulong ring_size = KMISC_BUF_SIZE;
+
+module_param(ring_size, ulong, 0444); // Permissions in /sysfs
+MODULE_PARM_DESC(ring_size, "Initial ring size in bytes, a power of 2 from a page to 1 GiB");
+
+static bool ring_huge = false;
+
+module_param(ring_huge, bool, 0444); // Permissions in /sysfs
+MODULE_PARM_DESC(ring_huge, "Back the rings with PMD sized pages, needs a ring_size of 2 MiB at least");
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+#define RING_BUF_HUGE_ORDER     HPAGE_PMD_ORDER
+#else
+#define RING_BUF_HUGE_ORDER     0 // Not supported
+#endif
+
+// Per-cpu so that counting doesn't bounce a cache line between the
+// readers and the writers. Summed up when shown, high_water is the
+// maximum over the cpus.
+struct ring_buf_stats {
+    u64 bytes_written;
+    u64 bytes_read;
+    u64 writes;
+    u64 reads;
+    u64 short_writes; // Less than asked for
+    u64 short_reads;
+    u64 full; // Writes that found no space
+    u64 empty; // Reads that found no data
+    u64 contended; // Locks found taken, cmpxchg retries
+    u64 high_water; // Bytes used after a write
+};
+
+#define ring_buf_stat_add(ring, field, val)  this_cpu_add((ring)->stats->field, (val))
+#define ring_buf_stat_inc(ring, field)       this_cpu_inc((ring)->stats->field)
+// Racy against preemption, good enough for a statistic
+#define ring_buf_stat_max(ring, field, val) \
+    do { \
+        u64 __val = (val); \
+        if (__val > this_cpu_read((ring)->stats->field)) \
+            this_cpu_write((ring)->stats->field, __val); \
+    } while (0)
+
+// A reader of its own in the broadcast mode, subscribed on the first read
+struct ring_buf_cursor {
+    struct list_head node; // In ring_buf.cursors while subscribed
+    struct ring_buf *ring; // Subscribed to, NULL if not
+    u64 idx;
+};
+
 struct ring_buf {
-    spinlock_t read_lock;
-    spinlock_t write_lock;
+    // Mutexes: the copies to and from the user buffers may fault
+    struct mutex read_lock;
+    // Readers and writers don't bounce each other's lock
+    struct mutex write_lock ____cacheline_aligned_in_smp;
+    // Taken for reading around every access to the data pages, for
+    // writing to swap them or to switch the mode. The read side is
+    // a per-cpu counter so the lock-free modes stay lock-free.
+    struct percpu_rw_semaphore config_sem;
+    unsigned int mode; // KMISC_MODE_*
+    unsigned int flags; // KMISC_RING_*
     size_t size;
-    atomic64_t read_idx;
-    atomic64_t write_idx;
-    struct page *pages;
-    void *buf;
+    struct kmisc_ring_ctl *ctl; // Indexes, shared with the user mappings
+    struct page *ctl_page;
+    struct page **pages;
+    size_t page_count;
+    unsigned int order; // Of the pages, RING_BUF_HUGE_ORDER for a huge ring
+    void *buf; // The double mapping, NULL for a huge ring
+    int node; // NUMA node of the pages, NUMA_NO_NODE for any
+    atomic_t mapped; // User mappings, the pages can't be swapped under them
+    atomic64_t dropped; // Overwritten before being read
+    struct ring_buf_stats __percpu *stats;
+    wait_queue_head_t read_wait; // Readers waiting for data
+    wait_queue_head_t write_wait; // Writers waiting for space
+    // In-kernel producers, see ring_buf_reserve(). Attached under
+    // config_sem, the configuration stays fixed while there are any.
+    unsigned int producers;
+    raw_spinlock_t reserve_lock;
+    // Their write_head: the one in ctl is writable through the user
+    // mappings, it only mirrors this one for them to see
+    u64 reserve_head;
+    struct irq_work wake_work; // Can't wake up from NMI directly
+    spinlock_t cursors_lock;
+    struct list_head cursors; // Subscribed in the broadcast mode
 };
 
-static struct ring_buf *ring_buf_alloc(size_t page_count)
+static void ring_buf_wake_work(struct irq_work *work);
+
+static bool ring_buf_size_valid(size_t size, unsigned int order)
+{
+    return size >= (PAGE_SIZE << order) && size <= KMISC_MAX_BUF_SIZE && is_power_of_2(size);
+}
+
+static void ring_buf_free_pages(struct page **pages, size_t page_count, unsigned int order, void *buf)
+{
+    size_t i;
+
+    if (buf)
+        vunmap(buf);
+
+    if (pages) {
+        for (i = 0; i < page_count; ++i) {
+            if (pages[i])
+                __free_pages(pages[i], order);
+        }
+
+        kvfree(pages);
+    }
+}
+
+// The data pages are allocated one by one: a single high order
+// allocation of a few megabytes already fails on a fragmented
+// system. vmap() stitches them together, twice to wrap around.
+//
+// A huge ring gets PMD sized pages instead and no vmap(): the kernel
+// reaches them through the linear mapping, already mapped with huge
+// pages, and the copies are split at the page boundaries. The pages
+// are zeroed, they end up in the user mappings.
+static int ring_buf_alloc_pages(size_t page_count, unsigned int order, int node, struct page ***pages_out,
+                                void **buf_out)
+{
+	size_t i;
+	struct page **pages;
+	struct page **double_map; // Wraps around
+	void *buf;
+	gfp_t gfp = GFP_KERNEL | __GFP_ZERO;
+
+	if (order)
+		gfp |= __GFP_COMP | __GFP_RETRY_MAYFAIL | __GFP_NOWARN;
+
+	pages = kvmalloc_node(array_size(page_count, sizeof(struct page*)), GFP_KERNEL | __GFP_ZERO, node);
+	if (!pages)
+		return -ENOMEM;
+
+	for (i = 0; i < page_count; ++i) {
+		pages[i] = alloc_pages_node(node, gfp, order);
+		if (!pages[i])
+			goto fail;
+
+		cond_resched();
+	}
+
+	if (order) {
+		*pages_out = pages;
+		*buf_out = NULL;
+
+		return 0;
+	}
+
+	double_map = kvcalloc(page_count*2, sizeof(struct page*), GFP_KERNEL);
+	if (!double_map)
+		goto fail;
+
+	for (i = 0; i < page_count; ++i)
+		double_map[i] = double_map[i + page_count] = pages[i];
+
+	buf = vmap(double_map, page_count*2, VM_MAP, PAGE_KERNEL);
+
+	kvfree(double_map);
+
+	if (!buf)
+		goto fail;
+
+	*pages_out = pages;
+	*buf_out = buf;
+
+	return 0;
+
+fail:
+
+    ring_buf_free_pages(pages, page_count, order, NULL);
+
+    return -ENOMEM;
+}
+
+static struct ring_buf *ring_buf_alloc(size_t size, int node, bool huge)
+{
+	unsigned int order = huge ? RING_BUF_HUGE_ORDER : 0;
+	size_t page_count = size >> (PAGE_SHIFT + order);
+	struct ring_buf* ring;
+
+	ring = kzalloc_node(sizeof(struct ring_buf), GFP_KERNEL, node);
+	if (!ring)
+		return NULL;
+
+	ring->stats = alloc_percpu(struct ring_buf_stats);
+	if (!ring->stats) {
+		kfree(ring);
+		return NULL;
+	}
+
+	if (percpu_init_rwsem(&ring->config_sem)) {
+		free_percpu(ring->stats);
+		kfree(ring);
+		return NULL;
+	}
+
+	ring->size = size;
+	ring->page_count = page_count;
+	ring->order = order;
+	ring->flags = order ? KMISC_RING_HUGE : 0;
+	ring->node = node;
+	mutex_init(&ring->read_lock);
+	mutex_init(&ring->write_lock);
+	atomic_set(&ring->mapped, 0);
+	atomic64_set(&ring->dropped, 0);
+	init_waitqueue_head(&ring->read_wait);
+	init_waitqueue_head(&ring->write_wait);
+	raw_spin_lock_init(&ring->reserve_lock);
+	spin_lock_init(&ring->cursors_lock);
+	INIT_LIST_HEAD(&ring->cursors);
+	init_irq_work(&ring->wake_work, ring_buf_wake_work);
+
+	ring->ctl_page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO, 0);
+
+	if (!ring->ctl_page)
+		goto fail;
+
+	ring->ctl = page_address(ring->ctl_page);
+	ring->ctl->size = ring->size;
+	ring->ctl->flags = ring->flags;
+
+	if (ring_buf_alloc_pages(page_count, order, node, &ring->pages, &ring->buf))
+		goto fail;
+
+	return ring;
+
+fail:
+
+    if (ring->ctl_page)
+        __free_page(ring->ctl_page);
+
+    percpu_free_rwsem(&ring->config_sem);
+    free_percpu(ring->stats);
+    kfree(ring);
+
+    return NULL;
+}
+
+static void ring_buf_free(struct ring_buf *ring)
+{
+    if (ring) {
+        irq_work_sync(&ring->wake_work);
+        ring_buf_free_pages(ring->pages, ring->page_count, ring->order, ring->buf);
+
+        if (ring->ctl_page)
+            __free_page(ring->ctl_page);
+
+        percpu_free_rwsem(&ring->config_sem);
+        free_percpu(ring->stats);
+        kfree(ring);
+    }
+}
+
+static size_t ring_buf_used(struct ring_buf *ring)
+{
+    u64 write_idx = smp_load_acquire(&ring->ctl->write_idx);
+    s64 used = write_idx - smp_load_acquire(&ring->ctl->read_idx);
+
+    // The writers push read_idx in the overwrite mode
+    return used > 0 ? used : 0;
+}
+
+// What a reader has to read: from its cursor in the broadcast mode,
+// the cursor not being behind read_idx when a writer pushed it
+static size_t ring_buf_cursor_used(struct ring_buf *ring, struct ring_buf_cursor *cursor)
+{
+    u64 write_idx;
+    u64 idx;
+    s64 used;
+
+    if (!(READ_ONCE(ring->flags) & KMISC_RING_BROADCAST) || !cursor || READ_ONCE(cursor->ring) != ring)
+        return ring_buf_used(ring);
+
+    write_idx = smp_load_acquire(&ring->ctl->write_idx);
+    idx = max_t(u64, READ_ONCE(cursor->idx), smp_load_acquire(&ring->ctl->read_idx));
+    used = write_idx - idx;
+
+    return used > 0 ? used : 0;
+}
+
+// A writev() of several segments goes in whole or not at all in the
+// byte mode: the segments often are a header and a payload, and the
+// reader can't tell where a truncated one stopped
+static bool ring_buf_write_whole(struct iov_iter *from)
+{
+    return iter_is_iovec(from) && from->nr_segs > 1;
+}
+
+// Whether a write of size bytes would make progress: any free byte
+// does in the byte mode unless the write goes in whole, a record needs
+// room for all of it, and the overwrite mode always does. A record or
+// a whole write that can never fit is left for the write to fail on.
+static bool ring_buf_writable(struct ring_buf *ring, size_t size, bool whole)
+{
+    size_t ring_size = READ_ONCE(ring->size);
+    size_t space = ring_size - ring_buf_used(ring);
+    unsigned int flags = READ_ONCE(ring->flags);
+
+    if (flags & KMISC_RING_OVERWRITE)
+        return true;
+
+    if (flags & KMISC_RING_RECORDS)
+        return space >= KMISC_RECORD_SIZE(size) || KMISC_RECORD_SIZE(size) > ring_size;
+
+    if (whole)
+        return space >= size || size > ring_size;
+
+    return space > 0;
+}
+
+// Counts the times the lock was found taken, only then waiting for it
+static void ring_buf_lock(struct ring_buf *ring, struct mutex *lock)
+{
+    if (!mutex_trylock(lock)) {
+        ring_buf_stat_inc(ring, contended);
+        mutex_lock(lock);
+    }
+}
+
+// wq_has_sleeper() has the barrier pairing with the one in
+// prepare_to_wait() or kmisc_file_watch(), so the common case of
+// nobody waiting costs no lock. The watch entries of the files are
+// only on the queues while someone waits on a file.
+static void ring_buf_wake(wait_queue_head_t *wq, __poll_t events)
+{
+    if (wq_has_sleeper(wq))
+        wake_up_interruptible_poll(wq, events);
+}
+
+static void ring_buf_wake_work(struct irq_work *work)
+{
+    struct ring_buf *ring = container_of(work, struct ring_buf, wake_work);
+
+    ring_buf_wake(&ring->read_wait, EPOLLIN | EPOLLRDNORM);
+}
+
+// The address of idx in the ring, *contig gets how many bytes from
+// there on are contiguous: up to the ring size thanks to the double
+// mapping, up to the end of the page in a huge ring.
+static void *ring_buf_addr(struct ring_buf *ring, u64 idx, size_t *contig)
+{
+    // Instead of modulo % as the size is a power of 2
+    size_t off = idx & (ring->size - 1);
+    size_t page_size = PAGE_SIZE << ring->order;
+
+    if (likely(ring->buf)) {
+        if (contig)
+            *contig = ring->size;
+        return (u8*)ring->buf + off;
+    }
+
+    if (contig)
+        *contig = page_size - (off & (page_size - 1));
+    return (u8*)page_address(ring->pages[off >> (PAGE_SHIFT + ring->order)]) + (off & (page_size - 1));
+}
+
+// The copy helpers return the number of bytes copied, less than
+// asked only when a user buffer faults, and advance the iterator.
+// Thanks to the double mapping a chunk up to the ring size never
+// needs splitting, however many segments the iterator has. The huge
+// rings take a copy per page crossed.
+static size_t ring_buf_copy_out(struct ring_buf *ring, u64 read_idx, struct iov_iter *to, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        size_t contig;
+        void *addr = ring_buf_addr(ring, read_idx + done, &contig);
+        size_t chunk = min(size - done, contig);
+        size_t copied = copy_to_iter(addr, chunk, to);
+
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+
+    return done;
+}
+
+static size_t ring_buf_copy_in(struct ring_buf *ring, u64 write_idx, struct iov_iter *from, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        size_t contig;
+        void *addr = ring_buf_addr(ring, write_idx + done, &contig);
+        size_t chunk = min(size - done, contig);
+        size_t copied = copy_from_iter(addr, chunk, from);
+
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+
+    return done;
+}
+
+static void ring_buf_zero(struct ring_buf *ring, u64 idx, size_t size)
+{
+    while (size) {
+        size_t contig;
+        void *addr = ring_buf_addr(ring, idx, &contig);
+        size_t chunk = min(size, contig);
+
+        memset(addr, 0, chunk);
+        idx += chunk;
+        size -= chunk;
+    }
+}
+
+// The headers are aligned and never cross a page boundary
+static struct kmisc_record *ring_buf_record(struct ring_buf *ring, u64 idx)
+{
+    return ring_buf_addr(ring, idx, NULL);
+}
+
+// Fills the KMISC_RECORD_SIZE(size) bytes at write_idx with a record.
+// If the payload faults, the record is marked as padding: the space
+// may be already committed to, and the readers skip it.
+static bool ring_buf_copy_in_record(struct ring_buf *ring, u64 write_idx, struct iov_iter *from, size_t size)
+{
+    struct kmisc_record *rec = ring_buf_record(ring, write_idx);
+    bool copied;
+
+    copied = ring_buf_copy_in(ring, write_idx + sizeof(*rec), from, size) == size;
+
+    rec->len = size;
+    rec->flags = copied ? 0 : KMISC_RECORD_PAD;
+
+    return copied;
+}
+
+// How many bytes of whole records starting at idx fit into out_buf_size,
+// looking at no more than avail bytes. The padding left by the faulted
+// writers is skipped, *skip gets the size of it in front of the records.
+// Returns -EMSGSIZE if the first record doesn't fit into the buffer and
+// -EIO if it doesn't make sense.
+static ssize_t ring_buf_records_len(struct ring_buf *ring, u64 idx, size_t avail, size_t out_buf_size,
+                                size_t *skip)
+{
+    struct kmisc_record *rec;
+    size_t rec_size;
+    size_t len = 0;
+
+    *skip = 0;
+
+    while (*skip + len < avail) {
+        rec = ring_buf_record(ring, idx + *skip + len);
+        rec_size = KMISC_RECORD_SIZE((size_t)READ_ONCE(rec->len));
+
+        // Garbage written through the mapping
+        if (rec_size > avail - *skip - len)
+            return len ? len : -EIO;
+
+        if (READ_ONCE(rec->flags) & KMISC_RECORD_PAD) {
+            // Left for the next read to skip
+            if (len)
+                break;
+
+            *skip += rec_size;
+            continue;
+        }
+
+        if (len + rec_size > out_buf_size) {
+            if (!len)
+                return -EMSGSIZE;
+            break;
+        }
+
+        len += rec_size;
+    }
+
+    return len;
+}
+
+// Single consumer: read_idx is ours, only write_idx needs acquiring.
+// The locked mode runs the same code under read_lock.
+static ssize_t ring_buf_read_spsc(struct ring_buf *ring, struct iov_iter *to)
+{
+    size_t out_buf_size = iov_iter_count(to);
+    bool records = ring->flags & KMISC_RING_RECORDS;
+    u64 write_idx;
+    u64 read_idx;
+    size_t will_read;
+    size_t did_read;
+    size_t skip = 0;
+
+    write_idx = smp_load_acquire(&ring->ctl->write_idx);
+    read_idx = READ_ONCE(ring->ctl->read_idx);
+
+    // If the indexes are equal, the buffer is empty,
+    // nothing is avalaible to read
+    if (records) {
+        ssize_t len = ring_buf_records_len(ring, read_idx, write_idx - read_idx, out_buf_size, &skip);
+
+        if (len < 0)
+            return len;
+
+        will_read = len;
+    } else
+        will_read = min_t(size_t, write_idx - read_idx, out_buf_size);
+
+    did_read = ring_buf_copy_out(ring, read_idx + skip, to, will_read);
+
+    // The records stay in the ring unless all of them are copied
+    if (records && did_read < will_read)
+        did_read = 0;
+
+    // Release: the data has been consumed before the producer may reuse the space
+    smp_store_release(&ring->ctl->read_idx, read_idx + skip + did_read);
+
+    // Nothing copied because of the user buffer, not because the ring is empty
+    if (!did_read && will_read)
+        return -EFAULT;
+
+    return did_read;
+}
+
+static ssize_t ring_buf_write_spsc(struct ring_buf *ring, struct iov_iter *from)
+{
+    size_t in_buf_size = iov_iter_count(from);
+    u64 write_idx;
+    u64 read_idx;
+    size_t space;
+    size_t will_write;
+    size_t did_write;
+
+    write_idx = READ_ONCE(ring->ctl->write_idx);
+    read_idx = smp_load_acquire(&ring->ctl->read_idx);
+
+    // If the indexes are equal, the buffer is empty,
+    // and all space is available to write
+    space = ring->size - (write_idx - read_idx);
+
+    if (ring->flags & KMISC_RING_RECORDS) {
+        will_write = KMISC_RECORD_SIZE(in_buf_size);
+        if (will_write > space)
+            return 0;
+
+        // Nothing is committed if the payload faults
+        if (!ring_buf_copy_in_record(ring, write_idx, from, in_buf_size))
+            return -EFAULT;
+
+        smp_store_release(&ring->ctl->write_idx, write_idx + will_write);
+
+        return in_buf_size;
+    }
+
+    if (ring_buf_write_whole(from) && in_buf_size > space)
+        return 0;
+
+    will_write = min(space, in_buf_size);
+    did_write = ring_buf_copy_in(ring, write_idx, from, will_write);
+
+    // Release: the data is in place before the consumer can see it
+    smp_store_release(&ring->ctl->write_idx, write_idx + did_write);
+
+    if (!did_write && will_write)
+        return -EFAULT;
+
+    return did_write;
+}
+
+// The spinning waits for the other readers and writers give up then
+static bool ring_buf_wait_aborted(void)
+{
+    return fatal_signal_pending(current) || ((current->flags & PF_KTHREAD) && kthread_should_stop());
+}
+
+// Waits for the readers or the writers reserved ahead to commit, until
+// *idx gets to head. The indexes are in the control page, writable
+// through the user mappings: a client breaking the protocol there could
+// keep *idx from ever getting to head. The wait gives up on a fatal
+// signal, or on a stop for the drain threads, so the task can always
+// be killed. EINTR then, and the ring is stuck short of head for good.
+static int ring_buf_wait_commit(u64 *idx, u64 head)
+{
+    while (READ_ONCE(*idx) != head) {
+        if (ring_buf_wait_aborted())
+            return -EINTR;
+
+        cpu_relax();
+        cond_resched();
+    }
+
+    return 0;
+}
+
+// Multiple consumers: a reader claims [read_head, read_head + n) with
+// a cmpxchg, copies without holding anything, then releases the space
+// to the producers in claim order so read_idx never runs ahead of a
+// reader still copying. The data of a faulting reader is lost.
+static ssize_t ring_buf_read_mpmc(struct ring_buf *ring, struct iov_iter *to)
+{
+    size_t out_buf_size = iov_iter_count(to);
+    bool records = ring->flags & KMISC_RING_RECORDS;
+    u64 head;
+    u64 old;
+    size_t avail;
+    size_t will_read;
+    size_t did_read;
+    size_t skip = 0;
+
+    head = READ_ONCE(ring->ctl->read_head);
+
+    for (;;) {
+        avail = smp_load_acquire(&ring->ctl->write_idx) - head;
+
+        if (records) {
+            ssize_t len = ring_buf_records_len(ring, head, avail, out_buf_size, &skip);
+
+            if (len < 0) {
+                // Looked at what another reader already took
+                old = READ_ONCE(ring->ctl->read_head);
+                if (old != head) {
+                    ring_buf_stat_inc(ring, contended);
+                    head = old;
+                    continue;
+                }
+
+                return len;
+            }
+
+            will_read = len;
+        } else
+            will_read = min_t(size_t, avail, out_buf_size);
+
+        if (!will_read && !skip)
+            return 0;
+
+        old = cmpxchg(&ring->ctl->read_head, head, head + skip + will_read);
+        if (old == head)
+            break;
+
+        ring_buf_stat_inc(ring, contended);
+        head = old;
+    }
+
+    did_read = ring_buf_copy_out(ring, head + skip, to, will_read);
+
+    if (ring_buf_wait_commit(&ring->ctl->read_idx, head))
+        return -EINTR;
+
+    smp_store_release(&ring->ctl->read_idx, head + skip + will_read);
+
+    if (will_read && (!did_read || (records && did_read < will_read)))
+        return -EFAULT;
+
+    return did_read;
+}
+
+// Multiple producers: the mirror image of the above. A reservation
+// can't be given back once the later producers have theirs, so the
+// part a faulting writer couldn't fill is committed zeroed, or as
+// padding in the record mode.
+static ssize_t ring_buf_write_mpmc(struct ring_buf *ring, struct iov_iter *from)
+{
+    size_t in_buf_size = iov_iter_count(from);
+    bool records = ring->flags & KMISC_RING_RECORDS;
+    bool whole = ring_buf_write_whole(from);
+    u64 head;
+    u64 old;
+    size_t space;
+    size_t will_write;
+    size_t did_write;
+
+    head = READ_ONCE(ring->ctl->write_head);
+
+    for (;;) {
+        space = ring->size - (head - smp_load_acquire(&ring->ctl->read_idx));
+
+        if (records) {
+            will_write = KMISC_RECORD_SIZE(in_buf_size);
+            if (will_write > space)
+                return 0;
+        } else {
+            will_write = min(space, in_buf_size);
+            if (!will_write || (whole && will_write < in_buf_size))
+                return 0;
+        }
+
+        old = cmpxchg(&ring->ctl->write_head, head, head + will_write);
+        if (old == head)
+            break;
+
+        ring_buf_stat_inc(ring, contended);
+        head = old;
+    }
+
+    if (records) {
+        did_write = ring_buf_copy_in_record(ring, head, from, in_buf_size) ?
+            in_buf_size : 0;
+    } else {
+        did_write = ring_buf_copy_in(ring, head, from, will_write);
+        if (did_write < will_write)
+            ring_buf_zero(ring, head + did_write, will_write - did_write);
+    }
+
+    // Commit in reservation order: wait for the producers ahead of us
+    if (ring_buf_wait_commit(&ring->ctl->write_idx, head))
+        return -EINTR;
+
+    smp_store_release(&ring->ctl->write_idx, head + will_write);
+
+    if (!did_write)
+        return -EFAULT;
+
+    return did_write;
+}
+
+// Flight recorder: the writers reserve like in the MPMC mode but
+// without looking at the free space, and push read_idx over the
+// oldest data instead. The readers copy optimistically and retry
+// if a writer has moved read_idx meanwhile, see ring_buf_push().
+
+// Makes room for a reservation ending at end by moving read_idx over
+// the oldest data, to a record boundary in the record mode. Waits for
+// the writers ahead to commit up to there first: that keeps read_idx
+// from passing write_idx, and the record headers walked over in place.
+// read_idx moves before the data is overwritten, so a reader seeing
+// it unchanged after copying knows it copied intact data. Gives up
+// with EINTR like ring_buf_wait_commit().
+static int ring_buf_push(struct ring_buf *ring, u64 end)
+{
+    struct kmisc_ring_ctl *ctl = ring->ctl;
+    u64 target = end - ring->size;
+    u64 read_idx = READ_ONCE(ctl->read_idx);
+    u64 new_idx;
+    u64 old;
+
+    if ((s64)(target - read_idx) <= 0)
+        return 0;
+
+    while ((s64)(smp_load_acquire(&ctl->write_idx) - target) < 0) {
+        if (ring_buf_wait_aborted())
+            return -EINTR;
+
+        cpu_relax();
+        cond_resched();
+    }
+
+    for (;;) {
+        if ((s64)(target - read_idx) <= 0)
+            return 0;
+
+        new_idx = target;
+
+        // Walking from a stale read_idx may see garbage, the cmpxchg fails then
+        if (ring->flags & KMISC_RING_RECORDS) {
+            for (new_idx = read_idx; (s64)(new_idx - target) < 0; )
+                new_idx += KMISC_RECORD_SIZE((size_t)READ_ONCE(ring_buf_record(ring, new_idx)->len));
+        }
+
+        old = cmpxchg(&ctl->read_idx, read_idx, new_idx);
+        if (old == read_idx) {
+            atomic64_add(new_idx - read_idx, &ring->dropped);
+            return 0;
+        }
+
+        ring_buf_stat_inc(ring, contended);
+        read_idx = old;
+    }
+}
+
+static ssize_t ring_buf_read_overwrite(struct ring_buf *ring, struct iov_iter *to)
+{
+    size_t out_buf_size = iov_iter_count(to);
+    bool records = ring->flags & KMISC_RING_RECORDS;
+    u64 write_idx;
+    u64 read_idx;
+    size_t will_read;
+    size_t did_read;
+    size_t skip;
+
+    for (;;) {
+        read_idx = smp_load_acquire(&ring->ctl->read_idx);
+        write_idx = smp_load_acquire(&ring->ctl->write_idx);
+        skip = 0;
+
+        // Also when a writer pushed read_idx past the write_idx just read
+        if ((s64)(write_idx - read_idx) <= 0)
+            return 0;
+
+        if (records) {
+            ssize_t len = ring_buf_records_len(ring, read_idx, write_idx - read_idx, out_buf_size, &skip);
+
+            if (len < 0) {
+                if (READ_ONCE(ring->ctl->read_idx) != read_idx)
+                    continue;
+
+                return len;
+            }
+
+            will_read = len;
+        } else
+            will_read = min_t(size_t, write_idx - read_idx, out_buf_size);
+
+        did_read = ring_buf_copy_out(ring, read_idx + skip, to, will_read);
+
+        // The records stay in the ring unless all of them are copied
+        if (records && did_read < will_read)
+            did_read = 0;
+
+        // Pairs with the cmpxchg in ring_buf_push() preceding the overwrite
+        smp_rmb();
+
+        if (cmpxchg(&ring->ctl->read_idx, read_idx, read_idx + skip + did_read) == read_idx)
+            break;
+
+        // Overwritten while copying, or taken by another reader
+        ring_buf_stat_inc(ring, contended);
+        iov_iter_revert(to, did_read);
+    }
+
+    if (!did_read && will_read)
+        return -EFAULT;
+
+    return did_read;
+}
+
+// Never waits for the readers and never truncates, except for keeping
+// only the newest ring size worth of a bigger write in the byte mode.
+static ssize_t ring_buf_write_overwrite(struct ring_buf *ring, struct iov_iter *from)
+{
+    size_t in_buf_size = iov_iter_count(from);
+    bool records = ring->flags & KMISC_RING_RECORDS;
+    size_t will_write;
+    size_t did_write;
+    size_t dropped = 0;
+    u64 head;
+    u64 old;
+
+    if (records)
+        will_write = KMISC_RECORD_SIZE(in_buf_size);
+    else {
+        if (in_buf_size > ring->size) {
+            dropped = in_buf_size - ring->size;
+            iov_iter_advance(from, dropped);
+            atomic64_add(dropped, &ring->dropped);
+        }
+
+        will_write = in_buf_size - dropped;
+    }
+
+    head = READ_ONCE(ring->ctl->write_head);
+
+    for (;;) {
+        old = cmpxchg(&ring->ctl->write_head, head, head + will_write);
+        if (old == head)
+            break;
+
+        ring_buf_stat_inc(ring, contended);
+        head = old;
+    }
+
+    if (ring_buf_push(ring, head + will_write))
+        return -EINTR;
+
+    if (records) {
+        did_write = ring_buf_copy_in_record(ring, head, from, in_buf_size) ? in_buf_size : 0;
+    } else {
+        did_write = ring_buf_copy_in(ring, head, from, will_write);
+        if (did_write < will_write)
+            ring_buf_zero(ring, head + did_write, will_write - did_write);
+        if (did_write)
+            did_write += dropped;
+    }
+
+    // Commit in reservation order: wait for the producers ahead of us
+    if (ring_buf_wait_commit(&ring->ctl->write_idx, head))
+        return -EINTR;
+
+    smp_store_release(&ring->ctl->write_idx, head + will_write);
+
+    if (!did_write)
+        return -EFAULT;
+
+    return did_write;
+}
+
+// Broadcast: read_idx is the minimum of the cursors. Moved forward by
+// the readers, and by the writers too in the overwrite mode, so both
+// only ever move it forward with a cmpxchg. Called with cursors_lock.
+//
+// The cursors move without the lock: a reader skips this unless it
+// sees read_idx at its old cursor after moving it. Scanning again
+// after every move of read_idx catches the reader that didn't see it.
+static void ring_buf_cursors_commit(struct ring_buf *ring)
+{
+    struct ring_buf_cursor *cursor;
+    u64 read_idx = READ_ONCE(ring->ctl->read_idx);
+
+    for (;;) {
+        u64 min_idx = 0;
+        bool found = false;
+
+        list_for_each_entry(cursor, &ring->cursors, node) {
+            u64 idx = READ_ONCE(cursor->idx);
+
+            if (!found || (s64)(idx - min_idx) < 0)
+                min_idx = idx;
+            found = true;
+        }
+
+        // Nobody left, the data stays for the next reader
+        if (!found || (s64)(min_idx - read_idx) <= 0)
+            return;
+
+        // The full barrier orders the copies before the space is reused,
+        // and the scan above after the move
+        if (try_cmpxchg(&ring->ctl->read_idx, &read_idx, min_idx))
+            read_idx = min_idx;
+    }
+}
+
+// The indexes of an idle ring were moved, or it left the broadcast mode
+static void ring_buf_cursors_reset(struct ring_buf *ring)
+{
+    struct ring_buf_cursor *cursor, *tmp;
+
+    spin_lock(&ring->cursors_lock);
+
+    list_for_each_entry_safe(cursor, tmp, &ring->cursors, node) {
+        if (ring->flags & KMISC_RING_BROADCAST) {
+            cursor->idx = ring->ctl->read_idx;
+        } else {
+            list_del_init(&cursor->node);
+            WRITE_ONCE(cursor->ring, NULL);
+        }
+    }
+
+    spin_unlock(&ring->cursors_lock);
+}
+
+static void ring_buf_subscribe(struct ring_buf *ring, struct ring_buf_cursor *cursor)
+{
+    spin_lock(&ring->cursors_lock);
+
+    if (!cursor->ring) {
+        cursor->idx = smp_load_acquire(&ring->ctl->read_idx);
+        list_add(&cursor->node, &ring->cursors);
+        WRITE_ONCE(cursor->ring, ring);
+    }
+
+    spin_unlock(&ring->cursors_lock);
+}
+
+static void ring_buf_unsubscribe(struct ring_buf_cursor *cursor)
+{
+    struct ring_buf *ring = READ_ONCE(cursor->ring);
+
+    if (!ring)
+        return;
+
+    spin_lock(&ring->cursors_lock);
+
+    // Unless the ring has left the broadcast mode meanwhile
+    if (cursor->ring) {
+        list_del_init(&cursor->node);
+        WRITE_ONCE(cursor->ring, NULL);
+        ring_buf_cursors_commit(ring);
+    }
+
+    spin_unlock(&ring->cursors_lock);
+
+    ring_buf_wake(&ring->write_wait, EPOLLOUT | EPOLLWRNORM);
+}
+
+// Any number of readers, each at its own cursor. They copy, then move
+// the cursor with a cmpxchg as more threads may read through the same
+// file. In the overwrite mode the data is valid if read_idx hasn't
+// passed the cursor after copying, a reader found behind is moved to
+// read_idx, the data in between is lost to it.
+static ssize_t ring_buf_read_broadcast(struct ring_buf *ring, struct ring_buf_cursor *cursor, struct iov_iter *to)
+{
+    size_t out_buf_size = iov_iter_count(to);
+    bool records = ring->flags & KMISC_RING_RECORDS;
+    bool overwrite = ring->flags & KMISC_RING_OVERWRITE;
+    u64 write_idx;
+    u64 read_idx;
+    u64 idx;
+    size_t will_read;
+    size_t did_read;
+    size_t skip;
+
+    for (;;) {
+        idx = READ_ONCE(cursor->idx);
+        read_idx = smp_load_acquire(&ring->ctl->read_idx);
+
+        if ((s64)(read_idx - idx) > 0) {
+            if (cmpxchg(&cursor->idx, idx, read_idx) != idx)
+                ring_buf_stat_inc(ring, contended);
+            continue;
+        }
+
+        write_idx = smp_load_acquire(&ring->ctl->write_idx);
+        skip = 0;
+
+        if ((s64)(write_idx - idx) <= 0)
+            return 0;
+
+        if (records) {
+            ssize_t len = ring_buf_records_len(ring, idx, write_idx - idx, out_buf_size, &skip);
+
+            if (len < 0) {
+                if (READ_ONCE(cursor->idx) != idx ||
+                    (overwrite && READ_ONCE(ring->ctl->read_idx) != read_idx))
+                    continue;
+
+                return len;
+            }
+
+            will_read = len;
+        } else
+            will_read = min_t(size_t, write_idx - idx, out_buf_size);
+
+        did_read = ring_buf_copy_out(ring, idx + skip, to, will_read);
+
+        // The records stay in the ring unless all of them are copied
+        if (records && did_read < will_read)
+            did_read = 0;
+
+        if (overwrite) {
+            // Pairs with the cmpxchg in ring_buf_push() preceding the overwrite
+            smp_rmb();
+
+            if ((s64)(READ_ONCE(ring->ctl->read_idx) - idx) > 0) {
+                ring_buf_stat_inc(ring, contended);
+                iov_iter_revert(to, did_read);
+                continue;
+            }
+        }
+
+        if (cmpxchg(&cursor->idx, idx, idx + skip + did_read) == idx)
+            break;
+
+        // Another thread read through the same file
+        ring_buf_stat_inc(ring, contended);
+        iov_iter_revert(to, did_read);
+    }
+
+    // Only the slowest readers can move read_idx
+    if ((skip || did_read) && (s64)(idx - READ_ONCE(ring->ctl->read_idx)) <= 0) {
+        spin_lock(&ring->cursors_lock);
+        ring_buf_cursors_commit(ring);
+        spin_unlock(&ring->cursors_lock);
+    }
+
+    if (!did_read && will_read)
+        return -EFAULT;
+
+    return did_read;
+}
+
+// Reads into any kind of buffers, the user ones, the kernel ones or
+// a mix of them coming from readv(). The cursor is needed only in the
+// broadcast mode.
+static ssize_t ring_buf_read_iter(struct ring_buf *ring, struct ring_buf_cursor *cursor, struct iov_iter *to)
+{
+    size_t out_buf_size = iov_iter_count(to);
+    ssize_t ret;
+
+    percpu_down_read(&ring->config_sem);
+
+    if (ring->flags & KMISC_RING_BROADCAST) {
+        if (!cursor) {
+            ret = -EINVAL;
+        } else {
+            // Also off the ring the file read before being bound
+            if (READ_ONCE(cursor->ring) != ring) {
+                ring_buf_unsubscribe(cursor);
+                ring_buf_subscribe(ring, cursor);
+            }
+
+            ret = ring_buf_read_broadcast(ring, cursor, to);
+        }
+    } else switch (ring->flags & KMISC_RING_OVERWRITE ? KMISC_MODE_OVERWRITE : ring->mode) {
+    case KMISC_MODE_OVERWRITE:
+        ret = ring_buf_read_overwrite(ring, to);
+        break;
+
+    case KMISC_MODE_SPSC:
+        ret = ring_buf_read_spsc(ring, to);
+        break;
+
+    case KMISC_MODE_MPMC:
+        ret = ring_buf_read_mpmc(ring, to);
+        break;
+
+    default:
+        ring_buf_lock(ring, &ring->read_lock);
+        ret = ring_buf_read_spsc(ring, to);
+        mutex_unlock(&ring->read_lock);
+        break;
+    }
+
+    percpu_up_read(&ring->config_sem);
+
+    if (ret > 0) {
+        ring_buf_stat_inc(ring, reads);
+        ring_buf_stat_add(ring, bytes_read, ret);
+        if (ret < out_buf_size)
+            ring_buf_stat_inc(ring, short_reads);
+
+        ring_buf_wake(&ring->write_wait, EPOLLOUT | EPOLLWRNORM);
+    } else if (ret == 0 && out_buf_size)
+        ring_buf_stat_inc(ring, empty);
+
+    return ret;
+}
+
+static ssize_t __maybe_unused ring_buf_read(struct ring_buf *ring, void* out_buf, size_t out_buf_size)
+{
+    struct kvec kv = { .iov_base = out_buf, .iov_len = out_buf_size };
+    struct iov_iter to;
+
+    iov_iter_kvec(&to, READ, &kv, 1, out_buf_size);
+
+    return ring_buf_read_iter(ring, NULL, &to);
+}
+
+// All of the iterator, writev() segments included, goes in as one
+// contiguous chunk: a record, all of a writev() or as many bytes as
+// fit, never mixed with what other writers have.
+static ssize_t ring_buf_write_iter(struct ring_buf *ring, struct iov_iter *from)
+{
+    size_t in_buf_size = iov_iter_count(from);
+    ssize_t ret;
+
+    if (!in_buf_size)
+        return 0;
+
+    percpu_down_read(&ring->config_sem);
+
+    // The in-kernel producers own the write side, see ring_buf_reserve()
+    if (ring->producers) {
+        percpu_up_read(&ring->config_sem);
+        return -EPERM;
+    }
+
+    // One write is one record, the ring must be able to hold it
+    if ((ring->flags & KMISC_RING_RECORDS) &&
+        (in_buf_size > U32_MAX || KMISC_RECORD_SIZE(in_buf_size) > ring->size)) {
+        percpu_up_read(&ring->config_sem);
+        return -EMSGSIZE;
+    }
+
+    // Same for a writev() going in whole
+    if (!(ring->flags & (KMISC_RING_RECORDS | KMISC_RING_OVERWRITE)) && ring_buf_write_whole(from) &&
+        in_buf_size > ring->size) {
+        percpu_up_read(&ring->config_sem);
+        return -EMSGSIZE;
+    }
+
+    switch (ring->flags & KMISC_RING_OVERWRITE ? KMISC_MODE_OVERWRITE : ring->mode) {
+    case KMISC_MODE_OVERWRITE:
+        ret = ring_buf_write_overwrite(ring, from);
+        break;
+
+    case KMISC_MODE_SPSC:
+        ret = ring_buf_write_spsc(ring, from);
+        break;
+
+    case KMISC_MODE_MPMC:
+        ret = ring_buf_write_mpmc(ring, from);
+        break;
+
+    default:
+        ring_buf_lock(ring, &ring->write_lock);
+        ret = ring_buf_write_spsc(ring, from);
+        mutex_unlock(&ring->write_lock);
+        break;
+    }
+
+    percpu_up_read(&ring->config_sem);
+
+    if (ret > 0) {
+        ring_buf_stat_inc(ring, writes);
+        ring_buf_stat_add(ring, bytes_written, ret);
+        if (ret < in_buf_size)
+            ring_buf_stat_inc(ring, short_writes);
+        ring_buf_stat_max(ring, high_water, ring_buf_used(ring));
+
+        ring_buf_wake(&ring->read_wait, EPOLLIN | EPOLLRDNORM);
+    } else if (ret == 0)
+        ring_buf_stat_inc(ring, full);
+
+    return ret;
+}
+
+static ssize_t __maybe_unused ring_buf_write(struct ring_buf *ring, const void* in_buf, size_t in_buf_size)
+{
+    struct kvec kv = { .iov_base = (void *)in_buf, .iov_len = in_buf_size };
+    struct iov_iter from;
+
+    iov_iter_kvec(&from, WRITE, &kv, 1, in_buf_size);
+
+    return ring_buf_write_iter(ring, &from);
+}
+
+// Empty, and no reservation in flight. Called with config_sem held
+// for writing, so nobody is inside the read and write paths.
+static bool ring_buf_idle(struct ring_buf *ring)
+{
+    struct kmisc_ring_ctl *ctl = ring->ctl;
+    // Only the MPMC readers keep read_head, the overwrite writers keep write_head too
+    bool read_head = ring->mode == KMISC_MODE_MPMC &&
+        !(ring->flags & (KMISC_RING_OVERWRITE | KMISC_RING_BROADCAST));
+    bool write_head = ring->mode == KMISC_MODE_MPMC || (ring->flags & KMISC_RING_OVERWRITE);
+
+    return ctl->read_idx == ctl->write_idx &&
+        (!read_head || ctl->read_head == ctl->read_idx) &&
+        (!write_head || ctl->write_head == ctl->write_idx);
+}
+
+static int ring_buf_set_mode(struct ring_buf *ring, unsigned int mode)
+{
+    struct kmisc_ring_ctl *ctl = ring->ctl;
+    int ret = 0;
+
+    if (mode > KMISC_MODE_MPMC)
+        return -EINVAL;
+
+    percpu_down_write(&ring->config_sem);
+
+    if (ring->producers || !ring_buf_idle(ring)) {
+        ret = -EBUSY;
+    } else {
+        ctl->read_head = ctl->read_idx;
+        ctl->write_head = ctl->write_idx;
+        WRITE_ONCE(ctl->mode, mode);
+        ring->mode = mode;
+    }
+
+    percpu_up_write(&ring->config_sem);
+
+    return ret;
+}
+
+static int ring_buf_realloc(struct ring_buf *ring, size_t size, unsigned int order);
+
+static int ring_buf_set_flags(struct ring_buf *ring, unsigned int flags)
+{
+    struct kmisc_ring_ctl *ctl = ring->ctl;
+    unsigned int order = (flags & KMISC_RING_HUGE) ? RING_BUF_HUGE_ORDER : 0;
+    int ret = 0;
+
+    if (flags & ~KMISC_RING_FLAGS)
+        return -EINVAL;
+
+    if ((flags & KMISC_RING_HUGE) && !order)
+        return -EOPNOTSUPP;
+
+    // Switching between the small and the huge pages takes new ones
+    if (order != READ_ONCE(ring->order)) {
+        ret = ring_buf_realloc(ring, READ_ONCE(ring->size), order);
+        if (ret)
+            return ret;
+    }
+
+    percpu_down_write(&ring->config_sem);
+
+    if (ring->producers || !ring_buf_idle(ring) || order != ring->order) {
+        ret = -EBUSY;
+    } else {
+        // The record headers are aligned
+        if (flags & KMISC_RING_RECORDS)
+            ctl->read_idx = ctl->write_idx = ALIGN(ctl->write_idx, KMISC_RECORD_ALIGN);
+
+        ctl->read_head = ctl->read_idx;
+        ctl->write_head = ctl->write_idx;
+
+        WRITE_ONCE(ctl->flags, flags);
+        ring->flags = flags;
+
+        ring_buf_cursors_reset(ring);
+    }
+
+    percpu_up_write(&ring->config_sem);
+
+    return ret;
+}
+
+// Swaps in freshly allocated data pages of the given order. The ring
+// has to be idle and not mapped. The indexes keep running, with the
+// ring empty they are as good for the new size as for the old one.
+static int ring_buf_realloc(struct ring_buf *ring, size_t size, unsigned int order)
+{
+    struct page **pages;
+    size_t page_count;
+    void *buf;
+    unsigned int flags;
+    int ret;
+
+    if (!ring_buf_size_valid(size, order))
+        return -EINVAL;
+
+    page_count = size >> (PAGE_SHIFT + order);
+
+    // Allocating a big ring takes a while, don't stall the users
+    ret = ring_buf_alloc_pages(page_count, order, ring->node, &pages, &buf);
+    if (ret)
+        return ret;
+
+    percpu_down_write(&ring->config_sem);
+
+    if (ring->producers || atomic_read(&ring->mapped) || !ring_buf_idle(ring)) {
+        ret = -EBUSY;
+    } else {
+        swap(ring->pages, pages);
+        swap(ring->page_count, page_count);
+        swap(ring->order, order);
+        swap(ring->buf, buf);
+        ring->size = size;
+        WRITE_ONCE(ring->ctl->size, size);
+
+        flags = ring->flags & ~KMISC_RING_HUGE;
+        if (ring->order)
+            flags |= KMISC_RING_HUGE;
+        WRITE_ONCE(ring->ctl->flags, flags);
+        ring->flags = flags;
+    }
+
+    percpu_up_write(&ring->config_sem);
+
+    // Either the old pages or the unused new ones
+    ring_buf_free_pages(pages, page_count, order, buf);
+
+    if (!ret)
+        ring_buf_wake(&ring->write_wait, EPOLLOUT | EPOLLWRNORM);
+
+    return ret;
+}
+
+static int ring_buf_resize(struct ring_buf *ring, size_t size)
+{
+    return ring_buf_realloc(ring, size, READ_ONCE(ring->order));
+}
+
+// An in-kernel producer needs a record ring, switched to one if it
+// is idle. The user writers get -EPERM until the last producer goes,
+// the readers work as usual in any mode.
+static int ring_buf_attach_producer(struct ring_buf *ring)
+{
+    struct kmisc_ring_ctl *ctl = ring->ctl;
+    int ret = 0;
+
+    percpu_down_write(&ring->config_sem);
+
+    // The broadcast readers and the huge pages are fine too
+    if ((ring->flags & ~(KMISC_RING_BROADCAST | KMISC_RING_HUGE)) != KMISC_RING_RECORDS) {
+        if (ring->producers || !ring_buf_idle(ring)) {
+            ret = -EBUSY;
+            goto exit;
+        }
+
+        ctl->read_idx = ctl->write_idx = ALIGN(ctl->write_idx, KMISC_RECORD_ALIGN);
+        ctl->read_head = ctl->read_idx;
+        ring->flags = (ring->flags & (KMISC_RING_BROADCAST | KMISC_RING_HUGE)) | KMISC_RING_RECORDS;
+        WRITE_ONCE(ctl->flags, ring->flags);
+
+        ring_buf_cursors_reset(ring);
+    }
+
+    // Only the MPMC writers keep the head, and none is running. Aligned
+    // in case a mapping has stored a bogus write_idx: a record header
+    // must not cross a page of a huge ring.
+    if (!ring->producers)
+        ctl->write_idx = ctl->write_head = ring->reserve_head = ALIGN(ctl->write_idx, KMISC_RECORD_ALIGN);
+
+    ++ring->producers;
+
+exit:
+
+    percpu_up_write(&ring->config_sem);
+
+    return ret;
+}
+
+static void ring_buf_detach_producer(struct ring_buf *ring)
+{
+    percpu_down_write(&ring->config_sem);
+    --ring->producers;
+    percpu_up_write(&ring->config_sem);
+
+    ring_buf_wake(&ring->write_wait, EPOLLOUT | EPOLLWRNORM);
+}
+
+// Reserves a record for len bytes of payload and returns a pointer
+// to it in the ring, NULL if there is no room: the producer never
+// waits, the record is dropped and counted. Any context, NMI too.
+//
+// The reservation moves reserve_head under a raw spinlock with the
+// interrupts off, the header goes in before the head is published,
+// marked busy. In NMI the lock is only tried: the interrupted code
+// may be holding it. Then the commits make progress without a lock,
+// in any order, see ring_buf_commit().
+//
+// The producer gets the record contiguous: in a huge ring one that
+// would cross a page boundary goes after a padding record up to it,
+// and none can be bigger than a page.
+static void *ring_buf_reserve(struct ring_buf *ring, size_t len)
+{
+    struct kmisc_ring_ctl *ctl = ring->ctl;
+    size_t size = KMISC_RECORD_SIZE(len);
+    size_t pad = 0;
+    size_t contig;
+    struct kmisc_record *rec;
+    unsigned long irq_flags;
+    u64 head;
+
+    if (len > U32_MAX || size > (ring->buf ? ring->size : PAGE_SIZE << ring->order))
+        return NULL;
+
+    if (!raw_spin_trylock_irqsave(&ring->reserve_lock, irq_flags)) {
+        ring_buf_stat_inc(ring, contended);
+
+        if (in_nmi()) {
+            atomic64_add(size, &ring->dropped);
+            return NULL;
+        }
+
+        raw_spin_lock_irqsave(&ring->reserve_lock, irq_flags);
+    }
+
+    head = ring->reserve_head;
+    ring_buf_addr(ring, head, &contig);
+    if (contig < size)
+        pad = contig;
+
+    if (head + pad + size - smp_load_acquire(&ctl->read_idx) > ring->size) {
+        raw_spin_unlock_irqrestore(&ring->reserve_lock, irq_flags);
+        ring_buf_stat_inc(ring, full);
+        atomic64_add(size, &ring->dropped);
+        return NULL;
+    }
+
+    if (pad) {
+        rec = ring_buf_record(ring, head);
+        rec->len = pad - sizeof(*rec);
+        rec->flags = KMISC_RECORD_PAD;
+        head += pad;
+    }
+
+    rec = ring_buf_record(ring, head);
+    rec->len = len;
+    rec->flags = KMISC_RECORD_BUSY;
+
+    // The committers read the headers below the head
+    smp_store_release(&ring->reserve_head, head + size);
+    WRITE_ONCE(ctl->write_head, head + size);
+
+    raw_spin_unlock_irqrestore(&ring->reserve_lock, irq_flags);
+
+    return rec->data;
+}
+
+// The end of the record at idx if it can be walked over towards head,
+// 0 if not. write_idx and the headers are writable through the user
+// mappings, nothing from there is followed unchecked.
+static u64 ring_buf_commit_next(struct ring_buf *ring, u64 idx, u64 head)
+{
+    struct kmisc_record *rec;
+    u64 size;
+
+    if ((s64)(head - idx) <= 0 || head - idx > ring->size || !IS_ALIGNED(idx, KMISC_RECORD_ALIGN))
+        return 0;
+
+    rec = ring_buf_record(ring, idx);
+    size = KMISC_RECORD_SIZE((u64)READ_ONCE(rec->len));
+
+    return size <= head - idx ? idx + size : 0;
+}
+
+// Commits or discards the record reserved at data. Clearing the busy
+// flag is enough for the record itself, then whoever commits moves
+// write_idx over all the records not busy anymore in front of it,
+// including the ones committed out of order by the others. The full
+// barrier pairs with the one in try_cmpxchg() so that the producer
+// blocking the way either sees its own record passed over or gets
+// seen as committed.
+//
+// The walk goes up to a snapshot of reserve_head, which the mappings
+// can't touch, and a bounded number of steps: a mapping storing to
+// write_idx or to the headers can't keep it going in NMI. If write_idx
+// points at anything inconsistent and nobody moves it, the walk stops
+// and the record is counted as dropped.
+static void ring_buf_commit(struct ring_buf *ring, void *data, bool discard)
+{
+    struct kmisc_ring_ctl *ctl = ring->ctl;
+    struct kmisc_record *rec = (struct kmisc_record *)((u8 *)data - offsetof(struct kmisc_record, data));
+    u64 size = KMISC_RECORD_SIZE((u64)rec->len);
+    // A step moves write_idx by a record or finds it moved
+    size_t steps = 2 * (ring->size / KMISC_RECORD_ALIGN);
+    u64 head;
+    u64 next;
+    u64 idx;
+
+    if (discard) {
+        atomic64_add(size, &ring->dropped);
+    } else {
+        ring_buf_stat_inc(ring, writes);
+        ring_buf_stat_add(ring, bytes_written, rec->len);
+    }
+
+    // The readers skip the padding
+    smp_store_release(&rec->flags, discard ? KMISC_RECORD_PAD : 0);
+    smp_mb();
+
+    head = smp_load_acquire(&ring->reserve_head);
+    idx = READ_ONCE(ctl->write_idx);
+
+    while (idx != head && steps--) {
+        // A stale idx makes the header garbage and the exchange fail,
+        // once it succeeds the record may be consumed and reused
+        next = ring_buf_commit_next(ring, idx, head);
+        if (!next) {
+            next = READ_ONCE(ctl->write_idx);
+            if (next == idx) {
+                atomic64_add(size, &ring->dropped);
+                break;
+            }
+
+            idx = next; // Moved meanwhile
+            continue;
+        }
+
+        rec = ring_buf_record(ring, idx);
+        if (smp_load_acquire(&rec->flags) & KMISC_RECORD_BUSY)
+            break;
+
+        if (try_cmpxchg(&ctl->write_idx, &idx, next))
+            idx = next;
+        else
+            ring_buf_stat_inc(ring, contended);
+    }
+
+    ring_buf_stat_max(ring, high_water, ring_buf_used(ring));
+
+    if (wq_has_sleeper(&ring->read_wait))
+        irq_work_queue(&ring->wake_work);
+}
+
+static void ring_buf_vm_open(struct vm_area_struct *vma)
+{
+    struct ring_buf *ring = vma->vm_private_data;
+
+    atomic_inc(&ring->mapped);
+}
+
+static void ring_buf_vm_close(struct vm_area_struct *vma)
+{
+    struct ring_buf *ring = vma->vm_private_data;
+
+    atomic_dec(&ring->mapped);
+}
+
+static const struct vm_operations_struct ring_buf_vm_ops = {
+    .open = ring_buf_vm_open,
+    .close = ring_buf_vm_close,
+};
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+
+// The pfn of the small page p of the data, counting from the start of
+// the double mapping
+static unsigned long ring_buf_data_pfn(struct ring_buf *ring, unsigned long p)
+{
+    p &= (ring->size >> PAGE_SHIFT) - 1;
+
+    return page_to_pfn(ring->pages[p >> ring->order]) + (p & ((1ul << ring->order) - 1));
+}
+
+// The data of a huge ring is mapped on demand, with the PMDs when the
+// mapping is aligned for them and with the small pages otherwise. The
+// control page is mapped upfront.
+static vm_fault_t ring_buf_vm_fault(struct vm_fault *vmf)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct ring_buf *ring = vma->vm_private_data;
+    unsigned long p = (vmf->address - vma->vm_start) >> PAGE_SHIFT;
+
+    if (p < KMISC_MMAP_DATA_PGOFF)
+        return VM_FAULT_SIGBUS;
+
+    return vmf_insert_pfn(vma, vmf->address & PAGE_MASK, ring_buf_data_pfn(ring, p - KMISC_MMAP_DATA_PGOFF));
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,6,0)
+static vm_fault_t ring_buf_vm_huge_fault(struct vm_fault *vmf, enum page_entry_size pe_size)
+#else
+static vm_fault_t ring_buf_vm_huge_fault(struct vm_fault *vmf, unsigned int order)
+#endif
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct ring_buf *ring = vma->vm_private_data;
+    unsigned long data = vma->vm_start + (KMISC_MMAP_DATA_PGOFF << PAGE_SHIFT);
+    unsigned long addr = vmf->address & PMD_MASK;
+    unsigned long pfn;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,6,0)
+    if (pe_size != PE_SIZE_PMD)
+#else
+    if (order != PMD_SHIFT - PAGE_SHIFT)
+#endif
+        return VM_FAULT_FALLBACK;
+
+    if (addr < data || addr + PMD_SIZE > vma->vm_end || ((addr - data) & ~PMD_MASK))
+        return VM_FAULT_FALLBACK;
+
+    pfn = ring_buf_data_pfn(ring, (addr - data) >> PAGE_SHIFT);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,17,0)
+    return vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(pfn), vmf->flags & FAULT_FLAG_WRITE);
+#else
+    return vmf_insert_pfn_pmd(vmf, pfn, vmf->flags & FAULT_FLAG_WRITE);
+#endif
+}
+
+static const struct vm_operations_struct ring_buf_huge_vm_ops = {
+    .open = ring_buf_vm_open,
+    .close = ring_buf_vm_close,
+    .fault = ring_buf_vm_fault,
+    .huge_fault = ring_buf_vm_huge_fault,
+};
+
+// Puts the data of a huge ring, right after the control page, at a
+// PMD aligned address: the mapping is placed as if it started that
+// much into a file mapped at an aligned offset.
+static unsigned long ring_buf_get_unmapped_area(struct ring_buf *ring, struct file *filp, unsigned long addr,
+                                                unsigned long len, unsigned long pgoff, unsigned long flags)
+{
+    if (READ_ONCE(ring->order) && pgoff == KMISC_MMAP_CTL_PGOFF)
+        pgoff = (PMD_SIZE >> PAGE_SHIFT) - KMISC_MMAP_DATA_PGOFF;
+
+    return thp_get_unmapped_area(filp, addr, len, pgoff, flags);
+}
+
+#endif
+
+// Maps the control page and then the data pages twice, the same
+// wrap-around trick as the kernel mapping. The user space can then
+// produce or consume with plain loads and stores following the
+// protocol described next to struct kmisc_ring_ctl.
+//
+// A huge ring is mapped the same way but as raw pfns faulted in on
+// demand, for the data to go in with the PMDs: the compound pages
+// can't be inserted as a whole with vm_insert_page().
+static int ring_buf_mmap(struct ring_buf *ring, struct vm_area_struct *vma)
+{
+    unsigned long addr = vma->vm_start;
+    size_t i;
+    int ret;
+
+    // Private mappings would get COW copies of the ring
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    percpu_down_read(&ring->config_sem);
+
+    if (vma->vm_pgoff != KMISC_MMAP_CTL_PGOFF ||
+        vma->vm_end - vma->vm_start != PAGE_SIZE + 2*ring->size) {
+        ret = -EINVAL;
+        goto exit;
+    }
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    if (ring->order) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+        vma->vm_flags |= VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP | VM_HUGEPAGE;
+#else
+        vm_flags_set(vma, VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP | VM_HUGEPAGE);
+#endif
+
+        ret = remap_pfn_range(vma, addr, page_to_pfn(ring->ctl_page), PAGE_SIZE, vma->vm_page_prot);
+
+        if (!ret) {
+            vma->vm_private_data = ring;
+            vma->vm_ops = &ring_buf_huge_vm_ops;
+            atomic_inc(&ring->mapped);
+        }
+
+        goto exit;
+    }
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#else
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#endif
+
+    ret = vm_insert_page(vma, addr, ring->ctl_page);
+
+    for (i = 0; i < 2*ring->page_count && !ret; ++i) {
+        addr += PAGE_SIZE;
+        ret = vm_insert_page(vma, addr, ring->pages[i % ring->page_count]);
+    }
+
+    // Counted only once mapped: ->close isn't called if ->mmap fails
+    if (!ret) {
+        vma->vm_private_data = ring;
+        vma->vm_ops = &ring_buf_vm_ops;
+        atomic_inc(&ring->mapped);
+    }
+
+exit:
+
+    percpu_up_read(&ring->config_sem);
+
+    return ret;
+}
+
+static void ring_buf_stats_sum(struct ring_buf *ring, struct ring_buf_stats *sum)
+{
+    int cpu;
+
+    memset(sum, 0, sizeof(*sum));
+
+    for_each_possible_cpu(cpu) {
+        struct ring_buf_stats *stats = per_cpu_ptr(ring->stats, cpu);
+
+        sum->bytes_written += READ_ONCE(stats->bytes_written);
+        sum->bytes_read += READ_ONCE(stats->bytes_read);
+        sum->writes += READ_ONCE(stats->writes);
+        sum->reads += READ_ONCE(stats->reads);
+        sum->short_writes += READ_ONCE(stats->short_writes);
+        sum->short_reads += READ_ONCE(stats->short_reads);
+        sum->full += READ_ONCE(stats->full);
+        sum->empty += READ_ONCE(stats->empty);
+        sum->contended += READ_ONCE(stats->contended);
+        sum->high_water = max(sum->high_water, READ_ONCE(stats->high_water));
+    }
+}
+
+static int ring_buf_stats_scnprintf(struct ring_buf *ring, char *buf, size_t size)
+{
+    struct ring_buf_stats sum;
+
+    ring_buf_stats_sum(ring, &sum);
+
+    return scnprintf(buf, size,
+        "Buffer size: %zu bytes\n"
+        "Used: %zu bytes\n"
+        "High water: %llu bytes\n"
+        "Bytes written: %llu\n"
+        "Bytes read: %llu\n"
+        "Writes: %llu\n"
+        "Reads: %llu\n"
+        "Short writes: %llu\n"
+        "Short reads: %llu\n"
+        "Full: %llu\n"
+        "Empty: %llu\n"
+        "Contended: %llu\n"
+        "Dropped: %llu\n",
+        READ_ONCE(ring->size), ring_buf_used(ring), sum.high_water,
+        sum.bytes_written, sum.bytes_read, sum.writes, sum.reads,
+        sum.short_writes, sum.short_reads, sum.full, sum.empty,
+        sum.contended, (u64)atomic64_read(&ring->dropped));
+}
+
+// cat /sys/kernel/debug/kmisc/stats: the totals, then the per-cpu
+// breakdown to see which side runs where and who contends.
+static int ring_buf_stats_show(struct seq_file *m, void *v)
+{
+    struct ring_buf *ring = m->private;
+    char *buf;
+    int cpu;
+
+    buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    ring_buf_stats_scnprintf(ring, buf, PAGE_SIZE);
+    seq_puts(m, buf);
+    kfree(buf);
+
+    seq_printf(m, "\n%4s %16s %16s %12s %12s %12s %12s %12s %12s %12s %16s\n",
+        "cpu", "bytes_written", "bytes_read", "writes", "reads", "short_wr", "short_rd",
+        "full", "empty", "contended", "high_water");
+
+    for_each_possible_cpu(cpu) {
+        struct ring_buf_stats *stats = per_cpu_ptr(ring->stats, cpu);
+
+        seq_printf(m, "%4d %16llu %16llu %12llu %12llu %12llu %12llu %12llu %12llu %12llu %16llu\n",
+            cpu, READ_ONCE(stats->bytes_written), READ_ONCE(stats->bytes_read),
+            READ_ONCE(stats->writes), READ_ONCE(stats->reads),
+            READ_ONCE(stats->short_writes), READ_ONCE(stats->short_reads),
+            READ_ONCE(stats->full), READ_ONCE(stats->empty),
+            READ_ONCE(stats->contended), READ_ONCE(stats->high_water));
+    }
+
+    return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(ring_buf_stats);
+
+struct kmisc_dev {
+    struct ring_buf *ring; // Of the files not bound to a channel
+    struct miscdevice misc_dev;
+    struct device_attribute attr;
+    struct dentry *debugfs_dir;
+    struct dentry *channels_dir;
+    struct mutex channels_lock;
+    struct list_head channels;
+};
+
+// Independent pipelines get rings of their own so they don't share
+// the locks or the cache lines. Counted by the files bound to it, the
+// mappings hold their file and so the channel too.
+struct kmisc_channel_ring {
+    struct kref ref;
+    struct list_head node; // In kmisc_dev.channels
+    struct kmisc_dev *dev;
+    struct ring_buf *ring;
+    struct dentry *debugfs;
+    char name[KMISC_CHANNEL_NAME_LEN];
+};
+
+#define KMISC_FILE_TIMER        0 // The latency timer is running
+#define KMISC_FILE_EXPIRED      1 // and has fired since the last read
+
+// What an open file points to in private_data
+struct kmisc_file {
+    struct kmisc_dev *dev;
+    struct kmisc_channel_ring *channel; // Set once, NULL for the default ring
+    struct ring_buf_cursor cursor; // In the broadcast mode
+    // Wakeup coalescing, see struct kmisc_wakeup. The watch entries sit
+    // on the queues of the ring while the file has a waiter or a poller,
+    // and pass a wakeup on to the queues of the file only when its
+    // conditions are met, so the waiters aren't scheduled just to go
+    // back to sleep.
+    spinlock_t watch_lock;
+    struct ring_buf *watched; // The ring the watch entries are on
+    wait_queue_entry_t read_watch;
+    wait_queue_entry_t write_watch;
+    wait_queue_head_t read_wait;
+    wait_queue_head_t write_wait;
+    u64 high_watermark;
+    u64 low_watermark;
+    u64 timeout_ns;
+    struct hrtimer timer;
+    unsigned long state; // KMISC_FILE_*
+    struct mutex drain_lock;
+    struct kmisc_drain_thread *drain;
+};
+
+// Reads through a file from a kernel thread and writes the data out
+// to the files of struct kmisc_drain. A batch is whatever the wakeup
+// conditions of the file let accumulate, up to the buffer size.
+struct kmisc_drain_thread {
+    struct task_struct *task;
+    struct kmisc_file *kfile;
+    struct file *files[KMISC_DRAIN_FILES];
+    unsigned int count;
+    unsigned int index; // Of the file being written
+    loff_t pos;
+    u64 rotate_size;
+    void *buf;
+    size_t buf_size;
+};
+
+#define KMISC_DRAIN_BATCH       (4 << 20)
+
+static struct ring_buf *kmisc_kfile_ring(struct kmisc_file *kfile)
+{
+    struct kmisc_channel_ring *channel = smp_load_acquire(&kfile->channel);
+
+    return channel ? channel->ring : kfile->dev->ring;
+}
+
+static struct ring_buf *kmisc_file_ring(struct file *filp)
+{
+    return kmisc_kfile_ring(filp->private_data);
+}
+
+// Whether a reader of the file should be woken up. Below the watermark
+// the timer is started so that the data doesn't wait longer than the
+// timeout.
+static bool kmisc_file_readable(struct kmisc_file *kfile, struct ring_buf *ring)
+{
+    size_t used = ring_buf_cursor_used(ring, &kfile->cursor);
+    u64 timeout_ns = READ_ONCE(kfile->timeout_ns);
+
+    if (!used)
+        return false;
+
+    if (used >= READ_ONCE(kfile->high_watermark) || test_bit(KMISC_FILE_EXPIRED, &kfile->state))
+        return true;
+
+    // The writers are stuck, the watermark can't be reached
+    if (!ring_buf_writable(ring, 1, false))
+        return true;
+
+    if (timeout_ns && !test_and_set_bit(KMISC_FILE_TIMER, &kfile->state))
+        hrtimer_start(&kfile->timer, ns_to_ktime(timeout_ns), HRTIMER_MODE_REL);
+
+    return false;
+}
+
+static bool kmisc_file_writable(struct kmisc_file *kfile, struct ring_buf *ring, size_t size, bool whole)
 {
-	int i;
-	struct page **double_map; // Wraps around
-	struct ring_buf* ring;
+    u64 low_watermark = READ_ONCE(kfile->low_watermark);
 
-	double_map = NULL;
+    return ring_buf_writable(ring, size, whole) && (!low_watermark || ring_buf_used(ring) < low_watermark);
+}
 
-	ring = kzalloc(sizeof(struct ring_buf), GFP_KERNEL);
-	if (!ring)
-		goto fail;
+static enum hrtimer_restart kmisc_file_timer(struct hrtimer *timer)
+{
+    struct kmisc_file *kfile = container_of(timer, struct kmisc_file, timer);
 
-	ring->size = page_count * PAGE_SIZE;
-	spin_lock_init(&ring->read_lock);
-	spin_lock_init(&ring->write_lock);
+    set_bit(KMISC_FILE_EXPIRED, &kfile->state);
+    clear_bit(KMISC_FILE_TIMER, &kfile->state);
+    wake_up_interruptible_poll(&kfile->read_wait, EPOLLIN | EPOLLRDNORM);
 
-	ring->pages = alloc_pages(GFP_KERNEL, get_order(ring->size));
+    return HRTIMER_NORESTART;
+}
 
-	if (!ring->pages)
-		goto fail;
+// Run by the wakeups of the ring under the lock of its queue. Once
+// nobody waits on the file, the entry takes itself off the queue: the
+// ring then finds its queue empty and wakes up no one, without taking
+// the lock, see ring_buf_wake(). The next wait puts the entry back.
+static int kmisc_file_read_watch(wait_queue_entry_t *wq_entry, unsigned int mode, int sync, void *key)
+{
+    struct kmisc_file *kfile = container_of(wq_entry, struct kmisc_file, read_watch);
 
-	double_map = kcalloc(page_count*2, sizeof(struct page*), GFP_KERNEL);
-	if (!double_map)
-		goto fail;
-	
-	for (i = 0; i < page_count; ++i)
-		double_map[i] = double_map[i + page_count] = &ring->pages[i];
+    if (!wq_has_sleeper(&kfile->read_wait))
+        list_del_init(&wq_entry->entry);
+    else if (kmisc_file_readable(kfile, kfile->watched))
+        wake_up_interruptible_poll(&kfile->read_wait, EPOLLIN | EPOLLRDNORM);
 
-	ring->buf = vmap(double_map, page_count*2, VM_MAP, PAGE_KERNEL);
+    return 0;
+}
 
-    // ring->buf[4096] = 0xAA;
-    // ring->buf[4097] = 0xD1;
-    // pr_info("ring buffer mapped at: %llx %#x %#x\n", (u64)&ring->buf[0], ring->buf[0], ring->buf[1]);
+static int kmisc_file_write_watch(wait_queue_entry_t *wq_entry, unsigned int mode, int sync, void *key)
+{
+    struct kmisc_file *kfile = container_of(wq_entry, struct kmisc_file, write_watch);
 
-	if (!ring->buf)
-		goto fail;
+    if (!wq_has_sleeper(&kfile->write_wait))
+        list_del_init(&wq_entry->entry);
+    else if (kmisc_file_writable(kfile, kfile->watched, 1, false))
+        wake_up_interruptible_poll(&kfile->write_wait, EPOLLOUT | EPOLLWRNORM);
 
-	kfree(double_map);
+    return 0;
+}
 
-	return ring;
+// Under the lock of the queue: the entry may take itself off any time
+static void kmisc_file_watch_add(wait_queue_head_t *wq, wait_queue_entry_t *watch)
+{
+    unsigned long flags;
 
-fail:
+    spin_lock_irqsave(&wq->lock, flags);
+    if (list_empty(&watch->entry))
+        __add_wait_queue(wq, watch);
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
 
-    if (double_map)
-        kfree(double_map);
+static void kmisc_file_watch_del(wait_queue_head_t *wq, wait_queue_entry_t *watch)
+{
+    unsigned long flags;
 
-    if (ring) {
-        if (ring->buf)
-            vunmap(ring->buf);
+    spin_lock_irqsave(&wq->lock, flags);
+    list_del_init(&watch->entry);
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+// Puts the watch entries for the events on the queues of the ring,
+// moving them once the file gets bound to a channel. Called with the
+// waiter on the queue of the file already, so the entries don't take
+// themselves off before the waiter is seen.
+static void kmisc_file_watch(struct kmisc_file *kfile, struct ring_buf *ring, __poll_t events)
+{
+    spin_lock(&kfile->watch_lock);
 
-        if (ring->pages)
-            __free_pages(ring->pages, get_order(ring->size));
+    if (kfile->watched != ring) {
+        if (kfile->watched) {
+            kmisc_file_watch_del(&kfile->watched->read_wait, &kfile->read_watch);
+            kmisc_file_watch_del(&kfile->watched->write_wait, &kfile->write_watch);
+        }
 
-        kfree(ring);
+        WRITE_ONCE(kfile->watched, ring);
     }
 
-    return NULL;
+    if (events & EPOLLIN)
+        kmisc_file_watch_add(&ring->read_wait, &kfile->read_watch);
+    if (events & EPOLLOUT)
+        kmisc_file_watch_add(&ring->write_wait, &kfile->write_watch);
+
+    spin_unlock(&kfile->watch_lock);
+
+    // Pairs with wq_has_sleeper() in ring_buf_wake(): either the waker
+    // sees the entry, or the caller sees what the waker did
+    smp_mb();
 }
 
-static void ring_buf_free(struct ring_buf *ring)
+static void kmisc_file_unwatch(struct kmisc_file *kfile)
 {
-    if (ring) {
-        if (ring->buf)
-            vunmap(ring->buf);
+    if (kfile->watched) {
+        kmisc_file_watch_del(&kfile->watched->read_wait, &kfile->read_watch);
+        kmisc_file_watch_del(&kfile->watched->write_wait, &kfile->write_watch);
+        kfile->watched = NULL;
+    }
 
-        if (ring->pages)
-            __free_pages(ring->pages, get_order(ring->size));
+    hrtimer_cancel(&kfile->timer);
+}
 
-        kfree(ring);
-    }
+// The conditions of the waits on the file, checked once the waiter is
+// on the queue of the file
+static bool kmisc_file_wait_readable(struct kmisc_file *kfile, struct ring_buf *ring)
+{
+    kmisc_file_watch(kfile, ring, EPOLLIN);
+
+    return kmisc_file_readable(kfile, ring);
 }
 
-static ssize_t __ring_buf_read(struct ring_buf *ring, void* out_buf, size_t out_buf_size,
-                                bool user_buffer)
+static bool kmisc_file_wait_writable(struct kmisc_file *kfile, struct ring_buf *ring, size_t size, bool whole)
 {
-    off_t write_idx;
-    off_t read_idx;
-    off_t available_to_read;
-    off_t will_read;
+    kmisc_file_watch(kfile, ring, EPOLLOUT);
 
-    spin_lock(&ring->read_lock);
+    return kmisc_file_writable(kfile, ring, size, whole);
+}
 
-    write_idx = atomic64_read_acquire(&ring->write_idx);
-    read_idx = atomic64_read_acquire(&ring->read_idx);
+static int kmisc_file_set_wakeup(struct kmisc_file *kfile, const struct kmisc_wakeup __user *arg)
+{
+    struct kmisc_wakeup wakeup;
 
-    // If the indexes are equal, the buffer is empty,
-    // nothing is avalaible to read
+    if (copy_from_user(&wakeup, arg, sizeof(wakeup)))
+        return -EFAULT;
 
-    available_to_read = write_idx - read_idx;
-    if (available_to_read < 0)
-        available_to_read += ring->size;
-    will_read = min((size_t)available_to_read, out_buf_size);
+    WRITE_ONCE(kfile->high_watermark, wakeup.high_watermark);
+    WRITE_ONCE(kfile->low_watermark, wakeup.low_watermark);
+    WRITE_ONCE(kfile->timeout_ns, wakeup.timeout_ns);
 
-    // Instead of modulo % as the size is a power of 2
-    read_idx &= (ring->size - 1);
+    // The waiters re-check with the new conditions
+    wake_up_interruptible_poll(&kfile->read_wait, EPOLLIN | EPOLLRDNORM);
+    wake_up_interruptible_poll(&kfile->write_wait, EPOLLOUT | EPOLLWRNORM);
 
-    if (!user_buffer)
-        memcpy(out_buf, (u8*)ring->buf + read_idx, will_read);
-    else {
-        size_t nbytes_couldnt_copy = 
-            copy_to_user((void __force __user*)out_buf, (u8*)ring->buf + read_idx, will_read);
-        will_read -= nbytes_couldnt_copy;
+    return 0;
+}
+
+// Moves on to the next file and truncates it, with the credentials of
+// whoever opened it rather than those of the thread
+static void kmisc_drain_rotate(struct kmisc_drain_thread *drain)
+{
+    const struct cred *old_cred;
+    struct file *file;
+    int ret;
+
+    drain->index = (drain->index + 1) % drain->count;
+    drain->pos = 0;
+    file = drain->files[drain->index];
+
+    old_cred = override_creds(file->f_cred);
+    ret = vfs_truncate(&file->f_path, 0);
+    revert_creds(old_cred);
+
+    if (ret)
+        pr_warn_ratelimited("Couldn't truncate file %u: %d in %s\n", drain->index, ret, __func__);
+}
+
+static void kmisc_drain_write(struct kmisc_drain_thread *drain, struct ring_buf *ring, size_t size)
+{
+    const u8 *data = drain->buf;
+    ssize_t ret;
+
+    // A batch bigger than rotate_size still goes to a single file
+    if (drain->rotate_size && drain->pos && drain->pos + size > drain->rotate_size)
+        kmisc_drain_rotate(drain);
+
+    while (size) {
+        ret = kernel_write(drain->files[drain->index], data, size, &drain->pos);
+
+        // Already out of the ring, counted as dropped
+        if (ret <= 0) {
+            pr_warn_ratelimited("Couldn't write %zu bytes: %zd in %s\n", size, ret, __func__);
+            atomic64_add(size, &ring->dropped);
+            return;
+        }
+
+        data += ret;
+        size -= ret;
     }
+}
+
+// The records are read whole, one bigger than the batch gets a buffer
+// as big as the ring
+static int kmisc_drain_grow(struct kmisc_drain_thread *drain, struct ring_buf *ring)
+{
+    size_t size = READ_ONCE(ring->size);
+    void *buf;
 
-    atomic64_add(will_read, &ring->read_idx);
+    if (drain->buf_size >= size)
+        return -EMSGSIZE;
 
-    spin_unlock(&ring->read_lock);
+    buf = kvmalloc(size, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    kvfree(drain->buf);
+    drain->buf = buf;
+    drain->buf_size = size;
 
-    return will_read;
+    return 0;
 }
 
-static ssize_t __maybe_unused ring_buf_read(struct ring_buf *ring, void* out_buf, size_t out_buf_size)
+static int kmisc_drain_fn(void *arg)
+{
+    struct kmisc_drain_thread *drain = arg;
+    struct kmisc_file *kfile = drain->kfile;
+    // The file can't be bound while draining, the ring stays the same
+    struct ring_buf *ring = kmisc_kfile_ring(kfile);
+    struct iov_iter to;
+    struct kvec kv;
+    ssize_t ret;
+
+    while (!kthread_should_stop()) {
+        kv.iov_base = drain->buf;
+        kv.iov_len = drain->buf_size;
+        iov_iter_kvec(&to, READ, &kv, 1, drain->buf_size);
+
+        ret = ring_buf_read_iter(ring, &kfile->cursor, &to);
+
+        if (test_bit(KMISC_FILE_EXPIRED, &kfile->state))
+            clear_bit(KMISC_FILE_EXPIRED, &kfile->state);
+
+        if (ret > 0) {
+            kmisc_drain_write(drain, ring, ret);
+            continue;
+        }
+
+        if (ret == -EMSGSIZE) {
+            ret = kmisc_drain_grow(drain, ring);
+            if (!ret)
+                continue;
+        }
+
+        if (ret < 0) {
+            pr_err("Draining stopped: %zd in %s\n", ret, __func__);
+            break;
+        }
+
+        if (ret == 0)
+            wait_event_interruptible(kfile->read_wait,
+                kmisc_file_wait_readable(kfile, ring) || kthread_should_stop());
+    }
+
+    // kthread_stop() needs the thread around
+    for (;;) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (kthread_should_stop())
+            break;
+        schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+
+    return 0;
+}
+
+static void kmisc_drain_free(struct kmisc_drain_thread *drain)
 {
-    return __ring_buf_read(ring, out_buf, out_buf_size, false);
+    unsigned int i;
+
+    for (i = 0; i < drain->count; ++i) {
+        if (drain->files[i])
+            fput(drain->files[i]);
+    }
+
+    kvfree(drain->buf);
+    kfree(drain);
 }
 
-static ssize_t __maybe_unused ring_buf_read_to_user(struct ring_buf *ring, void* out_buf, size_t out_buf_size)
+static void kmisc_drain_stop(struct kmisc_drain_thread *drain)
 {
-    return __ring_buf_read(ring, out_buf, out_buf_size, true);
+    if (drain) {
+        kthread_stop(drain->task);
+        kmisc_drain_free(drain);
+    }
 }
 
-static ssize_t __ring_buf_write(struct ring_buf *ring, const void* in_buf, size_t in_buf_size,
-                                bool user_buffer)
+// Sets up the thread, not started yet
+static struct kmisc_drain_thread *kmisc_drain_create(struct kmisc_file *kfile, const struct kmisc_drain *desc)
 {
-    off_t write_idx;
-    off_t read_idx;
-    off_t available_to_write;
-    off_t will_write;
+    struct ring_buf *ring = kmisc_kfile_ring(kfile);
+    struct kmisc_channel_ring *channel = READ_ONCE(kfile->channel);
+    struct kmisc_drain_thread *drain;
+    struct file *file;
+    unsigned int i;
+    int ret;
 
-    spin_lock(&ring->write_lock);
+    drain = kzalloc(sizeof(*drain), GFP_KERNEL);
+    if (!drain)
+        return ERR_PTR(-ENOMEM);
 
-    write_idx = atomic64_read_acquire(&ring->write_idx);
-    read_idx = atomic64_read_acquire(&ring->read_idx);
- 
-    // If the indexes are equal, the buffer is empty,
-    // and all space is available to write
+    drain->kfile = kfile;
+    drain->count = desc->count;
+    drain->rotate_size = desc->rotate_size;
 
-    available_to_write = read_idx - write_idx;
-    if (available_to_write <= 0)
-        available_to_write += ring->size;
-    will_write = min((size_t)available_to_write, in_buf_size);
+    for (i = 0; i < desc->count; ++i) {
+        file = fget(desc->fds[i]);
+        if (!file) {
+            ret = -EBADF;
+            goto fail;
+        }
 
-    // Instead of modulo % as the size is a power of 2
-    write_idx &= (ring->size - 1);
+        drain->files[i] = file;
 
-    if (!user_buffer)
-        memcpy((u8*)ring->buf + write_idx, in_buf, will_write);
-    else {
-        size_t nbytes_couldnt_copy = 
-            copy_from_user((u8*)ring->buf + write_idx, (void __force __user*)in_buf, will_write);
-        will_write -= nbytes_couldnt_copy;
+        if (!(file->f_mode & FMODE_WRITE) || !S_ISREG(file_inode(file)->i_mode)) {
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+
+    // Appends to the first file
+    drain->pos = i_size_read(file_inode(drain->files[0]));
+
+    drain->buf_size = min_t(size_t, READ_ONCE(ring->size), KMISC_DRAIN_BATCH);
+    drain->buf = kvmalloc(drain->buf_size, GFP_KERNEL);
+    if (!drain->buf) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    // Next to the ring
+    drain->task = kthread_create_on_node(kmisc_drain_fn, drain, ring->node, "kmisc-drain/%s",
+                                         channel ? channel->name : kfile->dev->misc_dev.name);
+    if (IS_ERR(drain->task)) {
+        ret = PTR_ERR(drain->task);
+        goto fail;
+    }
+
+    return drain;
+
+fail:
+
+    kmisc_drain_free(drain);
+
+    return ERR_PTR(ret);
+}
+
+static int kmisc_file_drain(struct kmisc_file *kfile, const struct kmisc_drain __user *arg)
+{
+    struct kmisc_drain_thread *drain = NULL;
+    struct kmisc_drain desc;
+
+    if (copy_from_user(&desc, arg, sizeof(desc)))
+        return -EFAULT;
+
+    if (desc.reserved || desc.count > KMISC_DRAIN_FILES)
+        return -EINVAL;
+
+    mutex_lock(&kfile->drain_lock);
+
+    if (desc.count) {
+        drain = kmisc_drain_create(kfile, &desc);
+        if (IS_ERR(drain)) {
+            mutex_unlock(&kfile->drain_lock);
+            return PTR_ERR(drain);
+        }
     }
 
-    atomic64_add(will_write, &ring->write_idx);
+    // The old thread is done with its batch before the new one starts
+    kmisc_drain_stop(kfile->drain);
+    kfile->drain = drain;
+
+    if (drain)
+        wake_up_process(drain->task);
 
-    spin_unlock(&ring->write_lock);
+    mutex_unlock(&kfile->drain_lock);
 
-    return will_write;    
+    return 0;
 }
 
-static ssize_t __maybe_unused ring_buf_write(struct ring_buf *ring, const void* in_buf, size_t in_buf_size)
+// Called with channels_lock held, drops it
+static void kmisc_channel_release(struct kref *ref)
 {
-    return __ring_buf_write(ring, in_buf, in_buf_size, false);
+    struct kmisc_channel_ring *channel = container_of(ref, struct kmisc_channel_ring, ref);
+
+    // Before a channel of the same name can be created
+    debugfs_remove(channel->debugfs);
+    list_del(&channel->node);
+    mutex_unlock(&channel->dev->channels_lock);
+
+    pr_info("Destroying channel %s in %s\n", channel->name, __func__);
+
+    ring_buf_free(channel->ring);
+    kfree(channel);
 }
 
-static ssize_t __maybe_unused ring_buf_write_from_user(struct ring_buf *ring, const void* in_buf, size_t in_buf_size)
+static void kmisc_channel_put(struct kmisc_channel_ring *channel)
 {
-    return __ring_buf_write(ring, in_buf, in_buf_size, true);
+    kref_put_mutex(&channel->ref, kmisc_channel_release, &channel->dev->channels_lock);
 }
 
-struct kmisc_dev {
-    struct ring_buf *ring;
-    struct miscdevice misc_dev;
-    struct device_attribute attr;
-};
+// Finds the channel by name or creates it with the ring on the NUMA
+// node of the current CPU. Returns it with a reference taken.
+static struct kmisc_channel_ring *kmisc_channel_get(struct kmisc_dev *dev, const char *name)
+{
+    struct kmisc_channel_ring *channel;
+    int node = numa_node_id();
+    int ret;
+
+    mutex_lock(&dev->channels_lock);
+
+    list_for_each_entry(channel, &dev->channels, node) {
+        if (strcmp(channel->name, name) == 0) {
+            kref_get(&channel->ref);
+            goto exit;
+        }
+    }
+
+    channel = kzalloc_node(sizeof(*channel), GFP_KERNEL, node);
+    if (!channel) {
+        channel = ERR_PTR(-ENOMEM);
+        goto exit;
+    }
+
+    channel->ring = ring_buf_alloc(ring_size, node, ring_huge);
+    if (!channel->ring) {
+        kfree(channel);
+        channel = ERR_PTR(-ENOMEM);
+        goto exit;
+    }
+
+    ret = ring_buf_set_mode(channel->ring, ring_mode);
+    if (ret) {
+        ring_buf_free(channel->ring);
+        kfree(channel);
+        channel = ERR_PTR(ret);
+        goto exit;
+    }
+
+    kref_init(&channel->ref);
+    channel->dev = dev;
+    strscpy(channel->name, name, sizeof(channel->name));
+    channel->debugfs = debugfs_create_file(channel->name, 0444, dev->channels_dir, channel->ring,
+        &ring_buf_stats_fops);
+    list_add(&channel->node, &dev->channels);
+
+    pr_info("Created channel %s on node %d in %s\n", channel->name, node, __func__);
+
+exit:
+
+    mutex_unlock(&dev->channels_lock);
+
+    return channel;
+}
+
+static int kmisc_bind(struct file *filp, const struct kmisc_channel __user *arg)
+{
+    struct kmisc_file *kfile = filp->private_data;
+    struct kmisc_channel_ring *channel;
+    struct kmisc_channel desc;
+    char name[KMISC_CHANNEL_NAME_LEN];
+
+    if (copy_from_user(&desc, arg, sizeof(desc)))
+        return -EFAULT;
+
+    if (desc.reserved || strnlen(desc.name, sizeof(desc.name)) == sizeof(desc.name) ||
+        strchr(desc.name, '/'))
+        return -EINVAL;
+
+    if (desc.name[0])
+        strscpy(name, desc.name, sizeof(name));
+    else
+        snprintf(name, sizeof(name), "%u", desc.id);
+
+    if (READ_ONCE(kfile->channel))
+        return -EBUSY;
+
+    // The drain thread keeps reading the ring it started with
+    mutex_lock(&kfile->drain_lock);
+
+    if (kfile->drain) {
+        mutex_unlock(&kfile->drain_lock);
+        return -EBUSY;
+    }
+
+    channel = kmisc_channel_get(kfile->dev, name);
+    if (IS_ERR(channel)) {
+        mutex_unlock(&kfile->drain_lock);
+        return PTR_ERR(channel);
+    }
+
+    // Racing binds of the same file, the first one wins
+    if (cmpxchg_release(&kfile->channel, NULL, channel) != NULL) {
+        mutex_unlock(&kfile->drain_lock);
+        kmisc_channel_put(channel);
+        return -EBUSY;
+    }
+
+    mutex_unlock(&kfile->drain_lock);
+
+    // Stops holding back the default ring
+    ring_buf_unsubscribe(&kfile->cursor);
+
+    return 0;
+}
 
 static ssize_t __maybe_unused kmisc_attr_show(struct device *dev, struct device_attribute *attr,
         char *buf)
 {
+    struct kmisc_dev* kdev = container_of(attr, struct kmisc_dev, attr);
+
     // cat /sys/devices/virtual/misc/kmisc/kmisc
-    return sprintf(buf, "Buffer size: %d bytes\n", KMISC_BUF_SIZE);
+    return ring_buf_stats_scnprintf(kdev->ring, buf, PAGE_SIZE);
 }
 
 static ssize_t __maybe_unused kmisc_attr_store(struct device *dev, struct device_attribute *attr,
             const char *buf, size_t count)
 {
-	return strnlen(buf, count);
+    struct kmisc_dev* kdev = container_of(attr, struct kmisc_dev, attr);
+    unsigned long size;
+    int ret;
+
+    // echo 67108864 > /sys/devices/virtual/misc/kmisc/kmisc
+    ret = kstrtoul(buf, 0, &size);
+    if (ret)
+        return ret;
+
+    ret = ring_buf_resize(kdev->ring, size);
+    if (ret)
+        return ret;
+
+	return count;
 }
 
 static int kmisc_open(struct inode *, struct file *);
 static int kmisc_release(struct inode *, struct file *);
-static ssize_t kmisc_read(struct file *, char __user *, size_t, loff_t *);
-static ssize_t kmisc_write(struct file *, const char __user *, size_t, loff_t *);
+static ssize_t kmisc_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t kmisc_write_iter(struct kiocb *, struct iov_iter *);
+static int kmisc_mmap(struct file *, struct vm_area_struct *);
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static unsigned long kmisc_get_unmapped_area(struct file *, unsigned long, unsigned long, unsigned long,
+                                             unsigned long);
+#endif
+static __poll_t kmisc_poll(struct file *, poll_table *);
+static long kmisc_ioctl(struct file *, unsigned int, unsigned long);
 
 static const struct file_operations kmisc_file_ops = {
     .owner   = THIS_MODULE,
 	.open    = kmisc_open,
 	.release = kmisc_release,
-    .read = kmisc_read,
-    .write = kmisc_write
+    .read_iter = kmisc_read_iter,
+    .write_iter = kmisc_write_iter,
+    // Both go through the iterators above: splice() to or from a pipe,
+    // and sendfile() to a file or a socket, copy once, straight between
+    // the ring and the pipe pages, without a trip through user space.
+    // The pipe pages can't alias the ring: the space is reused as soon
+    // as read_idx moves while the pipe may keep its buffers for long.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
+    .mmap = kmisc_mmap,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    .get_unmapped_area = kmisc_get_unmapped_area,
+#endif
+    .poll = kmisc_poll,
+    .unlocked_ioctl = kmisc_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,12,0)
+    .fop_flags = FOP_NOWAIT,
+#endif
 };
 
 static int kmisc_open(struct inode *inode, struct file *filp)
 {
     struct kmisc_dev* dev = container_of(filp->private_data,  struct kmisc_dev, misc_dev);
+    struct kmisc_file *kfile;
 
     pr_info("Opening %s in %s\n", dev->misc_dev.name, __func__);
+
+    kfile = kzalloc(sizeof(*kfile), GFP_KERNEL);
+    if (!kfile)
+        return -ENOMEM;
+
+    kfile->dev = dev;
+    INIT_LIST_HEAD(&kfile->cursor.node);
+    spin_lock_init(&kfile->watch_lock);
+    init_waitqueue_func_entry(&kfile->read_watch, kmisc_file_read_watch);
+    init_waitqueue_func_entry(&kfile->write_watch, kmisc_file_write_watch);
+    INIT_LIST_HEAD(&kfile->read_watch.entry); // Off the queues
+    INIT_LIST_HEAD(&kfile->write_watch.entry);
+    init_waitqueue_head(&kfile->read_wait);
+    init_waitqueue_head(&kfile->write_wait);
+    mutex_init(&kfile->drain_lock);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,13,0)
+    hrtimer_init(&kfile->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    kfile->timer.function = kmisc_file_timer;
+#else
+    hrtimer_setup(&kfile->timer, kmisc_file_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#endif
+    filp->private_data = kfile;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,12,0)
+    // io_uring can try the non-blocking path inline
+    filp->f_mode |= FMODE_NOWAIT;
+#endif
+
     return 0;
 }
 
 static int kmisc_release(struct inode *inode, struct file *filp)
 {
-    struct kmisc_dev* dev = container_of(filp->private_data,  struct kmisc_dev, misc_dev);
+    struct kmisc_file *kfile = filp->private_data;
+
+    pr_info("Closing %s in %s\n", kfile->dev->misc_dev.name, __func__);
 
-    pr_info("Closing %s in %s\n", dev->misc_dev.name, __func__);
+    // The thread reads through the file
+    kmisc_drain_stop(kfile->drain);
+
+    // Off the queues of the ring before it can go away with the channel
+    kmisc_file_unwatch(kfile);
+    ring_buf_unsubscribe(&kfile->cursor);
+
+    if (kfile->channel)
+        kmisc_channel_put(kfile->channel);
+
+    kfree(kfile);
     return 0;
 }
 
-static ssize_t kmisc_read(struct file *filp, char __user *user_buf, size_t user_buf_size, loff_t *user_offset)
+// Neither O_NONBLOCK nor io_uring's and AIO's IOCB_NOWAIT may sleep
+static bool kmisc_nowait(struct kiocb *iocb)
 {
-    struct kmisc_dev* dev = container_of(filp->private_data,  struct kmisc_dev, misc_dev);
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+// Blocks while the ring is empty unless told not to wait, then
+// returns whatever is available. A zero sized read never blocks.
+// Once blocked, the wakeup conditions of the file apply.
+static ssize_t kmisc_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct kmisc_file *kfile = iocb->ki_filp->private_data;
+    struct ring_buf *ring = kmisc_file_ring(iocb->ki_filp);
+    size_t size = iov_iter_count(to);
+    ssize_t ret;
+
+    for (;;) {
+        ret = ring_buf_read_iter(ring, &kfile->cursor, to);
+
+        // The latency is counted from the data that arrives next
+        if (test_bit(KMISC_FILE_EXPIRED, &kfile->state))
+            clear_bit(KMISC_FILE_EXPIRED, &kfile->state);
+
+        if (ret != 0 || size == 0)
+            return ret;
+
+        if (kmisc_nowait(iocb))
+            return -EAGAIN;
+
+        ret = wait_event_interruptible(kfile->read_wait, kmisc_file_wait_readable(kfile, ring));
+        if (ret)
+            return ret;
+    }
+}
 
-    return ring_buf_read_to_user(dev->ring, user_buf, user_buf_size);
+// Blocks while the ring is full unless told not to wait, then
+// writes as much as fits. All the segments of a writev() make up
+// a single chunk written whole, or a single record in the record mode.
+static ssize_t kmisc_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct kmisc_file *kfile = iocb->ki_filp->private_data;
+    struct ring_buf *ring = kmisc_file_ring(iocb->ki_filp);
+    size_t size = iov_iter_count(from);
+    bool whole = ring_buf_write_whole(from);
+    ssize_t ret;
+
+    for (;;) {
+        ret = ring_buf_write_iter(ring, from);
+        if (ret != 0 || size == 0)
+            return ret;
+
+        if (kmisc_nowait(iocb))
+            return -EAGAIN;
+
+        ret = wait_event_interruptible(kfile->write_wait, kmisc_file_wait_writable(kfile, ring, size, whole));
+        if (ret)
+            return ret;
+    }
 }
 
-static ssize_t kmisc_write(struct file *filp, const char __user *user_buf, size_t user_buf_size, loff_t *user_offset)
+static __poll_t kmisc_poll(struct file *filp, poll_table *wait)
 {
-    struct kmisc_dev* dev = container_of(filp->private_data,  struct kmisc_dev, misc_dev);
+    struct kmisc_file *kfile = filp->private_data;
+    struct ring_buf *ring = kmisc_file_ring(filp);
+    __poll_t mask = 0;
+
+    poll_wait(filp, &kfile->read_wait, wait);
+    poll_wait(filp, &kfile->write_wait, wait);
+
+    // Still there from the first call for epoll, which keeps polling
+    if (!poll_does_not_wait(wait))
+        kmisc_file_watch(kfile, ring, EPOLLIN | EPOLLOUT);
+
+    if (kmisc_file_readable(kfile, ring))
+        mask |= EPOLLIN | EPOLLRDNORM;
+
+    if (kmisc_file_writable(kfile, ring, 1, false))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+
+    return mask;
+}
+
+static long kmisc_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct ring_buf *ring = kmisc_file_ring(filp);
+
+    switch (cmd) {
+    case KMISC_IOCTL_KICK:
+        // The user mappings move the indexes behind our back
+        ring_buf_wake(&ring->read_wait, EPOLLIN | EPOLLRDNORM);
+        ring_buf_wake(&ring->write_wait, EPOLLOUT | EPOLLWRNORM);
+        return 0;
+
+    case KMISC_IOCTL_SET_MODE:
+        return ring_buf_set_mode(ring, arg);
+
+    case KMISC_IOCTL_SET_SIZE:
+        return ring_buf_resize(ring, arg);
 
-    return ring_buf_write_from_user(dev->ring, user_buf, user_buf_size);
+    case KMISC_IOCTL_SET_FLAGS:
+        return ring_buf_set_flags(ring, arg);
+
+    case KMISC_IOCTL_GET_DROPPED:
+        return put_user((u64)atomic64_read(&ring->dropped), (u64 __user *)arg);
+
+    case KMISC_IOCTL_BIND:
+        return kmisc_bind(filp, (const struct kmisc_channel __user *)arg);
+
+    case KMISC_IOCTL_SET_WAKEUP:
+        return kmisc_file_set_wakeup(filp->private_data, (const struct kmisc_wakeup __user *)arg);
+
+    case KMISC_IOCTL_DRAIN:
+        // The thread consumes the data like read() through the file
+        if (!(filp->f_mode & FMODE_READ))
+            return -EBADF;
+
+        return kmisc_file_drain(filp->private_data, (const struct kmisc_drain __user *)arg);
+
+    default:
+        return -ENOIOCTLCMD;
+    }
+}
+
+static int kmisc_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    return ring_buf_mmap(kmisc_file_ring(filp), vma);
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static unsigned long kmisc_get_unmapped_area(struct file *filp, unsigned long addr, unsigned long len,
+                                             unsigned long pgoff, unsigned long flags)
+{
+    return ring_buf_get_unmapped_area(kmisc_file_ring(filp), filp, addr, len, pgoff, flags);
 }
+#endif
 
 static struct kmisc_dev *dev;
 
+struct kmisc_producer {
+    struct kmisc_channel_ring *channel;
+    struct ring_buf *ring;
+};
+
+struct kmisc_producer *kmisc_producer_open(const char *channel)
+{
+    struct kmisc_producer *producer;
+    int ret;
+
+    if (!channel[0] || strlen(channel) >= KMISC_CHANNEL_NAME_LEN || strchr(channel, '/'))
+        return ERR_PTR(-EINVAL);
+
+    producer = kzalloc(sizeof(*producer), GFP_KERNEL);
+    if (!producer)
+        return ERR_PTR(-ENOMEM);
+
+    producer->channel = kmisc_channel_get(dev, channel);
+    if (IS_ERR(producer->channel)) {
+        ret = PTR_ERR(producer->channel);
+        goto fail;
+    }
+
+    producer->ring = producer->channel->ring;
+
+    ret = ring_buf_attach_producer(producer->ring);
+    if (ret) {
+        kmisc_channel_put(producer->channel);
+        goto fail;
+    }
+
+    return producer;
+
+fail:
+
+    kfree(producer);
+
+    return ERR_PTR(ret);
+}
+EXPORT_SYMBOL_GPL(kmisc_producer_open);
+
+void kmisc_producer_close(struct kmisc_producer *producer)
+{
+    if (producer) {
+        ring_buf_detach_producer(producer->ring);
+        kmisc_channel_put(producer->channel);
+        kfree(producer);
+    }
+}
+EXPORT_SYMBOL_GPL(kmisc_producer_close);
+
+void *kmisc_reserve(struct kmisc_producer *producer, size_t len)
+{
+    return ring_buf_reserve(producer->ring, len);
+}
+EXPORT_SYMBOL_GPL(kmisc_reserve);
+
+void kmisc_commit(struct kmisc_producer *producer, void *data)
+{
+    ring_buf_commit(producer->ring, data, false);
+}
+EXPORT_SYMBOL_GPL(kmisc_commit);
+
+void kmisc_discard(struct kmisc_producer *producer, void *data)
+{
+    ring_buf_commit(producer->ring, data, true);
+}
+EXPORT_SYMBOL_GPL(kmisc_discard);
+
 static int __init init_kmisc_example(void)
 {
     int ret;
@@ -276,10 +2793,37 @@ static int __init init_kmisc_example(void)
     if (!dev)
         return -ENOMEM;
 
-    dev->ring = ring_buf_alloc(KMISC_BUF_SIZE/PAGE_SIZE);
+    if (ring_huge && !RING_BUF_HUGE_ORDER) {
+        kfree(dev);
+        dev = NULL;
+        return -EOPNOTSUPP;
+    }
+
+    if (!ring_buf_size_valid(ring_size, ring_huge ? RING_BUF_HUGE_ORDER : 0)) {
+        kfree(dev);
+        dev = NULL;
+        return -EINVAL;
+    }
+
+    dev->ring = ring_buf_alloc(ring_size, NUMA_NO_NODE, ring_huge);
 
-    if (!dev->ring)
+    if (!dev->ring) {
+        kfree(dev);
+        dev = NULL;
         return -ENOMEM;
+    }
+
+    ret = ring_buf_set_mode(dev->ring, ring_mode);
+
+    if (ret) {
+        ring_buf_free(dev->ring);
+        kfree(dev);
+        dev = NULL;
+        return ret;
+    }
+
+    mutex_init(&dev->channels_lock);
+    INIT_LIST_HEAD(&dev->channels);
 
     dev->misc_dev.minor = MISC_DYNAMIC_MINOR;
 	dev->misc_dev.name = KMISC_NAME;
@@ -298,6 +2842,11 @@ static int __init init_kmisc_example(void)
     if (ret == 0)
         ret = device_create_file(dev->misc_dev.this_device, &dev->attr);
 
+    // Optional, the device works without it
+    dev->debugfs_dir = debugfs_create_dir(KMISC_NAME, NULL);
+    debugfs_create_file("stats", 0444, dev->debugfs_dir, dev->ring, &ring_buf_stats_fops);
+    dev->channels_dir = debugfs_create_dir("channels", dev->debugfs_dir);
+
     return ret;
 }
 
@@ -305,8 +2854,11 @@ static void __exit exit_kmisc_example(void)
 {
     if (dev) {
         pr_info("Deregistering %s in %s\n", dev->misc_dev.name, __func__);
+        debugfs_remove_recursive(dev->debugfs_dir);
         device_remove_file(dev->misc_dev.this_device, &dev->attr);
         misc_deregister(&dev->misc_dev);
+        // The files hold the module, none can be bound to a channel
+        WARN_ON(!list_empty(&dev->channels));
         ring_buf_free(dev->ring);
         kfree(dev);
         dev = NULL;
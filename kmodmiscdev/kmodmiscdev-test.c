@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -8,6 +9,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <time.h>
 
 #include "kmodmiscdev.h"
 
@@ -15,6 +21,7 @@
     if (!(cond)) \
         { printf("(%d, %d) Assertion failed: '" str_cond "' in %s:%d\n", i, j, __FILE__, __LINE__); abort(); }
 #define ASSERT(cond) ASSERT2(cond, #cond)
+#define WOULD_BLOCK(ret) ((ret) == -1 && errno == EAGAIN)
 
 static const char* data[] = {
     "1",
@@ -27,16 +34,15 @@ static const char* data[] = {
     "88888888"
 };
 
-static char buffer[KMISC_BUF_SIZE*2];
+static char buffer[KMISC_BUF_SIZE*2] __attribute__((aligned(KMISC_RECORD_ALIGN)));
 
 static void test_read_write(void) {
     int fd;
-    size_t bytes_read;
-    size_t bytes_written;
+    ssize_t bytes_read;
 
     int i, j;
 
-    fd = open("/dev/" KMISC_NAME, O_RDWR);
+    fd = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
 
     if (fd == -1) {
         fprintf(stderr, "Couldn't open the file: %#04x\n", errno);
@@ -44,23 +50,25 @@ static void test_read_write(void) {
     }
 
     bytes_read = read(fd, buffer, sizeof buffer);
-    ASSERT(bytes_read >= 0);
+    ASSERT(bytes_read >= 0 || errno == EAGAIN);
+    if (bytes_read == -1)
+        bytes_read = 0;
 
     fprintf(stdout, "Had %ld bytes in the buffer before the test\n", bytes_read);
 
-    ASSERT(read(fd, buffer, KMISC_BUF_SIZE) == 0);
+    ASSERT(WOULD_BLOCK(read(fd, buffer, KMISC_BUF_SIZE)));
     ASSERT(write(fd, buffer, 2*KMISC_BUF_SIZE) == KMISC_BUF_SIZE);
-    ASSERT(write(fd, buffer, 2*KMISC_BUF_SIZE) == 0);
+    ASSERT(WOULD_BLOCK(write(fd, buffer, 2*KMISC_BUF_SIZE)));
     ASSERT(read(fd, buffer, 2*KMISC_BUF_SIZE) == KMISC_BUF_SIZE);
-    ASSERT(read(fd, buffer, KMISC_BUF_SIZE) == 0);
+    ASSERT(WOULD_BLOCK(read(fd, buffer, KMISC_BUF_SIZE)));
 
     for (i = 0; i < 2*KMISC_BUF_SIZE; ++i) {
         for (j = 0; j < sizeof data/sizeof data[0]; ++j) {
-            ASSERT(read(fd, buffer, j + 1) == 0);
+            ASSERT(WOULD_BLOCK(read(fd, buffer, j + 1)));
 
             ASSERT(write(fd, data[j], j + 2) == j + 2);
             ASSERT(write(fd, buffer, KMISC_BUF_SIZE) == KMISC_BUF_SIZE - (j + 2));
-            ASSERT(write(fd, data[j], 1) == 0);
+            ASSERT(WOULD_BLOCK(write(fd, data[j], 1)));
             ASSERT(read(fd, buffer, j + 2) == j + 2);
             ASSERT(strcmp(data[j], buffer) == 0);
             ASSERT(read(fd, buffer, KMISC_BUF_SIZE - (j + 2)) == KMISC_BUF_SIZE - (j + 2));
@@ -73,7 +81,7 @@ static void test_read_write(void) {
             ASSERT(read(fd, buffer, j + 2) == j + 2);
             ASSERT(strcmp(data[j], buffer) == 0);
 
-            ASSERT(read(fd, buffer, 1) == 0);
+            ASSERT(WOULD_BLOCK(read(fd, buffer, 1)));
         }
     }
 
@@ -82,7 +90,968 @@ static void test_read_write(void) {
     close(fd);
 }
 
+static void test_mmap(void) {
+    int fd;
+    long page_size;
+    size_t map_size;
+    unsigned char *map;
+    volatile struct kmisc_ring_ctl *ctl;
+    unsigned char *ring;
+    unsigned long long idx;
+
+    int i, j;
+
+    fd = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
+
+    if (fd == -1) {
+        fprintf(stderr, "Couldn't open the file: %#04x\n", errno);
+        return;
+    }
+
+    page_size = sysconf(_SC_PAGESIZE);
+    map_size = page_size + 2*KMISC_BUF_SIZE;
+
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, KMISC_MMAP_CTL_PGOFF);
+    i = j = 0;
+    ASSERT(map != MAP_FAILED);
+    ASSERT(mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0) == MAP_FAILED);
+
+    ctl = (volatile struct kmisc_ring_ctl *)map;
+    ring = map + KMISC_MMAP_DATA_PGOFF*page_size;
+
+    ASSERT(ctl->size == KMISC_BUF_SIZE);
+
+    // Drain whatever is left, the mapping has to agree with read()
+    while (read(fd, buffer, sizeof buffer) > 0)
+        ;
+    ASSERT(ctl->read_idx == ctl->write_idx);
+
+    for (i = 0; i < 2*KMISC_BUF_SIZE; ++i) {
+        for (j = 0; j < sizeof data/sizeof data[0]; ++j) {
+            // Kernel produces, the mapping consumes
+            ASSERT(write(fd, data[j], j + 2) == j + 2);
+
+            idx = __atomic_load_n(&ctl->read_idx, __ATOMIC_RELAXED);
+            ASSERT(__atomic_load_n(&ctl->write_idx, __ATOMIC_ACQUIRE) - idx == j + 2);
+            ASSERT(memcmp(ring + (idx & (KMISC_BUF_SIZE - 1)), data[j], j + 2) == 0);
+            // The second copy aliases the first one
+            ASSERT(ring[(idx & (KMISC_BUF_SIZE - 1)) + KMISC_BUF_SIZE] == data[j][0]);
+            __atomic_store_n(&ctl->read_idx, idx + j + 2, __ATOMIC_RELEASE);
+
+            // The mapping produces, the kernel consumes
+            idx = __atomic_load_n(&ctl->write_idx, __ATOMIC_RELAXED);
+            memcpy(ring + (idx & (KMISC_BUF_SIZE - 1)), data[j], j + 2);
+            __atomic_store_n(&ctl->write_idx, idx + j + 2, __ATOMIC_RELEASE);
+
+            ASSERT(read(fd, buffer, KMISC_BUF_SIZE) == j + 2);
+            ASSERT(strcmp(data[j], buffer) == 0);
+        }
+    }
+
+    fprintf(stdout, "(%d, %d) Test has passed\n", i, j);
+
+    munmap(map, map_size);
+    close(fd);
+}
+
+static void test_blocking(void) {
+    int fd;
+    pid_t child;
+    int status;
+    struct pollfd pfd;
+
+    int i = 0, j = 0;
+
+    fd = open("/dev/" KMISC_NAME, O_RDWR);
+
+    if (fd == -1) {
+        fprintf(stderr, "Couldn't open the file: %#04x\n", errno);
+        return;
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN | POLLOUT;
+
+    // The previous tests leave the ring empty
+    ASSERT(poll(&pfd, 1, 0) == 1);
+    ASSERT(pfd.revents == POLLOUT);
+
+    for (i = 0; i < sizeof data/sizeof data[0]; ++i) {
+        child = fork();
+        ASSERT(child != -1);
+
+        if (child == 0) {
+            usleep(10000);
+            _exit(write(fd, data[i], i + 2) == i + 2 ? 0 : 1);
+        }
+
+        // Sleeps until the child writes
+        ASSERT(read(fd, buffer, KMISC_BUF_SIZE) == i + 2);
+        ASSERT(strcmp(data[i], buffer) == 0);
+        ASSERT(waitpid(child, &status, 0) == child);
+        ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    // Fill up, the writer has to wait for the reader now
+    ASSERT(write(fd, buffer, KMISC_BUF_SIZE) == KMISC_BUF_SIZE);
+    pfd.events = POLLIN | POLLOUT;
+    ASSERT(poll(&pfd, 1, 0) == 1);
+    ASSERT(pfd.revents == POLLIN);
+
+    child = fork();
+    ASSERT(child != -1);
+
+    if (child == 0) {
+        usleep(10000);
+        _exit(read(fd, buffer, KMISC_BUF_SIZE) == KMISC_BUF_SIZE ? 0 : 1);
+    }
+
+    ASSERT(write(fd, data[0], 2) == 2);
+    ASSERT(waitpid(child, &status, 0) == child);
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    ASSERT(read(fd, buffer, KMISC_BUF_SIZE) == 2);
+
+    // Waits for the data in poll
+    child = fork();
+    ASSERT(child != -1);
+
+    if (child == 0) {
+        usleep(10000);
+        _exit(write(fd, data[0], 2) == 2 ? 0 : 1);
+    }
+
+    pfd.events = POLLIN;
+    ASSERT(poll(&pfd, 1, -1) == 1);
+    ASSERT(pfd.revents == POLLIN);
+    ASSERT(waitpid(child, &status, 0) == child);
+    ASSERT(read(fd, buffer, KMISC_BUF_SIZE) == 2);
+
+    fprintf(stdout, "(%d, %d) Test has passed\n", i, j);
+
+    close(fd);
+}
+
+static void test_records(void) {
+    int fd;
+    ssize_t n;
+    size_t off;
+    size_t count;
+    struct kmisc_record *rec;
+
+    int i = 0, j = 0;
+
+    fd = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
+
+    if (fd == -1) {
+        fprintf(stderr, "Couldn't open the file: %#04x\n", errno);
+        return;
+    }
+
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_FLAGS, KMISC_RING_RECORDS) == 0);
+
+    ASSERT(write(fd, buffer, KMISC_BUF_SIZE) == -1 && errno == EMSGSIZE);
+    ASSERT(WOULD_BLOCK(read(fd, buffer, sizeof buffer)));
+
+    for (i = 0; i < 2*KMISC_BUF_SIZE; ++i) {
+        // A batch of records, then all of them in one read
+        for (j = 0; j < sizeof data/sizeof data[0]; ++j)
+            ASSERT(write(fd, data[j], j + 2) == j + 2);
+
+        n = read(fd, buffer, sizeof buffer);
+        ASSERT(n > 0);
+
+        for (off = 0, j = 0; off < n; off += KMISC_RECORD_SIZE(rec->len), ++j) {
+            rec = (struct kmisc_record *)(buffer + off);
+            ASSERT(rec->len == j + 2);
+            ASSERT(rec->flags == 0);
+            ASSERT(strcmp((char *)rec->data, data[j]) == 0);
+        }
+        ASSERT(off == n);
+        ASSERT(j == sizeof data/sizeof data[0]);
+
+        // Whole records only
+        ASSERT(write(fd, data[7], 9) == 9);
+        ASSERT(write(fd, data[7], 9) == 9);
+        ASSERT(read(fd, buffer, KMISC_RECORD_SIZE(9) - 1) == -1 && errno == EMSGSIZE);
+        ASSERT(read(fd, buffer, 2*KMISC_RECORD_SIZE(9) - 1) == KMISC_RECORD_SIZE(9));
+        ASSERT(read(fd, buffer, 2*KMISC_RECORD_SIZE(9) - 1) == KMISC_RECORD_SIZE(9));
+        ASSERT(WOULD_BLOCK(read(fd, buffer, sizeof buffer)));
+    }
+
+    // Fill up, the last record doesn't get truncated
+    for (count = 0; write(fd, buffer, 100) == 100; ++count)
+        ;
+    ASSERT(errno == EAGAIN);
+    ASSERT(count == KMISC_BUF_SIZE / KMISC_RECORD_SIZE(100));
+    ASSERT(read(fd, buffer, sizeof buffer) == count*KMISC_RECORD_SIZE(100));
+
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_FLAGS, 0) == 0);
+
+    fprintf(stdout, "(%d, %d) Test has passed\n", i, j);
+
+    close(fd);
+}
+
+static void test_iovec(void) {
+    int fd;
+    char header[4] = "hdr";
+    char tail[64];
+    struct iovec iov[3];
+    struct kmisc_record *rec;
+
+    int i = 0, j = 0;
+
+    fd = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
+
+    if (fd == -1) {
+        fprintf(stderr, "Couldn't open the file: %#04x\n", errno);
+        return;
+    }
+
+    for (i = 0; i < 2*KMISC_BUF_SIZE; ++i) {
+        j = i % (sizeof data/sizeof data[0]);
+
+        // Header and payload in one go, back in two pieces
+        iov[0].iov_base = header;
+        iov[0].iov_len = sizeof header;
+        iov[1].iov_base = (void *)data[j];
+        iov[1].iov_len = j + 2;
+        ASSERT(writev(fd, iov, 2) == sizeof header + j + 2);
+
+        iov[0].iov_base = buffer;
+        iov[0].iov_len = 2;
+        iov[1].iov_base = tail;
+        iov[1].iov_len = sizeof tail;
+        ASSERT(readv(fd, iov, 2) == sizeof header + j + 2);
+        ASSERT(memcmp(buffer, header, 2) == 0);
+        ASSERT(memcmp(tail, header + 2, sizeof header - 2) == 0);
+        ASSERT(strcmp(tail + sizeof header - 2, data[j]) == 0);
+    }
+
+    // A writev() is a single record
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_FLAGS, KMISC_RING_RECORDS) == 0);
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof header;
+    iov[1].iov_base = (void *)data[7];
+    iov[1].iov_len = 9;
+    iov[2].iov_base = (void *)data[3];
+    iov[2].iov_len = 5;
+    ASSERT(writev(fd, iov, 3) == sizeof header + 9 + 5);
+    ASSERT(read(fd, buffer, sizeof buffer) == KMISC_RECORD_SIZE(sizeof header + 9 + 5));
+
+    rec = (struct kmisc_record *)buffer;
+    ASSERT(rec->len == sizeof header + 9 + 5);
+    ASSERT(strcmp((char *)rec->data, header) == 0);
+    ASSERT(strcmp((char *)rec->data + sizeof header, data[7]) == 0);
+    ASSERT(strcmp((char *)rec->data + sizeof header + 9, data[3]) == 0);
+
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_FLAGS, 0) == 0);
+
+    // Back in the byte mode, a writev() goes in whole or not at all
+    ASSERT(write(fd, buffer, KMISC_BUF_SIZE - 4) == KMISC_BUF_SIZE - 4);
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof header;
+    iov[1].iov_base = (void *)data[7];
+    iov[1].iov_len = 9;
+    ASSERT(WOULD_BLOCK(writev(fd, iov, 2)));
+    ASSERT(write(fd, data[2], 4) == 4);
+    ASSERT(WOULD_BLOCK(writev(fd, iov, 2)));
+
+    ASSERT(read(fd, buffer, KMISC_BUF_SIZE - 4) == KMISC_BUF_SIZE - 4);
+    ASSERT(read(fd, buffer, sizeof buffer) == 4);
+    ASSERT(strcmp(buffer, data[2]) == 0);
+
+    ASSERT(writev(fd, iov, 2) == sizeof header + 9);
+    ASSERT(read(fd, buffer, sizeof buffer) == sizeof header + 9);
+    ASSERT(strcmp(buffer, header) == 0);
+    ASSERT(strcmp(buffer + sizeof header, data[7]) == 0);
+
+    // Never fits
+    iov[0].iov_base = buffer;
+    iov[0].iov_len = KMISC_BUF_SIZE;
+    ASSERT(writev(fd, iov, 2) == -1 && errno == EMSGSIZE);
+    ASSERT(WOULD_BLOCK(read(fd, buffer, 1)));
+
+    fprintf(stdout, "(%d, %d) Test has passed\n", i, j);
+
+    close(fd);
+}
+
+static void test_splice(void) {
+    int fd;
+    int pipe_fds[2];
+    int file_fd;
+    char file_name[] = "/tmp/kmisc-splice-XXXXXX";
+
+    int i = 0, j = 0;
+
+    fd = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
+
+    if (fd == -1) {
+        fprintf(stderr, "Couldn't open the file: %#04x\n", errno);
+        return;
+    }
+
+    ASSERT(pipe(pipe_fds) == 0);
+
+    for (i = 0; i < 2*KMISC_BUF_SIZE; ++i) {
+        j = i % (sizeof data/sizeof data[0]);
+
+        // Ring to pipe
+        ASSERT(write(fd, data[j], j + 2) == j + 2);
+        ASSERT(splice(fd, NULL, pipe_fds[1], NULL, KMISC_BUF_SIZE, 0) == j + 2);
+        ASSERT(read(pipe_fds[0], buffer, sizeof buffer) == j + 2);
+        ASSERT(strcmp(data[j], buffer) == 0);
+
+        // Pipe to ring
+        ASSERT(write(pipe_fds[1], data[j], j + 2) == j + 2);
+        ASSERT(splice(pipe_fds[0], NULL, fd, NULL, KMISC_BUF_SIZE, 0) == j + 2);
+        ASSERT(read(fd, buffer, sizeof buffer) == j + 2);
+        ASSERT(strcmp(data[j], buffer) == 0);
+    }
+
+    // The whole ring to a file through sendfile()
+    file_fd = mkstemp(file_name);
+    ASSERT(file_fd != -1);
+    unlink(file_name);
+
+    memset(buffer, 0x5a, KMISC_BUF_SIZE);
+    ASSERT(write(fd, buffer, KMISC_BUF_SIZE) == KMISC_BUF_SIZE);
+    ASSERT(sendfile(file_fd, fd, NULL, 2*KMISC_BUF_SIZE) == KMISC_BUF_SIZE);
+    ASSERT(WOULD_BLOCK(read(fd, buffer, 1)));
+    ASSERT(pread(file_fd, buffer + KMISC_BUF_SIZE, KMISC_BUF_SIZE, 0) == KMISC_BUF_SIZE);
+    ASSERT(memcmp(buffer, buffer + KMISC_BUF_SIZE, KMISC_BUF_SIZE) == 0);
+
+    fprintf(stdout, "(%d, %d) Test has passed\n", i, j);
+
+    close(file_fd);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    close(fd);
+}
+
+static void test_overwrite(void) {
+    int fd;
+    unsigned long long dropped_before;
+    unsigned long long dropped;
+    struct kmisc_record *rec;
+    ssize_t n;
+    size_t off;
+
+    int i = 0, j = 0;
+
+    fd = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
+
+    if (fd == -1) {
+        fprintf(stderr, "Couldn't open the file: %#04x\n", errno);
+        return;
+    }
+
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_FLAGS, KMISC_RING_OVERWRITE) == 0);
+    ASSERT(ioctl(fd, KMISC_IOCTL_GET_DROPPED, &dropped_before) == 0);
+
+    // Three rings worth of data, the last one survives
+    for (i = 0; i < 3*KMISC_BUF_SIZE; ++i) {
+        char c = i / KMISC_BUF_SIZE;
+
+        ASSERT(write(fd, &c, 1) == 1);
+    }
+
+    ASSERT(ioctl(fd, KMISC_IOCTL_GET_DROPPED, &dropped) == 0);
+    ASSERT(dropped - dropped_before == 2*KMISC_BUF_SIZE);
+
+    ASSERT(read(fd, buffer, sizeof buffer) == KMISC_BUF_SIZE);
+    for (i = 0; i < KMISC_BUF_SIZE; ++i)
+        ASSERT(buffer[i] == 2);
+    ASSERT(WOULD_BLOCK(read(fd, buffer, 1)));
+
+    // A write bigger than the ring keeps its tail
+    for (i = 0; i < sizeof buffer; ++i)
+        buffer[i] = i / KMISC_BUF_SIZE;
+    ASSERT(write(fd, buffer, sizeof buffer) == sizeof buffer);
+    ASSERT(read(fd, buffer, sizeof buffer) == KMISC_BUF_SIZE);
+    for (i = 0; i < KMISC_BUF_SIZE; ++i)
+        ASSERT(buffer[i] == 1);
+
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_FLAGS, 0) == 0);
+
+    // Whole records are dropped in the record mode
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_FLAGS, KMISC_RING_OVERWRITE | KMISC_RING_RECORDS) == 0);
+
+    for (i = 0; i < 2*KMISC_BUF_SIZE; ++i) {
+        j = i % (sizeof data/sizeof data[0]);
+        ASSERT(write(fd, data[j], j + 2) == j + 2);
+    }
+
+    n = read(fd, buffer, sizeof buffer);
+    ASSERT(n > KMISC_BUF_SIZE - KMISC_RECORD_SIZE(9));
+    ASSERT(n <= KMISC_BUF_SIZE);
+
+    // The newest records, in order, up to the last one written
+    for (off = 0; off < n; off += KMISC_RECORD_SIZE(rec->len)) {
+        rec = (struct kmisc_record *)(buffer + off);
+        j = rec->len - 2;
+        ASSERT(j >= 0 && j < sizeof data/sizeof data[0]);
+        ASSERT(strcmp((char *)rec->data, data[j]) == 0);
+    }
+    ASSERT(off == n);
+    i = (2*KMISC_BUF_SIZE - 1) % (sizeof data/sizeof data[0]);
+    ASSERT(j == i);
+
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_FLAGS, 0) == 0);
+
+    fprintf(stdout, "(%d, %d) Test has passed\n", i, j);
+
+    close(fd);
+}
+
+static void test_broadcast(void) {
+    static char pattern[KMISC_BUF_SIZE + 100];
+    unsigned long long dropped_before;
+    unsigned long long dropped;
+    int fd_w, fd_r1, fd_r2;
+
+    int i = 0, j = 0;
+
+    fd_w = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
+    fd_r1 = open("/dev/" KMISC_NAME, O_RDONLY | O_NONBLOCK);
+    fd_r2 = open("/dev/" KMISC_NAME, O_RDONLY | O_NONBLOCK);
+
+    if (fd_w == -1 || fd_r1 == -1 || fd_r2 == -1) {
+        fprintf(stderr, "Couldn't open the file: %#04x\n", errno);
+        return;
+    }
+
+    for (i = 0; i < sizeof pattern; ++i)
+        pattern[i] = i * 13;
+
+    ASSERT(ioctl(fd_w, KMISC_IOCTL_SET_FLAGS, KMISC_RING_BROADCAST) == 0);
+
+    // The first reads subscribe
+    ASSERT(WOULD_BLOCK(read(fd_r1, buffer, 1)));
+    ASSERT(WOULD_BLOCK(read(fd_r2, buffer, 1)));
+
+    // Every reader gets everything
+    ASSERT(write(fd_w, data[4], 5) == 5);
+    ASSERT(read(fd_r1, buffer, sizeof buffer) == 5);
+    ASSERT(memcmp(buffer, data[4], 5) == 0);
+    ASSERT(read(fd_r2, buffer, sizeof buffer) == 5);
+    ASSERT(memcmp(buffer, data[4], 5) == 0);
+    ASSERT(WOULD_BLOCK(read(fd_r1, buffer, 1)));
+
+    // The slowest reader holds the space
+    ASSERT(write(fd_w, pattern, KMISC_BUF_SIZE) == KMISC_BUF_SIZE);
+    ASSERT(read(fd_r1, buffer, sizeof buffer) == KMISC_BUF_SIZE);
+    ASSERT(memcmp(buffer, pattern, KMISC_BUF_SIZE) == 0);
+    ASSERT(WOULD_BLOCK(write(fd_w, pattern, 1)));
+    ASSERT(read(fd_r2, buffer, 100) == 100);
+    ASSERT(memcmp(buffer, pattern, 100) == 0);
+    ASSERT(write(fd_w, pattern, sizeof pattern) == 100);
+    ASSERT(read(fd_r2, buffer, sizeof buffer) == KMISC_BUF_SIZE);
+    ASSERT(memcmp(buffer, pattern + 100, KMISC_BUF_SIZE - 100) == 0);
+    ASSERT(memcmp(buffer + KMISC_BUF_SIZE - 100, pattern, 100) == 0);
+
+    // Gone with the reader
+    close(fd_r1);
+    fd_r1 = -1;
+    ASSERT(write(fd_w, pattern, sizeof pattern) == KMISC_BUF_SIZE);
+    ASSERT(read(fd_r2, buffer, sizeof buffer) == KMISC_BUF_SIZE);
+
+    // The overwrite mode moves the slow readers forward
+    ASSERT(ioctl(fd_w, KMISC_IOCTL_SET_FLAGS, KMISC_RING_BROADCAST | KMISC_RING_OVERWRITE) == 0);
+    ASSERT(ioctl(fd_w, KMISC_IOCTL_GET_DROPPED, &dropped_before) == 0);
+    fd_r1 = open("/dev/" KMISC_NAME, O_RDONLY | O_NONBLOCK);
+    ASSERT(fd_r1 != -1);
+    ASSERT(WOULD_BLOCK(read(fd_r1, buffer, 1)));
+    ASSERT(WOULD_BLOCK(read(fd_r2, buffer, 1)));
+
+    ASSERT(write(fd_w, pattern, 100) == 100);
+    ASSERT(read(fd_r1, buffer, sizeof buffer) == 100);
+    ASSERT(write(fd_w, pattern, KMISC_BUF_SIZE) == KMISC_BUF_SIZE);
+    ASSERT(ioctl(fd_w, KMISC_IOCTL_GET_DROPPED, &dropped) == 0);
+    ASSERT(dropped - dropped_before == 100);
+
+    ASSERT(read(fd_r1, buffer, sizeof buffer) == KMISC_BUF_SIZE);
+    ASSERT(memcmp(buffer, pattern, KMISC_BUF_SIZE) == 0);
+    ASSERT(read(fd_r2, buffer, sizeof buffer) == KMISC_BUF_SIZE);
+    ASSERT(memcmp(buffer, pattern, KMISC_BUF_SIZE) == 0);
+
+    ASSERT(ioctl(fd_w, KMISC_IOCTL_SET_FLAGS, 0) == 0);
+
+    fprintf(stdout, "(%d, %d) Test has passed\n", i, j);
+
+    close(fd_r2);
+    close(fd_r1);
+    close(fd_w);
+}
+
+static void test_resize(void) {
+    const size_t size = 1 << 20;
+    const size_t chunk = 3000; // Not a divisor of the size to cross the end
+    int fd;
+    long page_size;
+    unsigned char *map;
+    unsigned char *pattern;
+    size_t off;
+
+    int i = 0, j = 0;
+
+    fd = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
+
+    if (fd == -1) {
+        fprintf(stderr, "Couldn't open the file: %#04x\n", errno);
+        return;
+    }
+
+    page_size = sysconf(_SC_PAGESIZE);
+
+    pattern = malloc(size);
+    ASSERT(pattern);
+    for (off = 0; off < size; ++off)
+        pattern[off] = off * 7 + (off >> 8);
+
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_SIZE, size + 1) == -1 && errno == EINVAL);
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_SIZE, size) == 0);
+
+    // The resize keeps the indexes, offset them from the page boundary
+    ASSERT(write(fd, pattern, 5) == 5);
+    ASSERT(read(fd, buffer, 5) == 5);
+
+    for (i = 0; i < 4; ++i) {
+        for (off = 0; off < size; off += j) {
+            j = write(fd, pattern + off, size - off < chunk ? size - off : chunk);
+            ASSERT(j > 0);
+        }
+        ASSERT(WOULD_BLOCK(write(fd, pattern, 1)));
+
+        for (off = 0; off < size; off += j) {
+            j = read(fd, buffer, sizeof buffer);
+            ASSERT(j > 0);
+            ASSERT(memcmp(buffer, pattern + off, j) == 0);
+        }
+        ASSERT(WOULD_BLOCK(read(fd, buffer, 1)));
+    }
+
+    map = mmap(NULL, page_size + 2*size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ASSERT(map != MAP_FAILED);
+    ASSERT(((struct kmisc_ring_ctl *)map)->size == size);
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_SIZE, KMISC_BUF_SIZE) == -1 && errno == EBUSY);
+    munmap(map, page_size + 2*size);
+
+    ASSERT(write(fd, pattern, 1) == 1);
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_SIZE, KMISC_BUF_SIZE) == -1 && errno == EBUSY);
+    ASSERT(read(fd, buffer, 1) == 1);
+
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_SIZE, KMISC_BUF_SIZE) == 0);
+
+    fprintf(stdout, "(%d, %d) Test has passed\n", i, j);
+
+    free(pattern);
+    close(fd);
+}
+
+static void test_huge(void) {
+    const size_t huge_page = 2 << 20;
+    const size_t size = 2*huge_page;
+    const size_t chunk = 3000; // Crosses the huge page boundaries
+    int fd;
+    long page_size;
+    unsigned char *map;
+    volatile struct kmisc_ring_ctl *ctl;
+    unsigned char *pattern;
+    unsigned long long idx;
+    size_t off;
+
+    int i = 0, j = 0;
+
+    fd = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
+
+    if (fd == -1) {
+        fprintf(stderr, "Couldn't open the file: %#04x\n", errno);
+        return;
+    }
+
+    page_size = sysconf(_SC_PAGESIZE);
+
+    pattern = malloc(size);
+    ASSERT(pattern);
+    for (off = 0; off < size; ++off)
+        pattern[off] = off * 13 + (off >> 12);
+
+    // Smaller than a huge page
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_FLAGS, KMISC_RING_HUGE) == -1);
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_SIZE, size) == 0);
+
+    if (ioctl(fd, KMISC_IOCTL_SET_FLAGS, KMISC_RING_HUGE) != 0) {
+        ASSERT(errno == ENOMEM || errno == EOPNOTSUPP);
+        fprintf(stdout, "No huge pages (%#04x), test skipped\n", errno);
+        ASSERT(ioctl(fd, KMISC_IOCTL_SET_SIZE, KMISC_BUF_SIZE) == 0);
+        free(pattern);
+        close(fd);
+        return;
+    }
+
+    // Offset the indexes from the page boundaries
+    ASSERT(write(fd, pattern, 5) == 5);
+    ASSERT(read(fd, buffer, 5) == 5);
+
+    for (i = 0; i < 4; ++i) {
+        for (off = 0; off < size; off += j) {
+            j = write(fd, pattern + off, size - off < chunk ? size - off : chunk);
+            ASSERT(j > 0);
+        }
+        ASSERT(WOULD_BLOCK(write(fd, pattern, 1)));
+
+        for (off = 0; off < size; off += j) {
+            j = read(fd, buffer, sizeof buffer);
+            ASSERT(j > 0);
+            ASSERT(memcmp(buffer, pattern + off, j) == 0);
+        }
+        ASSERT(WOULD_BLOCK(read(fd, buffer, 1)));
+    }
+
+    map = mmap(NULL, page_size + 2*size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, KMISC_MMAP_CTL_PGOFF);
+    ASSERT(map != MAP_FAILED);
+    ctl = (volatile struct kmisc_ring_ctl *)map;
+    ASSERT(ctl->size == size);
+    ASSERT(ctl->flags & KMISC_RING_HUGE);
+    // The data starts on a huge page boundary
+    ASSERT((((unsigned long)map + KMISC_MMAP_DATA_PGOFF*page_size) & (huge_page - 1)) == 0);
+
+    for (off = 0; off < size; off += j) {
+        j = write(fd, pattern + off, size - off < chunk ? size - off : chunk);
+        ASSERT(j > 0);
+    }
+
+    // The whole ring in one piece through the double mapping
+    idx = ctl->read_idx;
+    ASSERT(memcmp(map + KMISC_MMAP_DATA_PGOFF*page_size + (idx & (size - 1)), pattern, size) == 0);
+
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_FLAGS, 0) == -1 && errno == EBUSY);
+
+    for (off = 0; off < size; off += j) {
+        j = read(fd, buffer, sizeof buffer);
+        ASSERT(j > 0);
+    }
+
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_FLAGS, 0) == -1 && errno == EBUSY);
+    munmap(map, page_size + 2*size);
+
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_FLAGS, 0) == 0);
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_SIZE, KMISC_BUF_SIZE) == 0);
+
+    fprintf(stdout, "(%d, %d) Test has passed\n", i, j);
+
+    free(pattern);
+    close(fd);
+}
+
+static unsigned long long read_stat(const char *name) {
+    char text[1024];
+    char *line;
+    FILE *f;
+    size_t len;
+    unsigned long long value = ~0ull;
+
+    f = fopen("/sys/devices/virtual/misc/" KMISC_NAME "/" KMISC_NAME, "r");
+    if (!f)
+        return value;
+
+    len = fread(text, 1, sizeof text - 1, f);
+    text[len] = 0;
+    fclose(f);
+
+    line = strstr(text, name);
+    if (line)
+        sscanf(line + strlen(name), ": %llu", &value);
+
+    return value;
+}
+
+static void test_stats(void) {
+    unsigned long long written, read_bytes, writes, empty;
+    int fd;
+
+    int i = 0, j = 0;
+
+    fd = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
+
+    if (fd == -1) {
+        fprintf(stderr, "Couldn't open the file: %#04x\n", errno);
+        return;
+    }
+
+    written = read_stat("Bytes written");
+    read_bytes = read_stat("Bytes read");
+    writes = read_stat("Writes");
+    empty = read_stat("Empty");
+    ASSERT(written != ~0ull && read_bytes != ~0ull && writes != ~0ull && empty != ~0ull);
+
+    ASSERT(write(fd, data[0], strlen(data[0])) == strlen(data[0]));
+    ASSERT(read_stat("Used") == strlen(data[0]));
+    ASSERT(read_stat("High water") >= strlen(data[0]));
+    ASSERT(read(fd, buffer, sizeof buffer) == strlen(data[0]));
+    ASSERT(WOULD_BLOCK(read(fd, buffer, 1)));
+
+    ASSERT(read_stat("Bytes written") == written + strlen(data[0]));
+    ASSERT(read_stat("Bytes read") == read_bytes + strlen(data[0]));
+    ASSERT(read_stat("Writes") == writes + 1);
+    ASSERT(read_stat("Empty") == empty + 1);
+    ASSERT(read_stat("Used") == 0);
+
+    fprintf(stdout, "(%d, %d) Test has passed\n", i, j);
+
+    close(fd);
+}
+
+static void test_channels(void) {
+    struct kmisc_channel chan;
+    int fd, fd_a1, fd_a2, fd_7, fd_n7;
+
+    int i = 0, j = 0;
+
+    fd = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
+    fd_a1 = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
+    fd_a2 = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
+    fd_7 = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
+    fd_n7 = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
+
+    if (fd == -1 || fd_a1 == -1 || fd_a2 == -1 || fd_7 == -1 || fd_n7 == -1) {
+        fprintf(stderr, "Couldn't open the file: %#04x\n", errno);
+        return;
+    }
+
+    memset(&chan, 0, sizeof chan);
+    strcpy(chan.name, "a/b");
+    ASSERT(ioctl(fd_a1, KMISC_IOCTL_BIND, &chan) == -1 && errno == EINVAL);
+    memset(chan.name, 'a', sizeof chan.name);
+    ASSERT(ioctl(fd_a1, KMISC_IOCTL_BIND, &chan) == -1 && errno == EINVAL);
+
+    memset(&chan, 0, sizeof chan);
+    strcpy(chan.name, "a");
+    ASSERT(ioctl(fd_a1, KMISC_IOCTL_BIND, &chan) == 0);
+    ASSERT(ioctl(fd_a1, KMISC_IOCTL_BIND, &chan) == -1 && errno == EBUSY);
+    ASSERT(ioctl(fd_a2, KMISC_IOCTL_BIND, &chan) == 0);
+
+    // Numbered 7 and named "7" are the same channel
+    memset(&chan, 0, sizeof chan);
+    chan.id = 7;
+    ASSERT(ioctl(fd_7, KMISC_IOCTL_BIND, &chan) == 0);
+    strcpy(chan.name, "7");
+    ASSERT(ioctl(fd_n7, KMISC_IOCTL_BIND, &chan) == 0);
+
+    ASSERT(write(fd_a1, data[0], strlen(data[0])) == strlen(data[0]));
+    ASSERT(write(fd_7, data[1], strlen(data[1])) == strlen(data[1]));
+    ASSERT(write(fd, data[2], strlen(data[2])) == strlen(data[2]));
+
+    ASSERT(read(fd_a2, buffer, sizeof buffer) == strlen(data[0]));
+    ASSERT(memcmp(buffer, data[0], strlen(data[0])) == 0);
+    ASSERT(WOULD_BLOCK(read(fd_a1, buffer, sizeof buffer)));
+
+    ASSERT(read(fd_n7, buffer, sizeof buffer) == strlen(data[1]));
+    ASSERT(memcmp(buffer, data[1], strlen(data[1])) == 0);
+
+    ASSERT(read(fd, buffer, sizeof buffer) == strlen(data[2]));
+    ASSERT(memcmp(buffer, data[2], strlen(data[2])) == 0);
+
+    // The last file gone, the channel starts afresh
+    ASSERT(write(fd_7, data[3], strlen(data[3])) == strlen(data[3]));
+    close(fd_7);
+    close(fd_n7);
+    fd_7 = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
+    ASSERT(fd_7 != -1);
+    memset(&chan, 0, sizeof chan);
+    chan.id = 7;
+    ASSERT(ioctl(fd_7, KMISC_IOCTL_BIND, &chan) == 0);
+    ASSERT(WOULD_BLOCK(read(fd_7, buffer, sizeof buffer)));
+
+    fprintf(stdout, "(%d, %d) Test has passed\n", i, j);
+
+    close(fd_7);
+    close(fd_a2);
+    close(fd_a1);
+    close(fd);
+}
+
+static void test_wakeup(void) {
+    struct kmisc_wakeup wakeup = { .high_watermark = 8, .low_watermark = 1, .timeout_ns = 50000000 };
+    struct pollfd pfd;
+    struct timespec start, end;
+    long elapsed_ms;
+    int fd, fd_w;
+
+    int i = 0, j = 0;
+
+    fd = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
+    fd_w = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
+
+    if (fd == -1 || fd_w == -1) {
+        fprintf(stderr, "Couldn't open the file: %#04x\n", errno);
+        return;
+    }
+
+    ASSERT(ioctl(fd, KMISC_IOCTL_SET_WAKEUP, &wakeup) == 0);
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    // Below the watermark till the timeout
+    ASSERT(write(fd_w, data[0], 1) == 1);
+    ASSERT(poll(&pfd, 1, 0) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ASSERT(poll(&pfd, 1, 1000) == 1 && (pfd.revents & POLLIN));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed_ms = (end.tv_sec - start.tv_sec)*1000 + (end.tv_nsec - start.tv_nsec)/1000000;
+    ASSERT(elapsed_ms >= 20 && elapsed_ms < 1000);
+    ASSERT(read(fd, buffer, sizeof buffer) == 1);
+
+    // At the watermark right away, and the other files don't care
+    ASSERT(write(fd_w, data[7], 8) == 8);
+    ASSERT(poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN));
+    pfd.fd = fd_w;
+    ASSERT(poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN));
+
+    // Writable only once empty
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    ASSERT(poll(&pfd, 1, 0) == 0);
+    ASSERT(read(fd_w, buffer, sizeof buffer) == 8);
+    ASSERT(poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT));
+
+    fprintf(stdout, "(%d, %d) Test has passed\n", i, j);
+
+    close(fd_w);
+    close(fd);
+}
+
+// The drain thread runs on its own, waits for it to write the file out
+static int wait_file(int fd, const char *expected, size_t size) {
+    static char contents[1024];
+    struct stat st;
+    int tries;
+
+    for (tries = 0; tries < 1000; ++tries) {
+        if (fstat(fd, &st) == 0 && st.st_size == (off_t)size &&
+            pread(fd, contents, size, 0) == (ssize_t)size && memcmp(contents, expected, size) == 0)
+            return 1;
+        usleep(5000);
+    }
+
+    return 0;
+}
+
+static void test_drain(void) {
+    char path[2][32] = { "/tmp/kmisc-drain-XXXXXX", "/tmp/kmisc-drain-XXXXXX" };
+    struct kmisc_drain drain = { .count = 2, .rotate_size = 100 };
+    struct kmisc_channel channel = { .id = 1 };
+    char chunk[3][100];
+    int fd, out[2], wronly;
+
+    int i = 0, j = 0;
+
+    fd = open("/dev/" KMISC_NAME, O_RDWR | O_NONBLOCK);
+
+    if (fd == -1) {
+        fprintf(stderr, "Couldn't open the file: %#04x\n", errno);
+        return;
+    }
+
+    for (i = 0; i < 2; ++i) {
+        out[i] = mkstemp(path[i]);
+        ASSERT(out[i] != -1);
+        drain.fds[i] = out[i];
+    }
+    for (i = 0; i < 3; ++i)
+        memset(chunk[i], 'a' + i, sizeof chunk[i]);
+
+    // Only regular files open for writing
+    drain.fds[1] = fd;
+    ASSERT(ioctl(fd, KMISC_IOCTL_DRAIN, &drain) == -1 && errno == EINVAL);
+    drain.fds[1] = out[1];
+
+    // And only from a file that could read the data itself
+    wronly = open("/dev/" KMISC_NAME, O_WRONLY);
+    ASSERT(wronly != -1);
+    ASSERT(ioctl(wronly, KMISC_IOCTL_DRAIN, &drain) == -1 && errno == EBADF);
+    close(wronly);
+
+    ASSERT(ioctl(fd, KMISC_IOCTL_DRAIN, &drain) == 0);
+    ASSERT(ioctl(fd, KMISC_IOCTL_BIND, &channel) == -1 && errno == EBUSY);
+
+    // Each chunk fills a file, the next one rotates
+    ASSERT(write(fd, chunk[0], sizeof chunk[0]) == sizeof chunk[0]);
+    ASSERT(wait_file(out[0], chunk[0], sizeof chunk[0]));
+    ASSERT(write(fd, chunk[1], sizeof chunk[1]) == sizeof chunk[1]);
+    ASSERT(wait_file(out[1], chunk[1], sizeof chunk[1]));
+    ASSERT(write(fd, chunk[2], sizeof chunk[2]) == sizeof chunk[2]);
+    ASSERT(wait_file(out[0], chunk[2], sizeof chunk[2]));
+    ASSERT(wait_file(out[1], chunk[1], sizeof chunk[1]));
+
+    // Stopped, the reads get the data again
+    drain.count = 0;
+    ASSERT(ioctl(fd, KMISC_IOCTL_DRAIN, &drain) == 0);
+    ASSERT(write(fd, chunk[0], 10) == 10);
+    ASSERT(read(fd, buffer, sizeof buffer) == 10);
+
+    fprintf(stdout, "(%d, %d) Test has passed\n", i, j);
+
+    for (i = 0; i < 2; ++i) {
+        close(out[i]);
+        unlink(path[i]);
+    }
+    close(fd);
+}
+
+static int set_mode(int mode) {
+    int fd;
+    int ret;
+
+    fd = open("/dev/" KMISC_NAME, O_RDWR);
+
+    if (fd == -1) {
+        fprintf(stderr, "Couldn't open the file: %#04x\n", errno);
+        return -1;
+    }
+
+    ret = ioctl(fd, KMISC_IOCTL_SET_MODE, mode);
+    if (ret != 0)
+        fprintf(stderr, "Couldn't set mode %d: %#04x\n", mode, errno);
+
+    close(fd);
+
+    return ret;
+}
+
 int main() { 
-    test_read_write();
+    static const int modes[] = { KMISC_MODE_LOCKED, KMISC_MODE_SPSC, KMISC_MODE_MPMC };
+    int m;
+
+    for (m = 0; m < sizeof modes/sizeof modes[0]; ++m) {
+        if (set_mode(modes[m]) != 0)
+            return 1;
+
+        fprintf(stdout, "Mode %d\n", modes[m]);
+        test_read_write();
+        test_blocking();
+        test_records();
+        test_iovec();
+        test_splice();
+        test_overwrite();
+        test_broadcast();
+    }
+
+    // The user space doesn't take part in the MPMC reservations
+    if (set_mode(KMISC_MODE_LOCKED) != 0)
+        return 1;
+
+    test_mmap();
+    test_resize();
+    test_huge();
+    test_stats();
+    test_channels();
+    test_wakeup();
+    test_drain();
     return 0;
 }
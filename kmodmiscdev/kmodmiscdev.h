@@ -1,8 +1,199 @@
 #ifndef __kmod_miscdev__
 #define __kmod_miscdev__
 
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
 #define KMISC_NAME              "kmisc"
-#define KMISC_BUF_SIZE          4096
+#define KMISC_BUF_SIZE          4096 // Default, see the ring_size parameter
+#define KMISC_MAX_BUF_SIZE      (1ul << 30)
 #define KMISC_MAX_NAME_LEN      256
 
+#define KMISC_IOCTL_BASE        'M'
+// Wakes up the blocked readers and writers after moving
+// the indexes through the mapping
+#define KMISC_IOCTL_KICK        _IO(KMISC_IOCTL_BASE, 0)
+// Switches an empty and idle ring to the KMISC_MODE_* passed
+// as the argument, -EBUSY otherwise
+#define KMISC_IOCTL_SET_MODE    _IO(KMISC_IOCTL_BASE, 1)
+// Reallocates an empty, idle and unmapped ring with the size in
+// bytes passed as the argument: a power of 2 between a page and
+// KMISC_MAX_BUF_SIZE. The sysfs attribute does the same.
+#define KMISC_IOCTL_SET_SIZE    _IO(KMISC_IOCTL_BASE, 2)
+// Sets the KMISC_RING_* flags passed as the argument on an empty
+// and idle ring, -EBUSY otherwise
+#define KMISC_IOCTL_SET_FLAGS   _IO(KMISC_IOCTL_BASE, 3)
+// Bytes lost to the overwrite mode or dropped by the in-kernel
+// producers on a full ring since the ring was created
+#define KMISC_IOCTL_GET_DROPPED _IOR(KMISC_IOCTL_BASE, 4, __u64)
+// Binds the file to the channel described by struct kmisc_channel,
+// creating it on first use. The reads, writes, mappings and the other
+// ioctls then go to the ring of the channel instead of the default one.
+// A file is bound at most once, -EBUSY afterwards. A channel lives as
+// long as some file is bound to it.
+#define KMISC_IOCTL_BIND        _IOW(KMISC_IOCTL_BASE, 5, struct kmisc_channel)
+// Sets the wakeup conditions of the file from struct kmisc_wakeup
+#define KMISC_IOCTL_SET_WAKEUP  _IOW(KMISC_IOCTL_BASE, 6, struct kmisc_wakeup)
+// Starts a kernel thread reading the ring through the file and writing
+// it out to the files in struct kmisc_drain, replacing the one already
+// running for the file if any. count 0 only stops it. The thread goes
+// away with the file, and the file can't be bound while it runs. The
+// file has to be open for reading, EBADF otherwise.
+#define KMISC_IOCTL_DRAIN       _IOW(KMISC_IOCTL_BASE, 7, struct kmisc_drain)
+
+// Locks around the reader and the writer side
+#define KMISC_MODE_LOCKED       0
+// No locks, at most one reader and one writer at a time
+#define KMISC_MODE_SPSC         1
+// No locks, readers and writers reserve with cmpxchg on the
+// heads and commit to the indexes in reservation order
+#define KMISC_MODE_MPMC         2
+// Not set directly, KMISC_RING_OVERWRITE overrides the mode
+#define KMISC_MODE_OVERWRITE    3
+
+// Every write() is committed as one record or not at all, read()
+// returns as many whole records as fit into the buffer, each one as
+// struct kmisc_record followed by the payload and padded up to
+// KMISC_RECORD_ALIGN. A record bigger than the read buffer fails the
+// read with EMSGSIZE, one bigger than the ring fails the write.
+// Without it, a write() puts in as much as fits and a writev() of
+// several segments all of it or nothing, waiting for the room like a
+// record does.
+#define KMISC_RING_RECORDS      0x1
+// Flight recorder: the writers never wait or truncate, they drop
+// the oldest data (whole records in the record mode) instead and
+// count it, see KMISC_IOCTL_GET_DROPPED. Works the same in any mode,
+// the user mappings may only consume with a compare-and-swap on
+// read_idx after checking that read_idx didn't move while copying.
+#define KMISC_RING_OVERWRITE    0x2
+// Fan-out: every file reading the ring gets all of the data through
+// a cursor of its own, set to the oldest data still in the ring on
+// the first read. read_idx follows the slowest cursor, so the writers
+// wait for the slowest reader or, with KMISC_RING_OVERWRITE, push the
+// readers falling behind forward. The data is stored once whatever
+// the number of readers. The user mappings may produce but must not
+// move read_idx.
+#define KMISC_RING_BROADCAST    0x4
+// Backs the data with 2 MiB (PMD sized) pages to cut the TLB misses
+// on big rings, the ring has to be at least that big. Setting or
+// clearing it reallocates, so the ring must be empty and not mapped;
+// ENOMEM if there are not enough huge pages to be had, EOPNOTSUPP
+// without CONFIG_TRANSPARENT_HUGEPAGE. The data of the user mappings
+// is then PMD aligned, and mapped with PMDs where the kernel can.
+#define KMISC_RING_HUGE         0x8
+#define KMISC_RING_FLAGS        (KMISC_RING_RECORDS | KMISC_RING_OVERWRITE | KMISC_RING_BROADCAST | \
+                                 KMISC_RING_HUGE)
+
+#define KMISC_CACHELINE_SIZE    64
+
+struct kmisc_record {
+    __u32 len; // Of the payload
+    __u32 flags; // KMISC_RECORD_*
+    __u8  data[];
+};
+
+// Space left by a faulted writer, never returned by read()
+#define KMISC_RECORD_PAD        0x1
+// Reserved by an in-kernel producer and not committed yet, never
+// found below write_idx
+#define KMISC_RECORD_BUSY       0x2
+
+#define KMISC_RECORD_ALIGN      8
+#define KMISC_RECORD_SIZE(len) \
+    (((len) + sizeof(struct kmisc_record) + KMISC_RECORD_ALIGN - 1) & ~(KMISC_RECORD_ALIGN - 1))
+
+#define KMISC_CHANNEL_NAME_LEN  32
+
+// A channel is named by a NUL-terminated string without '/' or, when
+// the name is empty, numbered by id: the numbered channel 7 is the
+// same as the one named "7". A new channel gets its ring allocated
+// on the NUMA node of the calling CPU, with the size and the mode
+// from the module parameters.
+struct kmisc_channel {
+    __u32 id;
+    __u32 reserved; // Must be 0
+    char  name[KMISC_CHANNEL_NAME_LEN];
+};
+
+// Coalesces the wakeups of a file blocked in read() or write() or
+// waiting in poll(): a reader is woken up and sees EPOLLIN only once
+// high_watermark bytes are buffered, the ring is full or timeout_ns
+// has passed since the data arrived. A writer is woken up and sees
+// EPOLLOUT only once fewer than low_watermark bytes are buffered.
+// Zeros, the default, wake up on any data, on any space and never
+// time out. Non-blocking reads and writes are not affected.
+struct kmisc_wakeup {
+    __u64 high_watermark;
+    __u64 low_watermark;
+    __u64 timeout_ns;
+};
+
+#define KMISC_DRAIN_FILES       8
+
+// The files to drain to, regular ones open for writing. The data is
+// appended to fds[0] until it would grow over rotate_size bytes, then
+// fds[1] is truncated and written from the start and so on, wrapping
+// around to fds[0] after fds[count - 1]. rotate_size 0 never rotates.
+// The reads take whole records in the record mode, the batches are
+// driven by the wakeup conditions of the file, see struct kmisc_wakeup.
+struct kmisc_drain {
+    __s32 fds[KMISC_DRAIN_FILES];
+    __u32 count;
+    __u32 reserved; // Must be 0
+    __u64 rotate_size;
+};
+
+// Layout of mmap() on /dev/kmisc, in pages: the control page comes
+// first, then the data pages mapped twice back to back so that any
+// chunk up to the ring size is contiguous in the address space.
+// The mapping must be MAP_SHARED and cover all of it.
+#define KMISC_MMAP_CTL_PGOFF    0
+#define KMISC_MMAP_DATA_PGOFF   1
+
+// The control page. The indexes are free running byte counters,
+// the position in the ring is idx & (size - 1). The producer owns
+// write_idx, the consumer owns read_idx; publish with a store-release
+// after touching the data, load the other side with a load-acquire.
+// In the MPMC mode the heads are advanced with a compare-and-swap
+// first and the indexes follow in the same order. The consumer and
+// the producer sides live on separate cache lines.
+struct kmisc_ring_ctl {
+    __u64 read_idx;
+    __u64 read_head;
+    __u8  __pad0[KMISC_CACHELINE_SIZE - 2*sizeof(__u64)];
+    __u64 write_idx;
+    __u64 write_head;
+    __u8  __pad1[KMISC_CACHELINE_SIZE - 2*sizeof(__u64)];
+    __u64 size;
+    __u32 mode;
+    __u32 flags;
+};
+
+#ifdef __KERNEL__
+
+// In-kernel producers stream records to a channel, the user space
+// binds to the same channel to read them. The ring is switched to
+// the record mode, writing to it from the user space fails with EPERM
+// and so do the ioctls changing its configuration while there are
+// producers attached.
+//
+// kmisc_producer_open() and kmisc_producer_close() may sleep. The rest
+// is fine in any context including NMI and never waits: the payload goes
+// straight into the ring between kmisc_reserve() and kmisc_commit() or
+// kmisc_discard(), a full ring makes kmisc_reserve() return NULL and
+// the record is counted as dropped. Every reservation must be committed
+// or discarded, the records behind it are held up till then. The user
+// mappings may only consume then: a mapping storing to write_idx gets
+// the records committed after that counted as dropped.
+
+struct kmisc_producer;
+
+struct kmisc_producer *kmisc_producer_open(const char *channel);
+void kmisc_producer_close(struct kmisc_producer *producer);
+void *kmisc_reserve(struct kmisc_producer *producer, size_t len);
+void kmisc_commit(struct kmisc_producer *producer, void *data);
+void kmisc_discard(struct kmisc_producer *producer, void *data);
+
+#endif
+
 #endif